@@ -1,14 +1,24 @@
 #include "FormulaAST.h"
 
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -67,17 +77,52 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Shared by the tree walker and the bytecode interpreter. A non-finite
+// result means #ARITHM!, the callers check it.
+inline double ApplyBinaryOp(Instruction::Op op, double lhs, double rhs) {
+    switch (op) {
+    case Instruction::Add:
+        return lhs + rhs;
+    case Instruction::Subtract:
+        return lhs - rhs;
+    case Instruction::Multiply:
+        return lhs * rhs;
+    case Instruction::Divide:
+        return lhs / rhs;
+    default:
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+inline Position Shift(Position pos, Position shift) {
+    return {pos.row + shift.row, pos.col + shift.col};
+}
+
+inline Range Shift(Range range, Position shift) {
+    return {Shift(range.first, shift), Shift(range.last, shift)};
+}
+
+// Nodes are allocated in the arena of their FormulaAST and are never deleted
+// one by one, so they hold no owning pointers and have trivial destructors
 class Expr {
 public:
-    virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<double(Position)> func) const = 0;
+    // `shift` moves every reference, see FormulaAST::PrintFormula
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const = 0;
+    virtual ExecResult Evaluate(const std::function<ExecResult(Position)>& func,
+                                const RangeReader& read_range) const = 0;
+    // Appends the postfix code of the subtree
+    virtual void Compile(std::vector<Instruction>& code) const = 0;
+    virtual void Serialize(std::vector<SerializedNode>& nodes, Position shift) const = 0;
+    // Only range arguments of functions have one
+    virtual const Range* GetRange() const {
+        return nullptr;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position shift,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,12 +131,234 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, shift);
 
         if (parens_needed) {
             out << ')';
         }
     }
+
+protected:
+    ~Expr() = default;
+};
+
+enum class Function : char {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+namespace {
+constexpr std::array<std::string_view, 5> FUNCTION_NAMES = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (size_t i = 0; i < FUNCTION_NAMES.size(); ++i) {
+        if (FUNCTION_NAMES[i] == name) {
+            return static_cast<Function>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+// The reductions keep four independent accumulators, which lets the compiler
+// vectorize them without reordering a single chain of additions
+double SumKernel(const double* data, size_t size) {
+    double acc[4] = {0.0, 0.0, 0.0, 0.0};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        acc[0] += data[i];
+        acc[1] += data[i + 1];
+        acc[2] += data[i + 2];
+        acc[3] += data[i + 3];
+    }
+    double sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < size; ++i) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// `size` must be positive
+template <typename Less>
+double MinKernel(const double* data, size_t size, Less less) {
+    double acc[4] = {data[0], data[0], data[0], data[0]};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        for (size_t lane = 0; lane < 4; ++lane) {
+            acc[lane] = less(data[i + lane], acc[lane]) ? data[i + lane] : acc[lane];
+        }
+    }
+    for (; i < size; ++i) {
+        acc[0] = less(data[i], acc[0]) ? data[i] : acc[0];
+    }
+    double result = acc[0];
+    for (size_t lane = 1; lane < 4; ++lane) {
+        result = less(acc[lane], result) ? acc[lane] : result;
+    }
+    return result;
+}
+
+// The fallback for callers without a RangeReader: every cell is read through
+// `func`, so an empty cell is just a zero
+std::optional<FormulaError> ReadRangeByCells(Range range, const std::function<ExecResult(Position)>& func,
+                                             std::vector<double>& values) {
+    std::optional<FormulaError> error;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            ExecResult value = func({row, col});
+            if (const double* number = std::get_if<double>(&value)) {
+                values.push_back(*number);
+            } else if (!error) {
+                error = std::get<FormulaError>(value);
+            }
+        }
+    }
+    return error;
+}
+}  // namespace
+
+// Aggregate function call. Scalar arguments are ordinary expressions, range
+// arguments are read in one go when the function is applied.
+class CallExpr final : public Expr {
+public:
+    CallExpr(Function function, ArenaArray<const Expr* const> args)
+        : function_(function)
+        , args_(args) {
+        for (const Expr* arg : args_) {
+            scalar_count_ += arg->GetRange() == nullptr;
+        }
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << FUNCTION_NAMES[static_cast<size_t>(function_)];
+        for (const Expr* arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        out << FUNCTION_NAMES[static_cast<size_t>(function_)] << '(';
+        bool first = true;
+        for (const Expr* arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM, shift);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    ExecResult Evaluate(const std::function<ExecResult(Position)>& func,
+                        const RangeReader& read_range) const override {
+        std::vector<double> scalars;
+        for (const Expr* arg : args_) {
+            if (arg->GetRange()) {
+                continue;
+            }
+            ExecResult value = arg->Evaluate(func, read_range);
+            if (std::holds_alternative<double>(value)) {
+                scalars.push_back(std::get<double>(value));
+            }
+            // COUNT skips an erroneous argument the same as an erroneous cell of a range
+            else if (function_ != Function::Count) {
+                return value;
+            }
+        }
+        return Apply(scalars.data(), scalars.size(), func, read_range);
+    }
+
+    void Compile(std::vector<Instruction>& code) const override {
+        // the program stops at the first error, so such arguments stay with the tree
+        if (function_ == Function::Count && scalar_count_ > 0) {
+            code.emplace_back(Instruction::EvaluateCall, this);
+            return;
+        }
+        for (const Expr* arg : args_) {
+            arg->Compile(code);
+        }
+        code.emplace_back(Instruction::Call, this);
+    }
+
+    void Serialize(std::vector<SerializedNode>& nodes, Position shift) const override {
+        for (const Expr* arg : args_) {
+            arg->Serialize(nodes, shift);
+        }
+        SerializedNode node{SerializedNode::Call, static_cast<uint8_t>(function_),
+                            static_cast<uint32_t>(args_.size()), {}};
+        nodes.push_back(node);
+    }
+
+    size_t GetScalarCount() const {
+        return scalar_count_;
+    }
+
+    bool HasRanges() const {
+        return scalar_count_ < args_.size();
+    }
+
+    // Reads the ranges and reduces them together with the values of the
+    // scalar arguments; COUNT may get fewer of them than there are
+    ExecResult Apply(const double* scalars, size_t scalar_count, const std::function<ExecResult(Position)>& func,
+                     const RangeReader& read_range) const {
+        // nested evaluations started by the reads push after our values and
+        // truncate back to where they started, so the buffer works as a stack
+        thread_local std::vector<double> values;
+        size_t start = values.size();
+        std::optional<FormulaError> error;
+        for (const Expr* arg : args_) {
+            if (const Range* range = arg->GetRange()) {
+                auto range_error = read_range ? read_range(*range, values) : ReadRangeByCells(*range, func, values);
+                if (!error) {
+                    error = range_error;
+                }
+            }
+        }
+        values.insert(values.end(), scalars, scalars + scalar_count);
+        const double* data = values.data() + start;
+        size_t count = values.size() - start;
+
+        ExecResult result = 0.0;
+        if (error && function_ != Function::Count) {
+            result = *error;
+        } else {
+            switch (function_) {
+                case Function::Sum:
+                    result = SumKernel(data, count);
+                    break;
+                case Function::Average:
+                    result = count == 0 ? std::numeric_limits<double>::quiet_NaN() : SumKernel(data, count) / count;
+                    break;
+                case Function::Min:
+                    result = count == 0 ? 0.0 : MinKernel(data, count, std::less<double>());
+                    break;
+                case Function::Max:
+                    result = count == 0 ? 0.0 : MinKernel(data, count, std::greater<double>());
+                    break;
+                case Function::Count:
+                    result = static_cast<double>(count);
+                    break;
+            }
+            if (!std::isfinite(std::get<double>(result))) {
+                result = FormulaError(FormulaError::Category::Arithmetic);
+            }
+        }
+        values.resize(start);
+        return result;
+    }
+
+private:
+    Function function_;
+    ArenaArray<const Expr* const> args_;
+    size_t scalar_count_ = 0;
 };
 
 namespace {
@@ -105,10 +372,10 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
     void Print(std::ostream& out) const override {
@@ -119,10 +386,10 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const override {
+        lhs_->PrintFormula(out, precedence, shift);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, shift, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -144,38 +411,55 @@ public:
 
 // Реализуйте метод Evaluate() для бинарных операций.
 // При делении на 0 выбрасывайте ошибку вычисления FormulaError
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
-        double lhs_value = lhs_->Evaluate(func);
-        double rhs_value = rhs_->Evaluate(func);
-        double result = 0.0;
-        switch (type_) {
-        case Add:
-            result = lhs_value + rhs_value;
-            break;
-        case Subtract:
-            result = lhs_value - rhs_value;
-            break;
-        case Multiply:
-            result =  lhs_value * rhs_value;
-            break;
-        case Divide:
-            result = lhs_value / rhs_value;
-            break;
-        default:
-            throw FormulaError(FormulaError::Category::Arithmetic);
+    ExecResult Evaluate(const std::function<ExecResult(Position)>& func,
+                        const RangeReader& read_range) const override {
+        ExecResult lhs_value = lhs_->Evaluate(func, read_range);
+        if (!std::holds_alternative<double>(lhs_value)) {
+            return lhs_value;
         }
-
+        ExecResult rhs_value = rhs_->Evaluate(func, read_range);
+        if (!std::holds_alternative<double>(rhs_value)) {
+            return rhs_value;
+        }
+        double result = ApplyBinaryOp(static_cast<Instruction::Op>(type_), std::get<double>(lhs_value),
+                                      std::get<double>(rhs_value));
         if (!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
+            return FormulaError(FormulaError::Category::Arithmetic);
         }
-
         return result;
     }
 
+    void Compile(std::vector<Instruction>& code) const override {
+        lhs_->Compile(code);
+        rhs_->Compile(code);
+        code.emplace_back(static_cast<Instruction::Op>(type_));
+    }
+
+    void Serialize(std::vector<SerializedNode>& nodes, Position shift) const override {
+        lhs_->Serialize(nodes, shift);
+        rhs_->Serialize(nodes, shift);
+        SerializedNode node{};
+        switch (type_) {
+            case Add:
+                node.kind = SerializedNode::Add;
+                break;
+            case Subtract:
+                node.kind = SerializedNode::Subtract;
+                break;
+            case Multiply:
+                node.kind = SerializedNode::Multiply;
+                break;
+            case Divide:
+                node.kind = SerializedNode::Divide;
+                break;
+        }
+        nodes.push_back(node);
+    }
+
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -186,9 +470,9 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
     void Print(std::ostream& out) const override {
@@ -197,9 +481,9 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, shift);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -207,20 +491,33 @@ public:
     }
 
 // Реализуйте метод Evaluate() для унарных операций.
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
-        switch (type_) {
-        case UnaryPlus:
-            return operand_->Evaluate(func);
-        case UnaryMinus:
-            return -operand_->Evaluate(func);
+    ExecResult Evaluate(const std::function<ExecResult(Position)>& func,
+                        const RangeReader& read_range) const override {
+        ExecResult value = operand_->Evaluate(func, read_range);
+        if (type_ == UnaryMinus && std::holds_alternative<double>(value)) {
+            return -std::get<double>(value);
         }
-        return static_cast<double>(INT_MAX);
+        return value;
+    }
+
+    void Compile(std::vector<Instruction>& code) const override {
+        operand_->Compile(code);
+        // unary plus is a no-op
+        if (type_ == UnaryMinus) {
+            code.emplace_back(Instruction::Negate);
+        }
+    }
 
+    void Serialize(std::vector<SerializedNode>& nodes, Position shift) const override {
+        operand_->Serialize(nodes, shift);
+        SerializedNode node{};
+        node.kind = type_ == UnaryMinus ? SerializedNode::UnaryMinus : SerializedNode::UnaryPlus;
+        nodes.push_back(node);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
 class NumberExpr final : public Expr {
@@ -233,7 +530,7 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* shift */) const override {
         out << value_;
     }
 
@@ -242,66 +539,776 @@ public:
     }
 
 // Для чисел метод возвращает значение числа.
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
+    ExecResult Evaluate([[maybe_unused]] const std::function<ExecResult(Position)>& func,
+                        [[maybe_unused]] const RangeReader& read_range) const override {
         return value_;
     }
 
+    void Compile(std::vector<Instruction>& code) const override {
+        code.emplace_back(Instruction::PushNumber, value_);
+    }
+
+    void Serialize(std::vector<SerializedNode>& nodes, Position /* shift */) const override {
+        SerializedNode node{};
+        node.kind = SerializedNode::Number;
+        node.number = value_;
+        nodes.push_back(node);
+    }
+
 private:
     double value_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* pos)
+    explicit CellExpr(Position pos)
         : value_(pos) {
     }
 
     void Print(std::ostream& out) const override {
-        if (!value_->IsValid()) {
+        DoPrintFormula(out, EP_ATOM, {0, 0});
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        Position pos = Shift(value_, shift);
+        if (!pos.IsValid()) {
             out << FormulaError::Category::Ref;
         }
         else {
-            out << value_->ToString();
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.write(buffer, pos.ToChars(buffer) - buffer);
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // Для чисел метод возвращает значение числа.
+    ExecResult Evaluate(const std::function<ExecResult(Position)>& func,
+                        [[maybe_unused]] const RangeReader& read_range) const override {
+        return func(value_);
+    }
+
+    void Compile(std::vector<Instruction>& code) const override {
+        code.emplace_back(Instruction::LoadCell, value_);
+    }
+
+    void Serialize(std::vector<SerializedNode>& nodes, Position shift) const override {
+        Position pos = Shift(value_, shift);
+        SerializedNode node{};
+        node.kind = SerializedNode::Cell;
+        node.coords[0] = static_cast<int16_t>(pos.row);
+        node.coords[1] = static_cast<int16_t>(pos.col);
+        nodes.push_back(node);
+    }
+
+private:
+    Position value_;
+};
+
+// A range argument of a function; CallExpr reads it, so it has no code
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(Range range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_.ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        out << Shift(range_, shift).ToString();
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    // Для чисел метод возвращает значение числа.
-    double Evaluate(std::function<double(Position)> func) const override {
-        return func(*value_);
+    ExecResult Evaluate([[maybe_unused]] const std::function<ExecResult(Position)>& func,
+                        [[maybe_unused]] const RangeReader& read_range) const override {
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    void Compile([[maybe_unused]] std::vector<Instruction>& code) const override {
+    }
+
+    void Serialize(std::vector<SerializedNode>& nodes, Position shift) const override {
+        Range range = Shift(range_, shift);
+        SerializedNode node{};
+        node.kind = SerializedNode::Range;
+        node.coords[0] = static_cast<int16_t>(range.first.row);
+        node.coords[1] = static_cast<int16_t>(range.first.col);
+        node.coords[2] = static_cast<int16_t>(range.last.row);
+        node.coords[3] = static_cast<int16_t>(range.last.col);
+        nodes.push_back(node);
+    }
+
+    const Range* GetRange() const override {
+        return &range_;
     }
 
 private:
-    const Position* value_;
+    Range range_;
 };
 
+// Rewrites the compiled code of a tree into the code that is run. Only the
+// rewrites that give bit-identical results are done:
+// - operations on constants are folded if the result is finite, so a
+//   constant #ARITHM! is still reported when the formula runs;
+// - x*1, 1*x, x/1 and x-0 become x when x is known to be finite: a cell may
+//   hold "inf", and inf*1 is #ARITHM!; x+0 stays, -0+0 is +0;
+// - negations cancel: --x, x-(-y), x+(-y), (-x)*(-y) and (-x)/(-y) lose
+//   both negations or turn the operation around.
+// Constants can't fail and no cell load is dropped, so the errors come from
+// the same cells in the same order as without the rewrites.
+void OptimizeCode(std::vector<Instruction>& code) {
+    struct Operand {
+        // where the code of the operand starts in `out`
+        size_t start;
+        // a constant or the checked result of an operation
+        bool finite;
+    };
+    thread_local std::vector<Instruction> out;
+    thread_local std::vector<Operand> operands;
+    out.clear();
+    operands.clear();
+    // whether the code [start, end) is a single constant
+    auto is_constant = [](size_t start, size_t end) {
+        return end == start + 1 && out[start].op == Instruction::PushNumber;
+    };
+
+    for (const Instruction& instruction : code) {
+        switch (instruction.op) {
+        case Instruction::PushNumber:
+            operands.push_back({out.size(), std::isfinite(instruction.number)});
+            out.push_back(instruction);
+            break;
+        case Instruction::LoadCell:
+            operands.push_back({out.size(), false});
+            out.push_back(instruction);
+            break;
+        case Instruction::EvaluateCall:
+            // a count is finite, but it isn't folded: its arguments may read cells
+            operands.push_back({out.size(), true});
+            out.push_back(instruction);
+            break;
+        case Instruction::Negate:
+            if (is_constant(operands.back().start, out.size())) {
+                out.back().number = -out.back().number;
+            }
+            else if (out.back().op == Instruction::Negate) {
+                out.pop_back();
+            }
+            else {
+                out.push_back(instruction);
+            }
+            break;
+        case Instruction::Call: {
+            const CallExpr* call = instruction.call;
+            size_t start = out.size();
+            if (size_t count = call->GetScalarCount()) {
+                start = operands[operands.size() - count].start;
+                operands.resize(operands.size() - count);
+            }
+            operands.push_back({start, true});
+            bool constant = !call->HasRanges() &&
+                            std::all_of(out.begin() + start, out.end(), [](const Instruction& argument) {
+                                return argument.op == Instruction::PushNumber;
+                            });
+            if (constant) {
+                thread_local std::vector<double> scalars;
+                scalars.clear();
+                for (auto it = out.begin() + start; it != out.end(); ++it) {
+                    scalars.push_back(it->number);
+                }
+                ExecResult value = call->Apply(scalars.data(), scalars.size(), {}, {});
+                if (const double* number = std::get_if<double>(&value)) {
+                    out.erase(out.begin() + start, out.end());
+                    out.emplace_back(Instruction::PushNumber, *number);
+                    break;
+                }
+            }
+            out.push_back(instruction);
+            break;
+        }
+        default: {
+            Instruction::Op op = instruction.op;
+            Operand rhs = operands.back();
+            operands.pop_back();
+            Operand& lhs = operands.back();
+            bool lhs_constant = is_constant(lhs.start, rhs.start);
+            bool rhs_constant = is_constant(rhs.start, out.size());
+            double lhs_number = lhs_constant ? out[lhs.start].number : 0.0;
+            double rhs_number = rhs_constant ? out[rhs.start].number : 0.0;
+            bool lhs_finite = lhs.finite;
+            lhs.finite = true;
+            if (lhs_constant && rhs_constant) {
+                double result = ApplyBinaryOp(op, lhs_number, rhs_number);
+                if (std::isfinite(result)) {
+                    out.erase(out.begin() + lhs.start, out.end());
+                    out.emplace_back(Instruction::PushNumber, result);
+                    break;
+                }
+            }
+            else if (rhs_constant && lhs_finite &&
+                     ((rhs_number == 1.0 && (op == Instruction::Multiply || op == Instruction::Divide)) ||
+                      (rhs_number == 0.0 && !std::signbit(rhs_number) && op == Instruction::Subtract))) {
+                out.erase(out.begin() + rhs.start, out.end());
+                break;
+            }
+            else if (lhs_constant && rhs.finite && lhs_number == 1.0 && op == Instruction::Multiply) {
+                out.erase(out.begin() + lhs.start);
+                break;
+            }
+            else if (out.back().op == Instruction::Negate) {
+                if (op == Instruction::Add || op == Instruction::Subtract) {
+                    out.pop_back();
+                    op = op == Instruction::Add ? Instruction::Subtract : Instruction::Add;
+                }
+                else if (out[rhs.start - 1].op == Instruction::Negate) {
+                    out.pop_back();
+                    out.erase(out.begin() + (rhs.start - 1));
+                }
+            }
+            out.emplace_back(op);
+            break;
+        }
+        }
+    }
+    code.swap(out);
+}
 
+// Both ends must be valid positions; the corners may be given in any order
+Range MakeRange(std::string_view first_text, std::string_view last_text) {
+    Position first = Position::FromString(first_text);
+    Position last = Position::FromString(last_text);
+    if (!first.IsValid() || !last.IsValid()) {
+        throw FormulaException("Invalid range: " + std::string(first_text) + ":" + std::string(last_text));
+    }
+    return {{std::min(first.row, last.row), std::min(first.col, last.col)},
+            {std::max(first.row, last.row), std::max(first.col, last.col)}};
+}
+
+// Tokens of Formula.g4, lexed one at a time; the token is a view into the input
+class FormulaLexer {
+public:
+    explicit FormulaLexer(std::string_view input)
+        : input_(input) {
+    }
+
+    // Appends the input with every cell replaced by its offset from `anchor`,
+    // R[-1]C[0] for the cell above it. A reference is the only thing that
+    // differs between formulas copied along a column, so they get one key.
+    // The brackets can't be lexed, so no formula text is another one's key.
+    // Returns false for an invalid cell; throws ParsingError when lexing fails.
+    bool AppendRelativeKey(Position anchor, std::string& key) {
+        size_t copied = 0;
+        for (Advance(); token_.type != TokenType::End; Advance()) {
+            if (token_.type != TokenType::Cell) {
+                continue;
+            }
+            Position pos = Position::FromString(token_.text);
+            if (!pos.IsValid()) {
+                return false;
+            }
+            size_t start = token_.text.data() - input_.data();
+            key.append(input_.data() + copied, start - copied);
+            AppendOffset('R', pos.row - anchor.row, key);
+            AppendOffset('C', pos.col - anchor.col, key);
+            copied = start + token_.text.size();
+        }
+        key.append(input_.data() + copied, input_.size() - copied);
+        return true;
+    }
+
+protected:
+    enum class TokenType {
+        Number,
+        Cell,
+        Function,
+        Colon,
+        Comma,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        End,
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    std::string_view input_;
+    size_t offset_ = 0;
+    Token token_;
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    // WS: [ \t\n\r]+ -> skip
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    size_t SkipDigits(size_t offset) const {
+        while (offset < input_.size() && IsDigit(input_[offset])) {
+            ++offset;
+        }
+        return offset;
+    }
+
+    void Advance() {
+        while (offset_ < input_.size() && IsSpace(input_[offset_])) {
+            ++offset_;
+        }
+        if (offset_ == input_.size()) {
+            token_ = {TokenType::End, {}};
+            return;
+        }
+
+        size_t start = offset_;
+        size_t end = start + 1;
+        TokenType type;
+        switch (input_[start]) {
+            case '+':
+                type = TokenType::Add;
+                break;
+            case '-':
+                type = TokenType::Sub;
+                break;
+            case '*':
+                type = TokenType::Mul;
+                break;
+            case '/':
+                type = TokenType::Div;
+                break;
+            case '(':
+                type = TokenType::LeftParen;
+                break;
+            case ')':
+                type = TokenType::RightParen;
+                break;
+            case ':':
+                type = TokenType::Colon;
+                break;
+            case ',':
+                type = TokenType::Comma;
+                break;
+            default:
+                if (IsUpper(input_[start])) {
+                    end = LexName(start);
+                    type = IsDigit(input_[end - 1]) ? TokenType::Cell : TokenType::Function;
+                } else {
+                    type = TokenType::Number;
+                    end = LexNumber(start);
+                }
+        }
+        token_ = {type, input_.substr(start, end - start)};
+        offset_ = end;
+    }
+
+    // CELL: [A-Z]+[0-9]+, or a function name without digits
+    size_t LexName(size_t start) const {
+        size_t digits = start;
+        while (digits < input_.size() && IsUpper(input_[digits])) {
+            ++digits;
+        }
+        return SkipDigits(digits);
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t LexNumber(size_t start) const {
+        size_t end = SkipDigits(start);
+        if (end < input_.size() && input_[end] == '.') {
+            size_t fraction_end = SkipDigits(end + 1);
+            if (fraction_end > end + 1) {
+                end = fraction_end;
+            }
+        }
+        if (end == start) {
+            FailLexing(start);
+        }
+        // EXPONENT: [eE] [-+]? UINT, only taken when complete
+        if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+            size_t digits = end + 1;
+            if (digits < input_.size() && (input_[digits] == '+' || input_[digits] == '-')) {
+                ++digits;
+            }
+            size_t exponent_end = SkipDigits(digits);
+            if (exponent_end > digits) {
+                end = exponent_end;
+            }
+        }
+        return end;
+    }
+
+    [[noreturn]] void FailLexing(size_t offset) const {
+        throw ParsingError("Error when lexing: unexpected character '" + std::string(1, input_[offset]) + "'");
+    }
+
+private:
+    static void AppendOffset(char axis, int offset, std::string& key) {
+        char buffer[16];
+        key += axis;
+        key += '[';
+        key.append(buffer, std::to_chars(std::begin(buffer), std::end(buffer), offset).ptr);
+        key += ']';
+    }
+};
+
+// Hand-written front end for the Formula.g4 grammar, builds the same nodes as
+// ParseASTListener. Tokens are views into the input, so nothing but the AST
+// itself is allocated.
+class FastFormulaParser : private FormulaLexer {
+public:
+    explicit FastFormulaParser(std::string_view input)
+        : FormulaLexer(input) {
+        ReserveArena();
+        Advance();
+    }
+
+    // main: expr EOF
+    FormulaAST ParseMain() {
+        const Expr* root = ParseSum();
+        if (token_.type != TokenType::End) {
+            FailParsing();
+        }
+        return FormulaAST(std::move(arena_), root, {cells_, cell_count_}, {ranges_, range_count_});
+    }
+
+private:
+    Arena arena_;
+    Position* cells_ = nullptr;
+    size_t cell_count_ = 0;
+    Range* ranges_ = nullptr;
+    size_t range_count_ = 0;
+    // arguments of the calls being parsed, innermost last
+    std::vector<const Expr*> args_;
+
+    // Lexes the whole input once to size the arena, so that the nodes, the
+    // cells and the bytecode of the formula fit into a single block
+    void ReserveArena() {
+        size_t atoms = 0;
+        size_t cells = 0;
+        size_t operators = 0;
+        size_t calls = 0;
+        size_t ranges = 0;
+        size_t commas = 0;
+        for (Advance(); token_.type != TokenType::End; Advance()) {
+            switch (token_.type) {
+                case TokenType::Number:
+                    ++atoms;
+                    break;
+                case TokenType::Cell:
+                    ++atoms;
+                    ++cells;
+                    break;
+                case TokenType::Function:
+                    ++calls;
+                    break;
+                case TokenType::Colon:
+                    ++ranges;
+                    break;
+                case TokenType::Comma:
+                    ++commas;
+                    break;
+                case TokenType::LeftParen:
+                case TokenType::RightParen:
+                    break;
+                default:
+                    ++operators;
+            }
+        }
+        offset_ = 0;
+
+        size_t bytes = atoms * std::max(sizeof(NumberExpr), sizeof(CellExpr)) +
+                       operators * std::max(sizeof(BinaryOpExpr), sizeof(UnaryOpExpr)) +
+                       cells * sizeof(Position) + (atoms + operators + calls) * sizeof(Instruction) +
+                       calls * sizeof(CallExpr) + (calls + commas) * sizeof(const Expr*) +
+                       ranges * (sizeof(RangeExpr) + sizeof(Range)) + alignof(std::max_align_t);
+        arena_ = Arena(bytes);
+        cells_ = arena_.NewArray<Position>(cells);
+        ranges_ = arena_.NewArray<Range>(ranges);
+    }
+
+    [[noreturn]] void FailParsing() const {
+        throw ParsingError("Error when parsing: " +
+                           (token_.type == TokenType::End ? std::string("<EOF>") : std::string(token_.text)));
+    }
+
+    // expr (ADD | SUB) expr, left-associative
+    const Expr* ParseSum() {
+        const Expr* lhs = ParseProduct();
+        while (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            auto type = token_.type == TokenType::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            Advance();
+            const Expr* rhs = ParseProduct();
+            lhs = arena_.New<BinaryOpExpr>(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // expr (MUL | DIV) expr, left-associative
+    const Expr* ParseProduct() {
+        const Expr* lhs = ParseUnary();
+        while (token_.type == TokenType::Mul || token_.type == TokenType::Div) {
+            auto type = token_.type == TokenType::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            Advance();
+            const Expr* rhs = ParseUnary();
+            lhs = arena_.New<BinaryOpExpr>(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // (ADD | SUB) expr binds tighter than any binary operation
+    const Expr* ParseUnary() {
+        if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            auto type = token_.type == TokenType::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+            Advance();
+            return arena_.New<UnaryOpExpr>(type, ParseUnary());
+        }
+        return ParseAtom();
+    }
+
+    const Expr* ParseAtom() {
+        const Expr* node = nullptr;
+        switch (token_.type) {
+            case TokenType::Number:
+                node = arena_.New<NumberExpr>(ParseNumber(token_.text));
+                break;
+            case TokenType::Cell: {
+                Position value = Position::FromString(token_.text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(token_.text));
+                }
+                cells_[cell_count_++] = value;
+                node = arena_.New<CellExpr>(value);
+                break;
+            }
+            case TokenType::LeftParen:
+                Advance();
+                node = ParseSum();
+                if (token_.type != TokenType::RightParen) {
+                    FailParsing();
+                }
+                break;
+            case TokenType::Function:
+                node = ParseCall();
+                break;
+            default:
+                FailParsing();
+        }
+        Advance();
+        return node;
+    }
+
+    // FUNCTION '(' arg (',' arg)* ')', stops at the closing paren
+    const Expr* ParseCall() {
+        auto function = FindFunction(token_.text);
+        if (!function) {
+            throw ParsingError("Unknown function: " + std::string(token_.text));
+        }
+        Advance();
+        if (token_.type != TokenType::LeftParen) {
+            FailParsing();
+        }
+        size_t first_arg = args_.size();
+        do {
+            Advance();
+            args_.push_back(ParseArgument());
+        } while (token_.type == TokenType::Comma);
+        if (token_.type != TokenType::RightParen) {
+            FailParsing();
+        }
+
+        size_t arg_count = args_.size() - first_arg;
+        auto* args = arena_.NewArray<const Expr*>(arg_count);
+        std::copy(args_.begin() + first_arg, args_.end(), args);
+        args_.resize(first_arg);
+        return arena_.New<CallExpr>(*function, ArenaArray<const Expr* const>(args, arg_count));
+    }
+
+    // arg: CELL ':' CELL | expr
+    const Expr* ParseArgument() {
+        if (token_.type == TokenType::Cell) {
+            size_t saved_offset = offset_;
+            Token first = token_;
+            Advance();
+            if (token_.type == TokenType::Colon) {
+                Advance();
+                if (token_.type != TokenType::Cell) {
+                    FailParsing();
+                }
+                Range range = MakeRange(first.text, token_.text);
+                ranges_[range_count_++] = range;
+                Advance();
+                return arena_.New<RangeExpr>(range);
+            }
+            // not a range, parse the cell again as an expression
+            offset_ = saved_offset;
+            token_ = first;
+        }
+        return ParseSum();
+    }
+
+    // Converts the same way as `std::istream >> double` in
+    // ParseASTListener::exitLiteral: out of range numbers are rejected
+    static double ParseNumber(std::string_view text) {
+        char buffer[64];
+        std::string long_text;
+        const char* str = buffer;
+        if (text.size() < sizeof(buffer)) {
+            text.copy(buffer, text.size());
+            buffer[text.size()] = '\0';
+        } else {
+            long_text = std::string(text);
+            str = long_text.c_str();
+        }
+        char* end = nullptr;
+        double value = std::strtod(str, &end);
+        if (end != str + text.size() || std::isinf(value)) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return value;
+    }
+};
+
+// Builds the tree back from its postfix form. The nodes come from a file, so
+// everything is checked and a bad program throws instead of making a broken tree.
+FormulaAST BuildFromNodes(const SerializedNode* nodes, size_t count) {
+    size_t cell_count = 0;
+    size_t range_count = 0;
+    size_t arg_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        cell_count += nodes[i].kind == SerializedNode::Cell;
+        range_count += nodes[i].kind == SerializedNode::Range;
+        if (nodes[i].kind == SerializedNode::Call) {
+            // checked here already, as the arena is sized by it
+            if (nodes[i].arg_count > i) {
+                throw ParsingError("Invalid formula program");
+            }
+            arg_count += nodes[i].arg_count;
+        }
+    }
+    size_t node_size = std::max({sizeof(NumberExpr), sizeof(CellExpr), sizeof(RangeExpr), sizeof(UnaryOpExpr),
+                                 sizeof(BinaryOpExpr), sizeof(CallExpr)});
+    Arena arena(count * (node_size + sizeof(Instruction)) + cell_count * sizeof(Position) +
+                range_count * sizeof(Range) + arg_count * sizeof(const Expr*) + alignof(std::max_align_t));
+    Position* cells = arena.NewArray<Position>(cell_count);
+    Range* ranges = arena.NewArray<Range>(range_count);
+    size_t cell_index = 0;
+    size_t range_index = 0;
+
+    thread_local std::vector<const Expr*> stack;
+    stack.clear();
+    auto fail = [] {
+        throw ParsingError("Invalid formula program");
+    };
+    // ranges may only be arguments of functions
+    auto pop_operand = [&] {
+        if (stack.empty() || stack.back()->GetRange()) {
+            fail();
+        }
+        const Expr* operand = stack.back();
+        stack.pop_back();
+        return operand;
+    };
+
+    for (size_t i = 0; i < count; ++i) {
+        const SerializedNode& node = nodes[i];
+        switch (node.kind) {
+            case SerializedNode::Number:
+                stack.push_back(arena.New<NumberExpr>(node.number));
+                break;
+            case SerializedNode::Cell: {
+                Position pos{node.coords[0], node.coords[1]};
+                if (!pos.IsValid()) {
+                    fail();
+                }
+                cells[cell_index++] = pos;
+                stack.push_back(arena.New<CellExpr>(pos));
+                break;
+            }
+            case SerializedNode::Range: {
+                Range range{{node.coords[0], node.coords[1]}, {node.coords[2], node.coords[3]}};
+                if (!range.IsValid()) {
+                    fail();
+                }
+                ranges[range_index++] = range;
+                stack.push_back(arena.New<RangeExpr>(range));
+                break;
+            }
+            case SerializedNode::UnaryPlus:
+            case SerializedNode::UnaryMinus: {
+                auto type = node.kind == SerializedNode::UnaryPlus ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                const Expr* operand = pop_operand();
+                stack.push_back(arena.New<UnaryOpExpr>(type, operand));
+                break;
+            }
+            case SerializedNode::Add:
+            case SerializedNode::Subtract:
+            case SerializedNode::Multiply:
+            case SerializedNode::Divide: {
+                constexpr BinaryOpExpr::Type TYPES[] = {BinaryOpExpr::Add, BinaryOpExpr::Subtract,
+                                                        BinaryOpExpr::Multiply, BinaryOpExpr::Divide};
+                const Expr* rhs = pop_operand();
+                const Expr* lhs = pop_operand();
+                stack.push_back(arena.New<BinaryOpExpr>(TYPES[node.kind - SerializedNode::Add], lhs, rhs));
+                break;
+            }
+            case SerializedNode::Call: {
+                if (node.function >= FUNCTION_NAMES.size() || node.arg_count == 0 || node.arg_count > stack.size()) {
+                    fail();
+                }
+                auto* args = arena.NewArray<const Expr*>(node.arg_count);
+                std::copy(stack.end() - node.arg_count, stack.end(), args);
+                stack.resize(stack.size() - node.arg_count);
+                stack.push_back(arena.New<CallExpr>(static_cast<Function>(node.function),
+                                                    ArenaArray<const Expr* const>(args, node.arg_count)));
+                break;
+            }
+            default:
+                fail();
+        }
+    }
+    const Expr* root = pop_operand();
+    if (!stack.empty()) {
+        fail();
+    }
+    return FormulaAST(std::move(arena), root, {cells, cell_count}, {ranges, range_count});
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    FormulaAST MoveAST() {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
+        const Expr* root = args_.front();
         args_.clear();
 
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+        Position* cells = arena_.NewArray<Position>(cells_.size());
+        std::copy(cells_.begin(), cells_.end(), cells);
+        Range* ranges = arena_.NewArray<Range>(ranges_.size());
+        std::copy(ranges_.begin(), ranges_.end(), ranges);
+        return FormulaAST(std::move(arena_), root, {cells, cells_.size()}, {ranges, ranges_.size()});
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        const Expr* operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -311,8 +1318,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = arena_.New<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -324,17 +1330,16 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(arena_.New<NumberExpr>(value));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        const Expr* rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        const Expr* lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -348,8 +1353,7 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = arena_.New<BinaryOpExpr>(type, lhs, rhs);
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -358,9 +1362,27 @@ public:
         if (!value.IsValid()) {
             throw FormulaException("Invalid position: " + str_value);
         }
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        cells_.push_back(value);
+        args_.push_back(arena_.New<CellExpr>(value));
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+
+        auto* args = arena_.NewArray<const Expr*>(arg_count);
+        std::copy(args_.end() - arg_count, args_.end(), args);
+        args_.resize(args_.size() - arg_count);
+
+        auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        assert(function.has_value());
+        args_.push_back(arena_.New<CallExpr>(*function, ArenaArray<const Expr* const>(args, arg_count)));
+    }
+
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        Range range = MakeRange(ctx->CELL(0)->getSymbol()->getText(), ctx->CELL(1)->getSymbol()->getText());
+        ranges_.push_back(range);
+        args_.push_back(arena_.New<RangeExpr>(range));
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -368,8 +1390,10 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    Arena arena_;
+    std::vector<const Expr*> args_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -381,11 +1405,19 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+#endif
 
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+namespace {
+FormulaAST ParseFormulaASTFast(const std::string& in_str) {
+    ASTImpl::FastFormulaParser parser(in_str);
+    return parser.ParseMain();
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -406,13 +1438,44 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.MoveAST();
+}
+#endif
+}  // namespace
+
+bool AppendRelativeKey(std::string_view expression, Position anchor, std::string& key) {
+    try {
+        return ASTImpl::FormulaLexer(expression).AppendRelativeKey(anchor, key);
+    } catch (const ParsingError&) {
+        return false;
+    }
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
+bool IsFormulaParserAvailable(FormulaParserKind kind) {
+#ifdef SPREADSHEET_WITH_ANTLR
+    return true;
+#else
+    return kind == FormulaParserKind::Fast;
+#endif
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(in_str);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str, FormulaParserKind kind) {
+    if (!IsFormulaParserAvailable(kind)) {
+        throw std::invalid_argument("ANTLR formula parser is not built in");
+    }
     try {
-        return ParseFormulaAST(in);
+#ifdef SPREADSHEET_WITH_ANTLR
+        if (kind == FormulaParserKind::Antlr) {
+            std::istringstream in(in_str);
+            return ParseFormulaASTAntlr(in);
+        }
+#endif
+        return ParseFormulaASTFast(in_str);
     } catch (const std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
@@ -422,18 +1485,119 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, shift);
+}
+
+void FormulaAST::Serialize(std::vector<ASTImpl::SerializedNode>& nodes, Position shift) const {
+    root_expr_->Serialize(nodes, shift);
+}
+
+FormulaAST FormulaAST::Deserialize(const ASTImpl::SerializedNode* nodes, size_t count) {
+    return ASTImpl::BuildFromNodes(nodes, count);
+}
+
+ExecResult FormulaAST::Execute(const std::function<ExecResult(Position)>& func,
+                               const RangeReader& read_range) const {
+    using ASTImpl::Instruction;
+    // typical formulas fit into the fixed buffer, so no allocation happens
+    std::array<double, 32> small_stack;
+    std::unique_ptr<double[]> large_stack;
+    double* stack = small_stack.data();
+    if (stack_size_ > small_stack.size()) {
+        large_stack = std::make_unique<double[]>(stack_size_);
+        stack = large_stack.get();
+    }
+
+    size_t top = 0;
+    for (const Instruction& instruction : code_) {
+        switch (instruction.op) {
+        case Instruction::PushNumber:
+            stack[top++] = instruction.number;
+            break;
+        case Instruction::LoadCell: {
+            ExecResult value = func(instruction.cell);
+            if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            stack[top++] = std::get<double>(value);
+            break;
+        }
+        case Instruction::Negate:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case Instruction::Call: {
+            top -= instruction.call->GetScalarCount();
+            ExecResult value = instruction.call->Apply(stack + top, instruction.call->GetScalarCount(), func, read_range);
+            if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            stack[top++] = std::get<double>(value);
+            break;
+        }
+        case Instruction::EvaluateCall: {
+            ExecResult value = instruction.call->Evaluate(func, read_range);
+            if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            stack[top++] = std::get<double>(value);
+            break;
+        }
+        default:
+            --top;
+            stack[top - 1] = ASTImpl::ApplyBinaryOp(instruction.op, stack[top - 1], stack[top]);
+            if (!std::isfinite(stack[top - 1])) {
+                return FormulaError(FormulaError::Category::Arithmetic);
+            }
+            break;
+        }
+    }
+    assert(top == 1);
+    return stack[0];
 }
 
-double FormulaAST::Execute(std::function<double(Position)> func) const {
-    return root_expr_->Evaluate(func);
+ExecResult FormulaAST::ExecuteTree(const std::function<ExecResult(Position)>& func,
+                                   const RangeReader& read_range) const {
+    return root_expr_->Evaluate(func, read_range);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)),
-      cells_(std::move(cells)){
-    cells_.sort(Comp());
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, ArenaArray<Position> cells,
+                       ArenaArray<Range> ranges)
+    : arena_(std::move(arena)),
+      root_expr_(root_expr),
+      cells_(cells),
+      ranges_(ranges){
+    std::sort(cells_.begin(), cells_.end(), Comp());
+    std::sort(ranges_.begin(), ranges_.end());
+
+    // compiled into a reused buffer first, the arena gets an exact-size copy
+    thread_local std::vector<ASTImpl::Instruction> code;
+    code.clear();
+    root_expr_->Compile(code);
+    ASTImpl::OptimizeCode(code);
+    auto* code_data = arena_.NewArray<ASTImpl::Instruction>(code.size());
+    std::uninitialized_copy(code.begin(), code.end(), code_data);
+    code_ = {code_data, code.size()};
+
+    size_t depth = 0;
+    for (const ASTImpl::Instruction& instruction : code_) {
+        switch (instruction.op) {
+        case ASTImpl::Instruction::PushNumber:
+        case ASTImpl::Instruction::LoadCell:
+        case ASTImpl::Instruction::EvaluateCall:
+            stack_size_ = std::max(stack_size_, ++depth);
+            break;
+        case ASTImpl::Instruction::Negate:
+            break;
+        case ASTImpl::Instruction::Call:
+            depth = depth - instruction.call->GetScalarCount() + 1;
+            stack_size_ = std::max(stack_size_, depth);
+            break;
+        default:
+            --depth;
+            break;
+        }
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -1,41 +1,177 @@
 #pragma once
 
-#include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
+    class CallExpr;
+
+    // One step of the postfix program a formula is compiled to: operands are
+    // pushed onto a stack, operations pop their arguments and push the result
+    struct Instruction {
+        enum Op : char {
+            PushNumber,
+            LoadCell,
+            Negate,
+            // pops the scalar arguments of an aggregate function, pushes its value
+            Call,
+            // pushes the value of a call whose arguments are evaluated by the
+            // tree, for COUNT that skips the errors of its scalar arguments
+            EvaluateCall,
+            Add = '+',
+            Subtract = '-',
+            Multiply = '*',
+            Divide = '/',
+        };
+
+        explicit Instruction(Op op)
+            : op(op)
+            , number(0.0) {
+        }
+        Instruction(Op op, double number)
+            : op(op)
+            , number(number) {
+        }
+        Instruction(Op op, Position cell)
+            : op(op)
+            , cell(cell) {
+        }
+        Instruction(Op op, const CallExpr* call)
+            : op(op)
+            , call(call) {
+        }
+
+        Op op;
+        union {
+            double number;
+            Position cell;
+            const CallExpr* call;
+        };
+    };
+
+    // One node of the postfix form of the tree that snapshots store. Unlike
+    // the bytecode it keeps unary pluses and range arguments, so the tree and
+    // its text are restored exactly. Plain data, read right from the file.
+    struct SerializedNode {
+        enum Kind : uint8_t {
+            Number,
+            Cell,
+            Range,
+            UnaryPlus,
+            UnaryMinus,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            // pops `arg_count` arguments
+            Call,
+        };
+
+        Kind kind;
+        uint8_t function;
+        uint32_t arg_count;
+        union {
+            double number;
+            // row and col of a cell, or of the two corners of a range; they
+            // are below Position::MAX_ROWS and MAX_COLS
+            int16_t coords[4];
+        };
+    };
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Result of evaluating a formula or a referenced cell: errors are returned as
+// values, nothing is thrown on the evaluation path
+using ExecResult = std::variant<double, FormulaError>;
+
+// Reads a range for an aggregate function, see SheetInterface::GetNumericValues.
+// Must only append to `values`: evaluations nested into the read share it.
+using RangeReader = std::function<std::optional<FormulaError>(Range, std::vector<double>&)>;
+
+// Nodes, referenced cells and bytecode of a formula live in its own arena:
+// a parsed formula is a single heap block in the common case and is freed at once
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
+    // `root_expr`, `cells` and `ranges` must be allocated in `arena`
+    FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, ArenaArray<Position> cells,
+               ArenaArray<Range> ranges);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<double(Position)> func) const;
+    // Runs the compiled bytecode. Constants are folded in it and identities
+    // like x*1 are dropped, while the tree keeps the formula as written for
+    // printing. Without `read_range` ranges are read cell by cell through
+    // `func`, and empty cells count as zeros.
+    ExecResult Execute(const std::function<ExecResult(Position)>& func, const RangeReader& read_range = {}) const;
+    // Evaluates by walking the tree as written; kept as the reference implementation
+    ExecResult ExecuteTree(const std::function<ExecResult(Position)>& func,
+                           const RangeReader& read_range = {}) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Every reference is printed moved by `shift`, which is how a formula
+    // that shares the tree of another cell prints its own references
+    void PrintFormula(std::ostream& out, Position shift = {0, 0}) const;
+
+    // Appends the postfix form of the tree, references moved by `shift`
+    void Serialize(std::vector<ASTImpl::SerializedNode>& nodes, Position shift = {0, 0}) const;
+    // Rebuilds a formula from Serialize() output without parsing any text.
+    // Throws ParsingError when the nodes don't make a valid tree.
+    static FormulaAST Deserialize(const ASTImpl::SerializedNode* nodes, size_t count);
+
+    // Sorted, may contain duplicates
+    ArenaArray<const Position> GetCells() const {
+        return {cells_.begin(), cells_.size()};
     }
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+
+    // Ranges of the aggregate functions, sorted, may contain duplicates
+    ArenaArray<const Range> GetRanges() const {
+        return {ranges_.begin(), ranges_.size()};
+    }
+
+    ArenaArray<const ASTImpl::Instruction> GetCode() const {
+        return code_;
+    }
+
+    const Arena& GetArena() const {
+        return arena_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    Arena arena_;
+    const ASTImpl::Expr* root_expr_;
+    ArenaArray<Position> cells_;
+    ArenaArray<Range> ranges_;
+    ArenaArray<const ASTImpl::Instruction> code_;
+    size_t stack_size_ = 0;
 };
 
+// The hand-written parser is used by default. The ANTLR-generated one is kept
+// as the reference implementation and is there only when the build has ANTLR.
+enum class FormulaParserKind {
+    Fast,
+    Antlr,
+};
+
+bool IsFormulaParserAvailable(FormulaParserKind kind);
+
+// Appends the key of a formula written in the cell `anchor`: the text with
+// every reference made relative to the anchor, R[-1]C[0] for the cell above.
+// Formulas with equal keys differ only by the offset of their anchors, so
+// they can share one tree. Returns false when the text doesn't lex or has an
+// invalid reference; parsing such a formula fails anyway.
+bool AppendRelativeKey(std::string_view expression, Position anchor, std::string& key);
+
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(const std::string& in_str, FormulaParserKind kind = FormulaParserKind::Fast);
@@ -0,0 +1,80 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+Arena::Arena(size_t first_block_size)
+    : next_block_size_(std::max<size_t>(first_block_size, sizeof(Block))) {
+}
+
+Arena::Arena(Arena&& other) noexcept
+    : last_block_(std::exchange(other.last_block_, nullptr))
+    , cursor_(std::exchange(other.cursor_, nullptr))
+    , end_(std::exchange(other.end_, nullptr))
+    , next_block_size_(other.next_block_size_) {
+}
+
+Arena& Arena::operator=(Arena&& other) noexcept {
+    if (this != &other) {
+        FreeBlocks();
+        last_block_ = std::exchange(other.last_block_, nullptr);
+        cursor_ = std::exchange(other.cursor_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+        next_block_size_ = other.next_block_size_;
+    }
+    return *this;
+}
+
+Arena::~Arena() {
+    FreeBlocks();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    auto address = reinterpret_cast<std::uintptr_t>(cursor_);
+    size_t padding = (alignment - address % alignment) % alignment;
+    if (cursor_ == nullptr || static_cast<size_t>(end_ - cursor_) < padding + size) {
+        AddBlock(size + alignment);
+        address = reinterpret_cast<std::uintptr_t>(cursor_);
+        padding = (alignment - address % alignment) % alignment;
+    }
+    char* result = cursor_ + padding;
+    cursor_ = result + size;
+    return result;
+}
+
+size_t Arena::GetBlockCount() const {
+    size_t count = 0;
+    for (const Block* block = last_block_; block; block = block->prev) {
+        ++count;
+    }
+    return count;
+}
+
+size_t Arena::GetBytesReserved() const {
+    size_t bytes = 0;
+    for (const Block* block = last_block_; block; block = block->prev) {
+        bytes += block->size;
+    }
+    return bytes;
+}
+
+void Arena::AddBlock(size_t min_size) {
+    // the header takes the start of the block, the data follows it
+    size_t size = std::max(next_block_size_, sizeof(Block) + min_size);
+    auto* block = static_cast<Block*>(::operator new(size));
+    block->prev = last_block_;
+    block->size = size;
+    last_block_ = block;
+    cursor_ = reinterpret_cast<char*>(block + 1);
+    end_ = reinterpret_cast<char*>(block) + size;
+    next_block_size_ = size * 2;
+}
+
+void Arena::FreeBlocks() {
+    while (last_block_) {
+        Block* prev = last_block_->prev;
+        ::operator delete(last_block_);
+        last_block_ = prev;
+    }
+    cursor_ = end_ = nullptr;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator: objects are placed one after another in large blocks and
+// are all freed at once with the arena. Destructors are never called, so only
+// trivially destructible types can be put here.
+class Arena {
+public:
+    // The first block is allocated on first use, `first_block_size` bytes or
+    // more when a single allocation needs it
+    explicit Arena(size_t first_block_size = DEFAULT_BLOCK_SIZE);
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+    ~Arena();
+
+    void* Allocate(size_t size, size_t alignment);
+
+    template <typename T, typename... Args>
+    T* New(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena never calls destructors");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Uninitialized storage for `count` objects
+    template <typename T>
+    T* NewArray(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena never calls destructors");
+        return static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    size_t GetBlockCount() const;
+    // Bytes taken from the heap, including the unused tail of the last block
+    size_t GetBytesReserved() const;
+
+private:
+    static const size_t DEFAULT_BLOCK_SIZE = 256;
+
+    struct Block {
+        Block* prev;
+        size_t size;
+    };
+
+    Block* last_block_ = nullptr;
+    char* cursor_ = nullptr;
+    char* end_ = nullptr;
+    size_t next_block_size_;
+
+    void AddBlock(size_t min_size);
+    void FreeBlocks();
+};
+
+// Non-owning view of an array that lives in an arena
+template <typename T>
+class ArenaArray {
+public:
+    ArenaArray() = default;
+    ArenaArray(T* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    T* begin() const {
+        return data_;
+    }
+    T* end() const {
+        return data_ + size_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
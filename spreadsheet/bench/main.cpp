@@ -0,0 +1,1158 @@
+#include "FormulaAST.h"
+#include "common.h"
+#include "delimited_export.h"
+#include "delimited_import.h"
+#include "formula.h"
+#include "log_duration.h"
+#include "report.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "workloads.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+// Every heap allocation of the process is counted
+static std::atomic<size_t> g_allocation_count{0};
+
+// Once the replacements below are inlined, GCC sees free() of a pointer that
+// came from operator new and warns, although they are a matching pair
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    g_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+// keeps the optimizer from dropping the measured work
+volatile size_t g_sink = 0;
+
+// Resident set size in KiB, 0 where it is unknown
+size_t GetRssKiB() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages = 0;
+    size_t resident_pages = 0;
+    statm >> total_pages >> resident_pages;
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024;
+#else
+    return 0;
+#endif
+}
+
+// Reports heap allocations and RSS growth caused by `op`
+template <typename Op>
+void MeasureMemory(std::string_view name, size_t items, Op op) {
+    size_t allocations = g_allocation_count.load();
+    size_t rss = GetRssKiB();
+    op();
+    allocations = g_allocation_count.load() - allocations;
+    std::cerr << name << ": "sv << static_cast<double>(allocations) / items << " allocations/item, RSS +"sv
+              << (GetRssKiB() - rss) / 1024.0 << " MiB"sv << std::endl;
+}
+
+// Runs prepare() untimed and op() timed `repeats` times, prints the mean time of op()
+template <typename Prepare, typename Op>
+void MeasureMean(std::string_view name, int repeats, Prepare prepare, Op op) {
+    using Clock = std::chrono::steady_clock;
+    Clock::duration total{};
+    for (int i = 0; i < repeats; ++i) {
+        prepare();
+        auto start = Clock::now();
+        op();
+        total += Clock::now() - start;
+    }
+    auto mean = std::chrono::duration_cast<std::chrono::nanoseconds>(total).count() / repeats;
+    std::cerr << name << ": " << mean / 1000.0 << " us/op" << std::endl;
+}
+
+// Evaluates cells in the given order so that every evaluation hits cached
+// precedents and the recursion stays shallow
+void WarmUp(const SheetInterface& sheet, const std::vector<Position>& cells) {
+    size_t errors = 0;
+    for (Position pos : cells) {
+        errors += std::holds_alternative<FormulaError>(sheet.GetCell(pos)->GetValueView());
+    }
+    g_sink = errors;
+}
+
+void BenchSetCellDense() {
+    auto sheet = CreateSheet();
+    {
+        LOG_DURATION("SetCell dense 512x512"s);
+        for (int row = 0; row < 512; ++row) {
+            for (int col = 0; col < 512; ++col) {
+                sheet->SetCell({row, col}, "1"s);
+            }
+        }
+    }
+    {
+        LOG_DURATION("GetCell dense 512x512"s);
+        size_t found = 0;
+        for (int row = 0; row < 512; ++row) {
+            for (int col = 0; col < 512; ++col) {
+                found += sheet->GetCell({row, col}) != nullptr;
+            }
+        }
+        g_sink = found;
+    }
+}
+
+void BenchSetCellSparseRandom() {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> row_dist(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col_dist(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions(100'000);
+    for (Position& pos : positions) {
+        pos = {row_dist(gen), col_dist(gen)};
+    }
+
+    auto sheet = CreateSheet();
+    {
+        LOG_DURATION("SetCell sparse random 100k"s);
+        for (Position pos : positions) {
+            sheet->SetCell(pos, "1"s);
+        }
+    }
+    {
+        LOG_DURATION("GetCell sparse random 100k"s);
+        size_t found = 0;
+        for (Position pos : positions) {
+            found += sheet->GetCell(pos) != nullptr;
+        }
+        g_sink = found;
+    }
+}
+
+void BenchSetCellSingleColumn() {
+    auto sheet = CreateSheet();
+    LOG_DURATION("SetCell single column XFD1:XFD16384"s);
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        sheet->SetCell({row, Position::MAX_COLS - 1}, "1"s);
+    }
+}
+void BenchInvalidationChain() {
+    const int length = 10'000;
+    auto sheet = CreateSheet();
+    std::vector<Position> chain;
+    sheet->SetCell({0, 0}, "1"s);
+    chain.push_back({0, 0});
+    for (int row = 1; row < length; ++row) {
+        sheet->SetCell({row, 0}, "="s + Position{row - 1, 0}.ToString() + "+1"s);
+        chain.push_back({row, 0});
+    }
+    // unrelated filler so that the sheet is much larger than the chain
+    for (int row = 0; row < 256; ++row) {
+        for (int col = 1; col < 257; ++col) {
+            sheet->SetCell({row, col}, "1"s);
+        }
+    }
+
+    for (int affected : {length, length / 10, 1}) {
+        Position edited = chain[length - affected];
+        MeasureMean("Invalidate chain, affected "s + std::to_string(affected), 20,
+                    [&] { WarmUp(*sheet, chain); },
+                    [&] { sheet->SetCell(edited, edited.row == 0 ? "2"s : "=1"s); });
+    }
+}
+
+void BenchInvalidationFanOut() {
+    const int width = 10'000;
+    auto sheet = CreateSheet();
+    std::vector<Position> cells = {{0, 0}};
+    sheet->SetCell({0, 0}, "1"s);
+    for (int row = 0; row < width; ++row) {
+        sheet->SetCell({row, 1}, "=A1*2"s);
+        cells.push_back({row, 1});
+    }
+    sheet->SetCell({0, 2}, "1"s);
+    sheet->SetCell({1, 2}, "=C1"s);
+    cells.push_back({1, 2});
+
+    MeasureMean("Invalidate fan-out, affected "s + std::to_string(width), 20,
+                [&] { WarmUp(*sheet, cells); },
+                [&] { sheet->SetCell({0, 0}, "2"s); });
+    MeasureMean("Invalidate fan-out sheet, affected 1"s, 20,
+                [&] { WarmUp(*sheet, cells); },
+                [&] { sheet->SetCell({0, 2}, "2"s); });
+}
+// runs `iterations` evaluations of the parsed formula with both evaluators
+void CompareEvaluators(std::string_view name, const std::string& expression, int iterations) {
+    FormulaAST ast = ParseFormulaAST(expression);
+    std::function<ExecResult(Position)> cell_value = [](Position pos) -> ExecResult {
+        return pos.row + 1.0;
+    };
+    double sum = 0.0;
+    {
+        LOG_DURATION("Tree walk: "s + std::string(name));
+        for (int i = 0; i < iterations; ++i) {
+            sum += std::get<double>(ast.ExecuteTree(cell_value));
+        }
+    }
+    {
+        LOG_DURATION("Bytecode:  "s + std::string(name));
+        for (int i = 0; i < iterations; ++i) {
+            sum -= std::get<double>(ast.Execute(cell_value));
+        }
+    }
+    g_sink = static_cast<size_t>(sum);
+}
+
+void BenchFormulaEvaluation() {
+    std::string deep = "1";
+    for (int i = 2; i <= 200; ++i) {
+        deep = std::to_string(i) + "-(" + deep + ")";
+    }
+    std::string wide = "A1*B1";
+    for (int i = 2; i <= 200; ++i) {
+        wide += "+A" + std::to_string(i) + "*B" + std::to_string(i);
+    }
+    CompareEvaluators("deep, 200 nested levels"sv, deep, 20'000);
+    CompareEvaluators("wide, 400 cell loads"sv, wide, 20'000);
+    CompareEvaluators("small, A1+B2*3"sv, "A1+B2*3"s, 1'000'000);
+    // the bytecode has constants folded and identities dropped, the tree has them as written
+    CompareEvaluators("constants, 2*3+(A1+B1)*1-0+SUM(1,2,3)*-(-C1)/1"sv,
+                      "2*3+(A1+B1)*1-0+SUM(1,2,3)*-(-C1)/1"s, 1'000'000);
+}
+void BenchErrorCascade() {
+    const int length = 10'000;
+    auto sheet = CreateSheet();
+    std::vector<Position> chain;
+    for (int row = 0; row < length; ++row) {
+        sheet->SetCell({row, 0}, row == 0 ? "=1/0"s : "="s + Position{row - 1, 0}.ToString() + "+1"s);
+        chain.push_back({row, 0});
+    }
+    MeasureMean("Recalculate error cascade, 10k cells"s, 20,
+                [&] { sheet->SetCell({0, 0}, "=1/0"s); },
+                [&] { WarmUp(*sheet, chain); });
+    sheet->SetCell({0, 1}, "text"s);
+    sheet->SetCell({0, 0}, "=B1"s);
+    MeasureMean("Recalculate #VALUE! cascade, 10k cells"s, 20,
+                [&] { sheet->SetCell({0, 1}, "text"s); },
+                [&] { WarmUp(*sheet, chain); });
+}
+void BenchNumericTextReferences() {
+    const int rows = 10'000;
+    auto sheet = CreateSheet();
+    std::vector<Position> formulas;
+    sheet->SetCell({0, 3}, "2"s);
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row) + ".25"s);
+        sheet->SetCell({row, 1}, "'"s + std::to_string(row));
+        sheet->SetCell({row, 2}, "="s + Position{row, 0}.ToString() + "*D1+"s + Position{row, 1}.ToString());
+        formulas.push_back({row, 2});
+    }
+    MeasureMean("Recalculate 10k formulas over numeric text"s, 20,
+                [&] { sheet->SetCell({0, 3}, "3"s); },
+                [&] { WarmUp(*sheet, formulas); });
+}
+// Reads every cell of a text-heavy sheet through each accessor
+void BenchTextReads() {
+    using Clock = std::chrono::steady_clock;
+    const int rounds = 20;
+    Workload workload = MakeTextHeavy(5'000, 8, 42);
+    auto sheet = CreateSheet();
+    for (const auto& [pos, text] : workload.cells) {
+        sheet->SetCell(pos, text);
+    }
+    auto measure = [&](std::string_view name, auto read) {
+        size_t allocations = g_allocation_count.load();
+        auto start = Clock::now();
+        size_t sum = 0;
+        for (int round = 0; round < rounds; ++round) {
+            for (const auto& [pos, text] : workload.cells) {
+                sum += read(*sheet->GetCell(pos));
+            }
+        }
+        std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+        allocations = g_allocation_count.load() - allocations;
+        double reads = static_cast<double>(workload.cells.size()) * rounds;
+        g_sink = sum;
+        std::cerr << "Read 50k text-heavy cells, "sv << name << ": "sv << elapsed.count() / reads << " ns/read, "sv
+                  << static_cast<double>(allocations) / reads << " allocations/read"sv << std::endl;
+    };
+    measure("GetValue"sv, [](const CellInterface& cell) {
+        return cell.GetValue().index();
+    });
+    measure("GetValueView"sv, [](const CellInterface& cell) {
+        return cell.GetValueView().index();
+    });
+    measure("GetText"sv, [](const CellInterface& cell) {
+        return cell.GetText().size();
+    });
+    measure("GetTextView"sv, [](const CellInterface& cell) {
+        return static_cast<const Cell&>(cell).GetTextView().size();
+    });
+}
+// parses a batch of formulas of mixed size with the given front end
+void BenchParseThroughput(FormulaParserKind kind, std::string_view name, const std::vector<std::string>& formulas) {
+    size_t bytes = 0;
+    for (const auto& formula : formulas) {
+        bytes += formula.size();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& formula : formulas) {
+        g_sink = g_sink + !ParseFormulaAST(formula, kind).GetCells().empty();
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    std::cerr << "Parse "sv << name << ": "sv << formulas.size() << " formulas in "sv
+              << std::chrono::duration_cast<std::chrono::milliseconds>(seconds).count() << " ms, "sv
+              << static_cast<long>(formulas.size() / seconds.count()) << " formulas/s, "sv
+              << static_cast<long>(bytes / seconds.count() / (1 << 20)) << " MiB/s"sv << std::endl;
+}
+
+void BenchFormulaParsing() {
+    std::mt19937 gen(7);
+    std::vector<std::string> formulas;
+    for (int i = 0; i < 100'000; ++i) {
+        std::string formula = Position{int(gen() % 1000), int(gen() % 50)}.ToString();
+        for (int terms = gen() % 12; terms > 0; --terms) {
+            formula += "+-*/"[gen() % 4];
+            formula += gen() % 2 ? std::to_string(gen() % 10000) + ".5"s
+                                 : "("s + Position{int(gen() % 1000), int(gen() % 50)}.ToString() + "-1)"s;
+        }
+        formulas.push_back(std::move(formula));
+    }
+    BenchParseThroughput(FormulaParserKind::Fast, "fast"sv, formulas);
+    if (IsFormulaParserAvailable(FormulaParserKind::Antlr)) {
+        BenchParseThroughput(FormulaParserKind::Antlr, "ANTLR"sv, formulas);
+    }
+}
+
+// Position::ToString and FromString as they were before the constexpr codecs,
+// kept for comparison
+namespace legacy {
+std::string PositionToString(Position pos) {
+    std::string result = "";
+    if (!pos.IsValid()) {
+        return result;
+    }
+    int place = pos.col / 26;
+    int units = pos.col % 26;
+    if (place == 0) {
+        result += units + 65;
+    }
+    if (result.empty()) {
+        std::vector<int> values;
+        for (; place > 0; place = units / 26) {
+            if (place > 26) {
+                values.push_back(units + 65);
+                units = place;
+                continue;
+            }
+            result += place - 1 + 65;
+            if (units > 26) {
+                result += units % 26 + 65 - 1;
+            } else {
+                result += units + 65;
+            }
+            if (!values.empty()) {
+                for (size_t i = 0; i < values.size(); ++i) {
+                    result += values[values.size() - 1];
+                }
+            }
+            units = place % 26;
+        }
+    }
+    result += std::to_string(pos.row + 1);
+    return result;
+}
+
+Position PositionFromString(std::string_view str) {
+    if (str.empty() || !std::isupper(static_cast<unsigned char>(str[0])) || str.size() < 2) {
+        return Position::NONE;
+    }
+    bool is_wrong_format = false;
+    bool is_prev_symb_digit = false;
+    std::string col_index;
+    std::string row_index;
+    for (const char c : str) {
+        if (std::isupper(static_cast<unsigned char>(c))) {
+            col_index += c;
+            if (is_prev_symb_digit) {
+                is_wrong_format = true;
+                break;
+            }
+        } else if (std::isdigit(static_cast<unsigned char>(c))) {
+            row_index += c;
+            is_prev_symb_digit = true;
+        } else {
+            is_wrong_format = true;
+            break;
+        }
+    }
+    if (is_wrong_format || col_index.size() > 3 || col_index.size() + row_index.size() > 17) {
+        return Position::NONE;
+    }
+    Position result;
+    result.row = std::stoi(row_index) - 1;
+    if (!result.IsValid()) {
+        return Position::NONE;
+    }
+    for (size_t i = 0; i < col_index.size(); ++i) {
+        int value = static_cast<int>(std::pow(26, col_index.size() - 1 - i)) * (col_index[i] - 65 + 1);
+        if (result.col == 0) {
+            --value;
+        }
+        result.col += value;
+    }
+    if (!result.IsValid()) {
+        return Position::NONE;
+    }
+    return result;
+}
+}  // namespace legacy
+
+void BenchPositionCodecs() {
+    using Clock = std::chrono::steady_clock;
+    auto report = [](std::string_view name, size_t count, Clock::duration duration) {
+        double ns = std::chrono::duration<double, std::nano>(duration).count() / count;
+        std::cerr << name << ": "sv << ns << " ns/position"sv << std::endl;
+    };
+
+    std::mt19937 gen(17);
+    std::vector<Position> positions(1'000'000);
+    for (Position& pos : positions) {
+        pos = {int(gen() % Position::MAX_ROWS), int(gen() % Position::MAX_COLS)};
+    }
+    std::vector<std::string> texts;
+    texts.reserve(positions.size());
+    for (Position pos : positions) {
+        texts.push_back(pos.ToString());
+    }
+
+    auto start = Clock::now();
+    for (Position pos : positions) {
+        g_sink = g_sink + legacy::PositionToString(pos).size();
+    }
+    report("Position to string, legacy ToString"sv, positions.size(), Clock::now() - start);
+    start = Clock::now();
+    for (Position pos : positions) {
+        g_sink = g_sink + pos.ToString().size();
+    }
+    report("Position to string, ToString"sv, positions.size(), Clock::now() - start);
+    start = Clock::now();
+    for (Position pos : positions) {
+        char buffer[Position::MAX_STRING_LENGTH];
+        g_sink = g_sink + (pos.ToChars(buffer) - buffer);
+    }
+    report("Position to string, ToChars"sv, positions.size(), Clock::now() - start);
+
+    start = Clock::now();
+    for (const std::string& text : texts) {
+        g_sink = g_sink + legacy::PositionFromString(text).col;
+    }
+    report("Position from string, legacy FromString"sv, texts.size(), Clock::now() - start);
+    start = Clock::now();
+    for (const std::string& text : texts) {
+        g_sink = g_sink + Position::FromString(text).col;
+    }
+    report("Position from string, FromString"sv, texts.size(), Clock::now() - start);
+
+    // every position of the sheet goes to its string and back
+    size_t mismatches = 0;
+    start = Clock::now();
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        for (int row = 0; row < Position::MAX_ROWS; ++row) {
+            char buffer[Position::MAX_STRING_LENGTH];
+            char* end = Position{row, col}.ToChars(buffer);
+            Position parsed = Position::FromString(std::string_view(buffer, end - buffer));
+            mismatches += parsed.row != row || parsed.col != col;
+        }
+    }
+    size_t total = static_cast<size_t>(Position::MAX_ROWS) * Position::MAX_COLS;
+    report("Round trip of the whole sheet, ToChars + FromString"sv, total, Clock::now() - start);
+    size_t legacy_mismatches = 0;
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        Position pos{0, col};
+        legacy_mismatches += !(legacy::PositionFromString(legacy::PositionToString(pos)) == pos);
+    }
+    std::cerr << "Round trip mismatches: "sv << mismatches << " of "sv << total << ", legacy codecs: "sv
+              << legacy_mismatches << " of "sv << Position::MAX_COLS << " columns"sv << std::endl;
+    if (mismatches != 0) {
+        std::abort();
+    }
+}
+// The same column total written as a chain of additions and as SUM over a range
+void BenchRangeAggregates() {
+    const int rows = 500;
+    auto sheet = CreateSheet();
+    std::string chain = "=A1";
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row) + ".5"s);
+        if (row > 0) {
+            chain += "+"s + Position{row, 0}.ToString();
+        }
+    }
+    {
+        LOG_DURATION("Set 1000 formulas =A1+...+A500"s);
+        for (int row = 0; row < 1000; ++row) {
+            sheet->SetCell({row, 1}, chain);
+        }
+    }
+    {
+        LOG_DURATION("Set 1000 formulas =SUM(A1:A500)"s);
+        for (int row = 0; row < 1000; ++row) {
+            sheet->SetCell({row, 2}, "=SUM(A1:A500)"s);
+        }
+    }
+    MeasureMean("Recalculate =A1+...+A500"s, 2000,
+                [&] { sheet->SetCell({0, 0}, "1"s); },
+                [&] { g_sink = g_sink + std::holds_alternative<double>(sheet->GetCell({0, 1})->GetValue()); });
+    MeasureMean("Recalculate =SUM(A1:A500)"s, 2000,
+                [&] { sheet->SetCell({0, 0}, "1"s); },
+                [&] { g_sink = g_sink + std::holds_alternative<double>(sheet->GetCell({0, 2})->GetValue()); });
+}
+
+void BenchRecalculateScaling(std::string_view name, Sheet& sheet) {
+    for (size_t threads : {1, 2, 4, 8, 16}) {
+        sheet.RecalculateAll(threads);  // creates the pool
+        MeasureMean("RecalculateAll "s + std::string(name) + ", "s + std::to_string(threads) + " threads"s, 5,
+                    [] {}, [&] { sheet.RecalculateAll(threads); });
+    }
+}
+
+// Wide: 4000 rows x 20 columns, every column reads the previous ones, so the
+// DAG has 20 levels of 4000 cells. Deep: 128 independent chains of 500 cells.
+void BenchRecalculateAll() {
+    Sheet wide;
+    for (int row = 0; row < 4000; ++row) {
+        wide.SetCell({row, 0}, std::to_string(row));
+        for (int col = 1; col < 20; ++col) {
+            std::string left = Position{row, col - 1}.ToString();
+            std::string up_left = Position{std::max(row - 1, 0), col - 1}.ToString();
+            wide.SetCell({row, col}, "="s + left + "*1.0001+"s + up_left + "/3-SUM(A1:A16)"s);
+        }
+    }
+    BenchRecalculateScaling("wide 20x4000"sv, wide);
+
+    Sheet deep;
+    for (int col = 0; col < 128; ++col) {
+        deep.SetCell({0, col}, std::to_string(col));
+        for (int row = 1; row < 500; ++row) {
+            deep.SetCell({row, col}, "="s + Position{row - 1, col}.ToString() + "*0.5+1"s);
+        }
+    }
+    BenchRecalculateScaling("deep 128 chains x 500"sv, deep);
+}
+
+// A 5000-long chain and a 20x200 grid, each loaded cell by cell and as one batch
+void BenchBulkLoad() {
+    std::vector<std::pair<Position, std::string>> chain{{{0, 0}, "1"s}};
+    for (int row = 1; row < 5000; ++row) {
+        chain.push_back({{row, 0}, "="s + Position{row - 1, 0}.ToString() + "+1"s});
+    }
+    std::vector<std::pair<Position, std::string>> grid;
+    for (int row = 0; row < 200; ++row) {
+        grid.push_back({{row, 0}, std::to_string(row)});
+        for (int col = 1; col < 20; ++col) {
+            std::string left = Position{row, col - 1}.ToString();
+            std::string up = row > 0 ? Position{row - 1, col}.ToString() : "0"s;
+            grid.push_back({{row, col}, "="s + left + "+"s + up + "+SUM(A1:A16)"s});
+        }
+    }
+
+    for (const auto& [name, edits] : {std::pair{"chain 5000"sv, &chain}, std::pair{"grid 20x200"sv, &grid}}) {
+        {
+            Sheet sheet;
+            LOG_DURATION("SetCell load "s + std::string(name));
+            for (const auto& [pos, text] : *edits) {
+                sheet.SetCell(pos, text);
+            }
+        }
+        {
+            Sheet sheet;
+            LOG_DURATION("SetCells load "s + std::string(name));
+            sheet.SetCells(*edits);
+        }
+    }
+}
+
+// 16000 rows of 32 numbers and 32 formulas over them: saved once, then
+// loaded from the snapshot and, for comparison, by setting all the texts again
+void BenchSnapshot() {
+    std::vector<std::pair<Position, std::string>> edits;
+    for (int row = 0; row < 16'000; ++row) {
+        for (int col = 0; col < 32; ++col) {
+            edits.push_back({{row, col}, std::to_string(row * 32 + col)});
+        }
+        for (int col = 32; col < 64; ++col) {
+            std::string left = Position{row, col - 32}.ToString();
+            std::string next = Position{row, col - 31}.ToString();
+            std::string text = col % 8 == 0 ? "=SUM("s + left + ":"s + Position{row, col - 25}.ToString() + ")"s
+                                             : "="s + left + "*2+"s + next + "/3"s;
+            edits.push_back({{row, col}, std::move(text)});
+        }
+    }
+    Sheet sheet;
+    sheet.SetCells(edits);
+    std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+    {
+        LOG_DURATION("Snapshot save 1M cells"s);
+        Snapshot::Save(sheet, path);
+    }
+    std::cerr << "Snapshot size: "sv << std::filesystem::file_size(path) / (1024.0 * 1024.0) << " MiB"sv << std::endl;
+    std::unique_ptr<Sheet> loaded;
+    {
+        LOG_DURATION("Snapshot load 1M cells"s);
+        loaded = Snapshot::Load(path);
+    }
+    {
+        Sheet replayed;
+        LOG_DURATION("SetCells load 1M cells"s);
+        replayed.SetCells(edits);
+    }
+    g_sink = loaded->GetDependencyGraph().GetEdgeCount();
+    std::remove(path.c_str());
+}
+
+// A TSV dump of 16000 rows x 40 fields: numbers, texts and formulas over them
+void BenchImportDelimited() {
+    std::ostringstream dump;
+    for (int row = 0; row < 16'000; ++row) {
+        for (int col = 0; col < 40; ++col) {
+            if (col > 0) {
+                dump << '\t';
+            }
+            if (col % 4 == 0) {
+                dump << "name_"sv << row << '_' << col;
+            } else if (col % 4 == 3) {
+                dump << '=' << Position{row, col - 2}.ToString() << "*2+"sv << Position{row, col - 1}.ToString();
+            } else {
+                dump << row * 0.25 + col;
+            }
+        }
+        dump << '\n';
+    }
+    const std::string data = dump.str();
+    const double megabytes = data.size() / (1024.0 * 1024.0);
+    using Clock = std::chrono::steady_clock;
+    const double cells = 16'000.0 * 40;
+    auto report = [megabytes, cells](std::string_view name, Clock::duration duration, size_t allocations) {
+        double seconds = std::chrono::duration<double>(duration).count();
+        std::cerr << name << ": "sv << megabytes / seconds << " MB/s ("sv << seconds * 1000 << " ms for "sv << megabytes
+                  << " MB), "sv << static_cast<double>(allocations) / cells << " allocations/cell"sv << std::endl;
+    };
+
+    {
+        Sheet sheet;
+        size_t allocations = g_allocation_count.load();
+        auto start = Clock::now();
+        std::istringstream input(data);
+        std::string line;
+        for (int row = 0; std::getline(input, line); ++row) {
+            std::istringstream fields(line);
+            std::string field;
+            for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                sheet.SetCell({row, col}, field);
+            }
+        }
+        report("Import TSV with getline + SetCell"sv, Clock::now() - start, g_allocation_count.load() - allocations);
+    }
+    for (size_t threads : {1, 2, 4, 8}) {
+        Sheet sheet;
+        ImportOptions options;
+        options.thread_count = threads;
+        size_t allocations = g_allocation_count.load();
+        auto start = Clock::now();
+        std::istringstream input(data);
+        ImportDelimited(sheet, input, options);
+        report("ImportDelimited TSV, "s + std::to_string(threads) + " threads"s, Clock::now() - start,
+               g_allocation_count.load() - allocations);
+    }
+}
+
+// Counts the bytes written to it and drops them
+class CountingBuffer : public std::streambuf {
+public:
+    size_t GetSize() const {
+        return size_;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        ++size_;
+        return ch;
+    }
+    std::streamsize xsputn(const char* /* data */, std::streamsize count) override {
+        size_ += count;
+        return count;
+    }
+
+private:
+    size_t size_ = 0;
+};
+
+void BenchExportDelimited() {
+    const int rows = 16'000;
+    const int cols = 64;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> edits;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            std::string text;
+            if (col % 4 == 0) {
+                text = "name_"s + std::to_string(row) + '_' + std::to_string(col);
+            } else if (col % 4 == 3) {
+                text = '=' + Position{row, col - 2}.ToString() + "/3+"s + Position{row, col - 1}.ToString();
+            } else {
+                text = std::to_string(row * 0.25 + col);
+            }
+            edits.emplace_back(Position{row, col}, std::move(text));
+        }
+    }
+    sheet.SetCells(std::move(edits));
+    // evaluation is not what is measured here
+    sheet.RecalculateAll();
+
+    using Clock = std::chrono::steady_clock;
+    auto measure = [](std::string_view name, auto func) {
+        CountingBuffer buffer;
+        std::ostream output(&buffer);
+        auto start = Clock::now();
+        func(output);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double megabytes = buffer.GetSize() / (1024.0 * 1024.0);
+        std::cerr << name << ": "sv << megabytes / seconds << " MB/s ("sv << seconds * 1000 << " ms for "sv
+                  << megabytes << " MB)"sv << std::endl;
+    };
+    // what PrintValues did before: a stream operation per cell
+    auto print_by_cell = [&sheet](std::ostream& output, bool texts) {
+        Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    output << '\t';
+                }
+                const CellInterface* cell = sheet.GetCell({row, col});
+                if (!cell) {
+                    continue;
+                }
+                if (texts) {
+                    output << cell->GetText();
+                } else {
+                    std::visit([&output](const auto& x) { output << x; }, cell->GetValue());
+                }
+            }
+            output << '\n';
+        }
+    };
+
+    measure("Export 1M values, iostream per cell"sv, [&](std::ostream& output) {
+        print_by_cell(output, false);
+    });
+    measure("Export 1M values, PrintValues"sv, [&](std::ostream& output) {
+        sheet.PrintValues(output);
+    });
+    measure("Export 1M texts, PrintTexts (formula texts printed)"sv, [&](std::ostream& output) {
+        sheet.PrintTexts(output);
+    });
+    measure("Export 1M texts, iostream per cell (formula texts cached)"sv, [&](std::ostream& output) {
+        print_by_cell(output, true);
+    });
+    measure("Export 1M texts, PrintTexts (formula texts cached)"sv, [&](std::ostream& output) {
+        sheet.PrintTexts(output);
+    });
+    for (size_t threads : {2, 4}) {
+        ExportOptions options;
+        options.thread_count = threads;
+        measure("ExportDelimited 1M values, "s + std::to_string(threads) + " threads"s, [&](std::ostream& output) {
+            ExportDelimited(sheet, output, options);
+        });
+    }
+    ExportOptions options;
+    options.thread_count = 1;
+    options.area = Range{{rows / 2, 10}, {rows / 2 + 999, 19}};
+    measure("ExportDelimited 1000x10 values from the middle"sv, [&](std::ostream& output) {
+        ExportDelimited(sheet, output, options);
+    });
+}
+
+// Formulas of a typical size, with a few references and constants
+std::vector<std::string> MakeFormulaTexts(int count) {
+    std::vector<std::string> formulas;
+    for (int row = 0; row < count; ++row) {
+        std::string r = std::to_string(row % 16'000 + 1);
+        formulas.push_back("A"s + r + "+B"s + r + "*2-(C"s + r + "-1.5)/D"s + r);
+    }
+    return formulas;
+}
+
+void BenchFormulaMemory() {
+    const int count = 100'000;
+    std::vector<std::string> texts = MakeFormulaTexts(count);
+    // both parts run before anything is freed, so the growth is not hidden by reused memory
+    auto sheet = CreateSheet();
+    MeasureMemory("Set 100k formula cells"sv, count, [&] {
+        for (int row = 0; row < count; ++row) {
+            sheet->SetCell({row % 16'000, 4 + row / 16'000}, "="s + texts[row]);
+        }
+    });
+    std::vector<FormulaAST> asts;
+    asts.reserve(count);
+    MeasureMemory("Parse 100k ASTs"sv, count, [&] {
+        for (const auto& text : texts) {
+            asts.push_back(ParseFormulaAST(text));
+        }
+    });
+    // the copies of a formula along a column share the tree of the first one
+    FormulaTemplates templates;
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(count);
+    MeasureMemory("Parse 100k formulas through templates"sv, count, [&] {
+        LOG_DURATION("Parse 100k formulas through templates"s);
+        for (int row = 0; row < count; ++row) {
+            formulas.push_back(templates.Parse(texts[row], {row % 16'000, 4 + row / 16'000}));
+        }
+    });
+    {
+        LOG_DURATION("Free 100k ASTs"s);
+        asts.clear();
+        formulas.clear();
+    }
+    LOG_DURATION("Clear 100k formula cells"s);
+    for (int row = 0; row < count; ++row) {
+        sheet->ClearCell({row % 16'000, 4 + row / 16'000});
+    }
+}
+// 10M cells, 10000 rows of 1000: mostly numbers, a column in ten of short words
+// and one of formulas reading the number on their left. Reports the SetCell
+// throughput and the memory the sheet takes per cell.
+void BenchCellLayout() {
+    using Clock = std::chrono::steady_clock;
+    const int rows = 10'000;
+    const int cols = 1'000;
+    const double count = static_cast<double>(rows) * cols;
+    size_t allocations = g_allocation_count.load();
+    size_t rss = GetRssKiB();
+    auto start = Clock::now();
+    auto sheet = CreateSheet();
+    std::string text;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            if (col % 10 == 5) {
+                text = "item "s + std::to_string(col);
+            }
+            else if (col % 10 == 9) {
+                // the same formula down the column, as a copy would make it
+                text = "="s + Position{row, col - 1}.ToString() + "*2"s;
+            }
+            else {
+                text = std::to_string(row * cols + col);
+            }
+            sheet->SetCell({row, col}, std::move(text));
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    allocations = g_allocation_count.load() - allocations;
+    std::cerr << "SetCell 10M cells: "sv << elapsed.count() / count << " ns/cell, "sv
+              << static_cast<double>(allocations) / count << " allocations/cell, "sv
+              << static_cast<double>(GetRssKiB() - rss) * 1024 / count << " bytes/cell"sv << std::endl;
+    LOG_DURATION("Free 10M cells"s);
+    sheet.reset();
+}
+
+// 16000 rows of an id, 100 labels out of 64 and a formula: the memory and
+// the load time of 1.6M cells, nearly all of them repeating a few texts
+void BenchLowCardinalityTexts() {
+    Workload workload = MakeLowCardinality(16'000, 100, 64, 42);
+    size_t count = workload.cells.size();
+    auto sheet = std::make_unique<Sheet>();
+    MeasureMemory("SetCell 1.6M cells of 64 labels"sv, count, [&] {
+        LOG_DURATION("SetCell 1.6M cells of 64 labels"s);
+        for (auto& [pos, text] : workload.cells) {
+            sheet->SetCell(pos, std::move(text));
+        }
+    });
+    std::cerr << "Distinct pooled texts: "sv << sheet->GetTextPool().GetTextCount() << std::endl;
+}
+
+// How callers serialize access to the sheet on top of its own locking
+enum class ExternalLock {
+    None,
+    // one mutex around the whole sheet, as callers had to do before
+    Mutex,
+    SharedMutex,
+};
+
+// Reader threads read random formula cells while the writer, if any, edits
+// their inputs every 100 us
+void MeasureConcurrentReads(std::string_view name, ExternalLock external, size_t reader_count, bool with_writer) {
+    using Clock = std::chrono::steady_clock;
+    const int rows = 10'000;
+    const size_t reads_per_thread = 200'000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, r);
+        sheet.SetCell({row, 1}, "=A"s + r + "*2+1"s);
+    }
+    std::mutex mutex;
+    std::shared_mutex shared_mutex;
+    auto read = [&](Position pos) {
+        switch (external) {
+            case ExternalLock::Mutex: {
+                std::lock_guard lock(mutex);
+                return sheet.GetCell(pos)->GetValue();
+            }
+            case ExternalLock::SharedMutex: {
+                std::shared_lock lock(shared_mutex);
+                return sheet.GetCell(pos)->GetValue();
+            }
+            default:
+                return sheet.GetCell(pos)->GetValue();
+        }
+    };
+    auto write = [&](Position pos, std::string text) {
+        switch (external) {
+            case ExternalLock::Mutex: {
+                std::lock_guard lock(mutex);
+                sheet.SetCell(pos, std::move(text));
+                break;
+            }
+            case ExternalLock::SharedMutex: {
+                std::lock_guard lock(shared_mutex);
+                sheet.SetCell(pos, std::move(text));
+                break;
+            }
+            default:
+                sheet.SetCell(pos, std::move(text));
+        }
+    };
+
+    std::atomic<bool> done{false};
+    size_t writes = 0;
+    std::atomic<size_t> errors{0};
+    auto start = Clock::now();
+    std::thread writer;
+    if (with_writer) {
+        writer = std::thread([&] {
+            std::mt19937 gen(7);
+            while (!done.load()) {
+                write({static_cast<int>(gen() % rows), 0}, std::to_string(gen() % 100));
+                ++writes;
+                std::this_thread::sleep_for(100us);
+            }
+        });
+    }
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < reader_count; ++i) {
+        readers.emplace_back([&, i] {
+            std::mt19937 gen(static_cast<unsigned>(i));
+            size_t local_errors = 0;
+            for (size_t j = 0; j < reads_per_thread; ++j) {
+                local_errors += std::holds_alternative<FormulaError>(read({static_cast<int>(gen() % rows), 1}));
+            }
+            errors += local_errors;
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    done = true;
+    if (writer.joinable()) {
+        writer.join();
+    }
+    g_sink = errors.load();
+    std::cerr << name << ", "sv << reader_count << " readers"sv << (with_writer ? " + writer"sv : ""sv) << ": "sv
+              << reader_count * reads_per_thread / elapsed / 1e6 << " M reads/s"sv;
+    if (with_writer) {
+        std::cerr << ", "sv << writes << " writes"sv;
+    }
+    std::cerr << std::endl;
+}
+
+void BenchConcurrentReads() {
+    size_t reader_count = std::max(4u, std::thread::hardware_concurrency());
+    for (bool with_writer : {false, true}) {
+        MeasureConcurrentReads("Concurrent reads, sheet locks"sv, ExternalLock::None, reader_count, with_writer);
+        MeasureConcurrentReads("Concurrent reads, global mutex"sv, ExternalLock::Mutex, reader_count, with_writer);
+        MeasureConcurrentReads("Concurrent reads, std::shared_mutex"sv, ExternalLock::SharedMutex, reader_count,
+                               with_writer);
+    }
+}
+
+// The same scenarios for every workload; the sheet is loaded untimed when
+// the filter leaves out set_cell
+void RunWorkloadScenarios(Reporter& reporter, const Workload& workload) {
+    auto scenario = [&](std::string_view suffix) {
+        return workload.name + "/"s + std::string(suffix);
+    };
+    const std::string_view suffixes[] = {"set_cell"sv,      "get_value_cold"sv, "get_value_hot"sv,
+                                         "read_values"sv,   "read_value_views"sv, "edit_and_read"sv,
+                                         "print_values"sv, "parse_formula"sv};
+    if (std::none_of(std::begin(suffixes), std::end(suffixes),
+                     [&](std::string_view suffix) { return reporter.IsSelected(scenario(suffix)); })) {
+        return;
+    }
+    const auto& cells = workload.cells;
+    const auto& probes = workload.probes;
+    auto sheet = CreateSheet();
+    reporter.Run(scenario("set_cell"sv), cells.size(), 1, [&](size_t i) {
+        sheet->SetCell(cells[i].first, cells[i].second);
+    });
+    if (!reporter.IsSelected(scenario("set_cell"sv))) {
+        for (const auto& [pos, text] : cells) {
+            sheet->SetCell(pos, text);
+        }
+    }
+    auto read = [&](size_t i) {
+        g_sink = sheet->GetCell(probes[i % probes.size()])->GetValue().index();
+    };
+    // every probe is evaluated once, its precedents are cached already
+    reporter.Run(scenario("get_value_cold"sv), probes.size(), 1, read);
+    size_t rounds = std::max<size_t>(1, 200'000 / probes.size());
+    reporter.Run(scenario("get_value_hot"sv), probes.size() * rounds, 64, read);
+    // every cell, texts included, with and without copying the text
+    size_t cell_rounds = std::max<size_t>(1, 200'000 / cells.size());
+    reporter.Run(scenario("read_values"sv), cells.size() * cell_rounds, 64, [&](size_t i) {
+        g_sink = sheet->GetCell(cells[i % cells.size()].first)->GetValue().index();
+    });
+    reporter.Run(scenario("read_value_views"sv), cells.size() * cell_rounds, 64, [&](size_t i) {
+        g_sink = sheet->GetCell(cells[i % cells.size()].first)->GetValueView().index();
+    });
+    // an edit of the hot input and a read of every probe
+    reporter.Run(scenario("edit_and_read"sv), 20, 1, [&](size_t i) {
+        sheet->SetCell(workload.hot_input, std::to_string(i + 1000));
+        for (size_t probe = 0; probe < probes.size(); ++probe) {
+            read(probe);
+        }
+    });
+    CountingBuffer buffer;
+    std::ostream output(&buffer);
+    reporter.Run(scenario("print_values"sv), 3, 1, [&](size_t /* i */) {
+        sheet->PrintValues(output);
+    });
+    std::vector<std::string> expressions;
+    for (const auto& [pos, text] : cells) {
+        if (text[0] == FORMULA_SIGN) {
+            expressions.push_back(text.substr(1));
+        }
+    }
+    reporter.Run(scenario("parse_formula"sv), expressions.size(), 16, [&](size_t i) {
+        g_sink = ParseFormula(expressions[i])->GetReferencedCells().size();
+    });
+}
+
+void RunScenarios(Reporter& reporter, uint32_t seed) {
+    for (const Workload& workload : {MakeDenseGrid(200, 50, seed), MakeChain(5'000), MakeFanOut(10'000),
+                                     MakeSparseRandom(20'000, 4096, 256, seed), MakeCopyFilledColumns(5'000, 4, seed),
+                                     MakeTextHeavy(5'000, 8, seed), MakeLowCardinality(5'000, 8, 64, seed)}) {
+        RunWorkloadScenarios(reporter, workload);
+    }
+}
+}  // namespace
+
+// spreadsheet_bench [--filter=TEXT] [--json=PATH] [--seed=N]
+//
+// Runs the benchmarks whose names contain the filter text. The scenarios of
+// the synthetic workloads are named <workload>/<scenario>; their results go
+// to the JSON file as well.
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string json_path;
+    uint32_t seed = 42;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&](std::string_view option) {
+            return arg.substr(0, option.size()) == option ? std::optional(arg.substr(option.size())) : std::nullopt;
+        };
+        if (auto text = value("--filter="sv)) {
+            filter = std::string(*text);
+        }
+        else if (auto path = value("--json="sv)) {
+            json_path = std::string(*path);
+        }
+        else if (auto number = value("--seed="sv)) {
+            seed = static_cast<uint32_t>(std::stoul(std::string(*number)));
+        }
+        else {
+            std::cerr << "Usage: "sv << argv[0] << " [--filter=TEXT] [--json=PATH] [--seed=N]"sv << std::endl;
+            return 1;
+        }
+    }
+
+    Reporter reporter(filter);
+    const std::pair<std::string_view, void (*)()> benches[] = {
+        // goes first, while the heap is still fresh
+        {"FormulaMemory"sv, BenchFormulaMemory},
+        {"SetCellDense"sv, BenchSetCellDense},
+        {"SetCellSparseRandom"sv, BenchSetCellSparseRandom},
+        {"SetCellSingleColumn"sv, BenchSetCellSingleColumn},
+        {"InvalidationChain"sv, BenchInvalidationChain},
+        {"InvalidationFanOut"sv, BenchInvalidationFanOut},
+        {"FormulaEvaluation"sv, BenchFormulaEvaluation},
+        {"ErrorCascade"sv, BenchErrorCascade},
+        {"NumericTextReferences"sv, BenchNumericTextReferences},
+        {"TextReads"sv, BenchTextReads},
+        {"LowCardinalityTexts"sv, BenchLowCardinalityTexts},
+        {"FormulaParsing"sv, BenchFormulaParsing},
+        {"PositionCodecs"sv, BenchPositionCodecs},
+        {"RangeAggregates"sv, BenchRangeAggregates},
+        {"RecalculateAll"sv, BenchRecalculateAll},
+        {"BulkLoad"sv, BenchBulkLoad},
+        {"Snapshot"sv, BenchSnapshot},
+        {"ImportDelimited"sv, BenchImportDelimited},
+        {"ExportDelimited"sv, BenchExportDelimited},
+        {"ConcurrentReads"sv, BenchConcurrentReads},
+        // last, it takes a few seconds and a GiB
+        {"CellLayout"sv, BenchCellLayout},
+    };
+    for (auto [name, bench] : benches) {
+        if (reporter.IsSelected(name)) {
+            bench();
+        }
+    }
+    RunScenarios(reporter, seed);
+
+    if (!json_path.empty()) {
+        std::ofstream output(json_path);
+        reporter.WriteJson(output);
+        if (!output) {
+            std::cerr << "Cannot write "sv << json_path << std::endl;
+            return 1;
+        }
+    }
+}
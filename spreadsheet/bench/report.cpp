@@ -0,0 +1,108 @@
+#include "report.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+// nearest rank of the sorted samples
+double GetPercentile(const std::vector<double>& sorted, double percent) {
+    size_t rank = static_cast<size_t>(std::ceil(percent / 100 * static_cast<double>(sorted.size())));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+void WriteJsonString(std::ostream& output, std::string_view text) {
+    output << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            output << '\\';
+        }
+        output << c;
+    }
+    output << '"';
+}
+}  // namespace
+
+double ScenarioResult::GetOpsPerSecond() const {
+    return seconds > 0 ? static_cast<double>(ops) / seconds : 0;
+}
+
+Reporter::Reporter(std::string filter)
+    : filter_(std::move(filter)) {
+}
+
+bool Reporter::IsSelected(std::string_view name) const {
+    return name.find(filter_) != std::string_view::npos;
+}
+
+void Reporter::WriteJson(std::ostream& stream) const {
+    // the precision of the caller's stream stays as it is
+    std::ostringstream output;
+    output.precision(12);
+    output << "{\"results\": ["sv;
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const ScenarioResult& result = results_[i];
+        output << (i > 0 ? ",\n  "sv : "\n  "sv) << "{\"name\": "sv;
+        WriteJsonString(output, result.name);
+        output << ", \"ops\": "sv << result.ops << ", \"seconds\": "sv << result.seconds
+               << ", \"ops_per_second\": "sv << result.GetOpsPerSecond() << ", \"p50_ns\": "sv << result.p50_ns
+               << ", \"p90_ns\": "sv << result.p90_ns << ", \"p99_ns\": "sv << result.p99_ns
+               << ", \"max_ns\": "sv << result.max_ns << ", \"peak_rss_kib\": "sv << result.peak_rss_kib << '}';
+    }
+    output << "\n]}\n"sv;
+    stream << output.str();
+}
+
+void Reporter::ResetPeakRss() {
+#ifdef __linux__
+    // may be refused, e.g. in a sandbox
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+#endif
+}
+
+size_t Reporter::GetPeakRssKiB() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:"sv, 0) == 0) {
+            return std::stoul(line.substr(6));
+        }
+    }
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return 0;
+#endif
+}
+
+void Reporter::Add(std::string_view name, size_t ops, double seconds, std::vector<double>& sample_ns) {
+    std::sort(sample_ns.begin(), sample_ns.end());
+    ScenarioResult result;
+    result.name = std::string(name);
+    result.ops = ops;
+    result.seconds = seconds;
+    result.p50_ns = GetPercentile(sample_ns, 50);
+    result.p90_ns = GetPercentile(sample_ns, 90);
+    result.p99_ns = GetPercentile(sample_ns, 99);
+    result.max_ns = sample_ns.back();
+    result.peak_rss_kib = GetPeakRssKiB();
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << result.name << ": "sv << result.GetOpsPerSecond() << " ops/s, p50 "sv
+         << result.p50_ns << " ns, p90 "sv << result.p90_ns << " ns, p99 "sv << result.p99_ns << " ns, max "sv
+         << result.max_ns << " ns, peak RSS "sv << result.peak_rss_kib / 1024.0 << " MiB"sv;
+    std::cerr << line.str() << std::endl;
+    results_.push_back(std::move(result));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ScenarioResult {
+    std::string name;
+    size_t ops = 0;
+    double seconds = 0;
+    // latency of one op in nanoseconds
+    double p50_ns = 0;
+    double p90_ns = 0;
+    double p99_ns = 0;
+    double max_ns = 0;
+    // the peak resident set while the scenario ran, 0 where it is unknown
+    size_t peak_rss_kib = 0;
+
+    double GetOpsPerSecond() const;
+};
+
+// Runs the scenarios the filter selects, prints each result to stderr and
+// keeps them for the machine-readable output
+class Reporter {
+public:
+    // an empty filter selects everything, otherwise the names containing it
+    explicit Reporter(std::string filter = {});
+
+    bool IsSelected(std::string_view name) const;
+
+    // Calls op(i) for i in [0, ops). The calls are timed in batches of
+    // `batch`, so that the clock doesn't dominate ops of a few nanoseconds;
+    // the percentiles are then of the batch means.
+    template <typename Op>
+    void Run(std::string_view name, size_t ops, size_t batch, Op op) {
+        if (!IsSelected(name) || ops == 0) {
+            return;
+        }
+        using Clock = std::chrono::steady_clock;
+        std::vector<double> sample_ns;
+        sample_ns.reserve((ops + batch - 1) / batch);
+        ResetPeakRss();
+        auto start = Clock::now();
+        for (size_t first = 0; first < ops; first += batch) {
+            size_t last = std::min(ops, first + batch);
+            auto batch_start = Clock::now();
+            for (size_t i = first; i < last; ++i) {
+                op(i);
+            }
+            std::chrono::duration<double, std::nano> elapsed = Clock::now() - batch_start;
+            sample_ns.push_back(elapsed.count() / static_cast<double>(last - first));
+        }
+        std::chrono::duration<double> total = Clock::now() - start;
+        Add(name, ops, total.count(), sample_ns);
+    }
+
+    const std::vector<ScenarioResult>& GetResults() const {
+        return results_;
+    }
+
+    // {"results": [{"name": ..., "ops": ..., ...}, ...]}
+    void WriteJson(std::ostream& stream) const;
+
+private:
+    std::string filter_;
+    std::vector<ScenarioResult> results_;
+
+    // Makes the kernel count the peak anew where it can (Linux clear_refs);
+    // elsewhere the peak stays the one of the whole process
+    static void ResetPeakRss();
+    static size_t GetPeakRssKiB();
+    void Add(std::string_view name, size_t ops, double seconds, std::vector<double>& sample_ns);
+};
@@ -0,0 +1,182 @@
+#include "workloads.h"
+
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+
+using namespace std::literals;
+
+namespace {
+// the first cells of a sparse sheet take half of the references
+const size_t HUB_COUNT = 16;
+
+// The output of the engine is fixed by the standard, the one of the
+// distributions differs between standard libraries
+uint32_t Draw(std::mt19937& gen, uint32_t bound) {
+    return static_cast<uint32_t>(gen() % bound);
+}
+
+std::string MakeNumber(std::mt19937& gen) {
+    return std::to_string(Draw(gen, 1000));
+}
+}  // namespace
+
+Workload MakeDenseGrid(int rows, int cols, uint32_t seed) {
+    std::mt19937 gen(seed);
+    Workload workload;
+    workload.name = "dense_"s + std::to_string(rows) + "x"s + std::to_string(cols);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.emplace_back(Position{row, 0}, MakeNumber(gen));
+        for (int col = 1; col < cols; ++col) {
+            std::string left = Position{row, col - 1}.ToString();
+            std::string up_left = Position{std::max(row - 1, 0), col - 1}.ToString();
+            workload.cells.emplace_back(Position{row, col}, "="s + left + "*0.5+"s + up_left + "/3"s);
+        }
+        workload.probes.push_back({row, cols - 1});
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
+
+Workload MakeChain(int length) {
+    Workload workload;
+    workload.name = "chain_"s + std::to_string(length);
+    workload.cells.emplace_back(Position{0, 0}, "1"s);
+    for (int row = 1; row < length; ++row) {
+        workload.cells.emplace_back(Position{row, 0}, "="s + Position{row - 1, 0}.ToString() + "+1"s);
+        workload.probes.push_back({row, 0});
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
+
+Workload MakeFanOut(int width) {
+    Workload workload;
+    workload.name = "fan_out_"s + std::to_string(width);
+    workload.cells.emplace_back(Position{0, 0}, "1"s);
+    for (int row = 0; row < width; ++row) {
+        workload.cells.emplace_back(Position{row, 1}, "=A1*"s + std::to_string(row + 1));
+        workload.probes.push_back({row, 1});
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
+
+Workload MakeSparseRandom(size_t count, int rows, int cols, uint32_t seed) {
+    std::mt19937 gen(seed);
+    Workload workload;
+    workload.name = "sparse_random_"s + std::to_string(count) + "_in_"s + std::to_string(rows) + "x"s +
+                    std::to_string(cols);
+    std::unordered_set<Position, PositionHasher> used;
+    std::vector<size_t> reference_counts;
+    while (workload.cells.size() < count) {
+        Position pos{static_cast<int>(Draw(gen, rows)), static_cast<int>(Draw(gen, cols))};
+        if (!used.insert(pos).second) {
+            continue;
+        }
+        size_t index = workload.cells.size();
+        reference_counts.push_back(0);
+        if (index < HUB_COUNT || Draw(gen, 3) != 0) {
+            workload.cells.emplace_back(pos, MakeNumber(gen));
+            continue;
+        }
+        std::string text = "="s;
+        for (uint32_t i = 0, refs = 1 + Draw(gen, 4); i < refs; ++i) {
+            size_t target = Draw(gen, 2) == 0 ? Draw(gen, HUB_COUNT) : Draw(gen, static_cast<uint32_t>(index));
+            ++reference_counts[target];
+            text += (i > 0 ? "+"s : ""s) + workload.cells[target].first.ToString();
+        }
+        workload.cells.emplace_back(pos, std::move(text));
+        workload.probes.push_back(pos);
+    }
+    size_t hot = std::max_element(reference_counts.begin(), reference_counts.end()) - reference_counts.begin();
+    workload.hot_input = workload.cells[hot].first;
+    return workload;
+}
+
+Workload MakeCopyFilledColumns(int rows, int formula_cols, uint32_t seed) {
+    // {L} is the left neighbour, {A} the number of the row
+    static const std::vector<std::string> patterns = {
+        "={L}*2+1"s,
+        "={L}-{A}/3"s,
+        "=SUM({A}:{L})"s,
+        "=({L}+{A})*0.5"s,
+    };
+    std::mt19937 gen(seed);
+    Workload workload;
+    workload.name = "copy_filled_"s + std::to_string(rows) + "x"s + std::to_string(formula_cols);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.emplace_back(Position{row, 0}, MakeNumber(gen));
+        std::string number = Position{row, 0}.ToString();
+        for (int col = 1; col <= formula_cols; ++col) {
+            std::string left = Position{row, col - 1}.ToString();
+            std::string text;
+            for (const char* p = patterns[(col - 1) % patterns.size()].c_str(); *p; ++p) {
+                if (p[0] == '{' && p[2] == '}') {
+                    text += p[1] == 'L' ? left : number;
+                    p += 2;
+                }
+                else {
+                    text += *p;
+                }
+            }
+            workload.cells.emplace_back(Position{row, col}, std::move(text));
+            workload.probes.push_back({row, col});
+        }
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
+
+Workload MakeTextHeavy(int rows, int text_cols, uint32_t seed) {
+    static const std::vector<std::string> words = {
+        "revenue"s, "forecast"s, "quarterly"s, "adjusted"s, "region"s, "north"s, "south"s, "total"s,
+        "pending"s, "approved"s, "invoice"s, "customer"s, "shipment"s, "delayed"s, "returned"s, "notes"s,
+    };
+    std::mt19937 gen(seed);
+    Workload workload;
+    workload.name = "text_heavy_"s + std::to_string(rows) + "x"s + std::to_string(text_cols);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.emplace_back(Position{row, 0}, std::to_string(Draw(gen, 1000)));
+        for (int col = 1; col <= text_cols; ++col) {
+            // an escape sign in one cell of eight, the value drops it
+            std::string text = Draw(gen, 8) == 0 ? "'"s : ""s;
+            for (uint32_t i = 0, count = 3 + Draw(gen, 4); i < count; ++i) {
+                text += (i > 0 ? " "s : ""s) + words[Draw(gen, static_cast<uint32_t>(words.size()))];
+            }
+            workload.cells.emplace_back(Position{row, col}, std::move(text));
+        }
+        Position formula{row, text_cols + 1};
+        workload.cells.emplace_back(formula, "="s + Position{row, 0}.ToString() + "*2"s);
+        workload.probes.push_back(formula);
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
+
+Workload MakeLowCardinality(int rows, int label_cols, uint32_t label_count, uint32_t seed) {
+    static const std::vector<std::string> words = {
+        "north"s, "south"s, "east"s, "west"s, "pending"s, "approved"s, "shipped"s, "returned"s,
+    };
+    // "approved / east / category 12", long enough to leave the small string buffer
+    std::vector<std::string> labels;
+    for (uint32_t i = 0; i < label_count; ++i) {
+        labels.push_back(words[i % words.size()] + " / "s + words[i / words.size() % words.size()] +
+                         " / category "s + std::to_string(i));
+    }
+    std::mt19937 gen(seed);
+    Workload workload;
+    workload.name = "low_cardinality_"s + std::to_string(rows) + "x"s + std::to_string(label_cols) + "_of_"s +
+                    std::to_string(label_count);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.emplace_back(Position{row, 0}, std::to_string(row + 1));
+        for (int col = 1; col <= label_cols; ++col) {
+            workload.cells.emplace_back(Position{row, col}, labels[Draw(gen, label_count)]);
+        }
+        Position formula{row, label_cols + 1};
+        workload.cells.emplace_back(formula, "="s + Position{row, 0}.ToString() + "*2"s);
+        workload.probes.push_back(formula);
+    }
+    workload.hot_input = {0, 0};
+    return workload;
+}
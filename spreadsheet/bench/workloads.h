@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A sheet to benchmark. The cells come from a seed alone, so every run and
+// every machine builds the same sheet, and they are in an order in which
+// SetCell accepts them: a formula only reads cells set before it.
+struct Workload {
+    std::string name;
+    std::vector<std::pair<Position, std::string>> cells;
+    // formula cells the read scenarios ask for, precedents first
+    std::vector<Position> probes;
+    // the input whose edit invalidates the most probes
+    Position hot_input;
+};
+
+// Numbers in column A, every other cell reads its left and upper-left neighbours
+Workload MakeDenseGrid(int rows, int cols, uint32_t seed);
+// A1 is a number, every next row of column A reads the row above
+Workload MakeChain(int length);
+// `width` formulas in column B that all read the number in A1
+Workload MakeFanOut(int width);
+// `count` cells at random positions of the first rows x cols; a third of them
+// are formulas reading up to four earlier cells, half of the reads going to
+// the first few cells so that some inputs have many dependants
+Workload MakeSparseRandom(size_t count, int rows, int cols, uint32_t seed);
+// Numbers in column A and `formula_cols` columns with one formula filled down
+Workload MakeCopyFilledColumns(int rows, int formula_cols, uint32_t seed);
+// Mostly text: numbers written as text in column A, `text_cols` columns of
+// words too long for the small string buffer, some of them escaped, and a
+// formula column doubling column A
+Workload MakeTextHeavy(int rows, int text_cols, uint32_t seed);
+// An imported table: an id in column A, `label_cols` columns of labels drawn
+// from `label_count` categories and a formula column doubling the id
+Workload MakeLowCardinality(int rows, int label_cols, uint32_t label_count, uint32_t seed);
@@ -1,168 +1,708 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
 #include <string>
 #include <optional>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
-// ===== Empty cell impl ======
+namespace {
+const std::vector<Position> NO_REFERENCES;
+const std::vector<Range> NO_RANGES;
 
-Cell::Value Cell::EmptyImpl::GetValue() const {
-    return 0.0;
-}
+// Evaluations nest as a formula reads cells that aren't evaluated yet; past
+// this depth the rest of the chain is evaluated from the bottom instead
+const size_t MAX_EVALUATION_DEPTH = 256;
+thread_local size_t evaluation_depth = 0;
 
-std::string Cell::EmptyImpl::GetText() const {
-    using namespace std::literals;
-    return ""s;
+// Same rules as std::stod with the whole text consumed
+CellInterface::NumericValue ParseNumber(std::string_view text) {
+    if (text.empty()) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    // strtod wants a terminated string; the buffer is reused, so it doesn't allocate
+    thread_local std::string buffer;
+    buffer.assign(text);
+    char* end = nullptr;
+    errno = 0;
+    double result = std::strtod(buffer.c_str(), &end);
+    if (end != buffer.c_str() + buffer.size() || errno == ERANGE) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return result;
+}
+}  // namespace
+
+// ===== Text payload =====
+
+// A text that reads as a number, kept with the number. Such texts are mostly
+// unique, so they stay out of the pool. The characters follow the header in
+// the same allocation.
+struct Cell::NumberText {
+    double number;
+    size_t size;
+
+    static NumberText* Create(std::string_view text, double number) {
+        void* memory = ::operator new(sizeof(NumberText) + text.size());
+        NumberText* data = new (memory) NumberText{number, text.size()};
+        std::memcpy(data + 1, text.data(), text.size());
+        return data;
+    }
+    static void Destroy(NumberText* data) {
+        data->~NumberText();
+        ::operator delete(data);
+    }
+
+    std::string_view GetText() const {
+        return {reinterpret_cast<const char*>(this + 1), size};
+    }
+};
+
+// ===== Formula payload =====
+
+struct Cell::FormulaData {
+    std::unique_ptr<FormulaInterface> formula;
+    std::vector<Position> referenced_cells;
+    std::vector<Range> referenced_ranges;
+    // the canonical text, printed on first use by one of the readers
+    mutable std::atomic<const std::string*> text{nullptr};
+
+    explicit FormulaData(std::unique_ptr<FormulaInterface> formula)
+        : formula(std::move(formula)),
+          referenced_cells(this->formula->GetReferencedCells()),
+          referenced_ranges(this->formula->GetReferencedRanges()) {}
+
+    ~FormulaData() {
+        delete text.load(std::memory_order_relaxed);
+    }
+
+    std::string_view GetText() const {
+        const std::string* printed = text.load(std::memory_order_acquire);
+        if (!printed) {
+            // readers racing here print it each, the first copy stays
+            auto own = std::make_unique<const std::string>(FORMULA_SIGN + formula->GetExpression());
+            if (text.compare_exchange_strong(printed, own.get(), std::memory_order_acq_rel)) {
+                printed = own.release();
+            }
+        }
+        return *printed;
+    }
+};
+
+// ==== Parsed content ====
+
+Cell::Content::Content(PooledText* text)
+    : kind_(Kind::PooledText) {
+    payload_.pooled_text = text;
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-    return {};
+Cell::Content::Content(FormulaData* formula)
+    : kind_(Kind::Formula) {
+    payload_.formula = formula;
 }
 
-// ===== Text cell impl =====
+Cell::Content Cell::Content::FromNumberText(std::string_view text, double number) {
+    Content content;
+    if (text.size() <= SHORT_TEXT_SIZE) {
+        content.kind_ = Kind::ShortNumberText;
+        content.short_size_ = static_cast<uint8_t>(text.size());
+        std::memcpy(content.short_text_, text.data(), text.size());
+        content.payload_.number = number;
+    }
+    else {
+        content.kind_ = Kind::NumberText;
+        content.payload_.number_text = NumberText::Create(text, number);
+    }
+    return content;
+}
 
-Cell::TextImpl::TextImpl(std::string text)
-    : text_(std::move(text)) {}
+Cell::Content::Content(Content&& other) noexcept
+    : kind_(std::exchange(other.kind_, Kind::Empty)),
+    short_size_(other.short_size_),
+    payload_(other.payload_) {
+    if (kind_ == Kind::ShortNumberText) {
+        std::memcpy(short_text_, other.short_text_, short_size_);
+    }
+}
 
-Cell::Value Cell::TextImpl::GetValue() const {
-    if (text_[0] == ESCAPE_SIGN) {
-        return text_.substr(1);
+Cell::Content& Cell::Content::operator=(Content&& other) noexcept {
+    if (this != &other) {
+        Reset();
+        kind_ = std::exchange(other.kind_, Kind::Empty);
+        short_size_ = other.short_size_;
+        payload_ = other.payload_;
+        if (kind_ == Kind::ShortNumberText) {
+            std::memcpy(short_text_, other.short_text_, short_size_);
+        }
     }
-    else {
-        return text_;
+    return *this;
+}
+
+Cell::Content::~Content() {
+    Reset();
+}
+
+void Cell::Content::Reset() noexcept {
+    switch (kind_) {
+    case Kind::NumberText:
+        NumberText::Destroy(payload_.number_text);
+        break;
+    case Kind::PooledText:
+        TextPool::Release(payload_.pooled_text);
+        break;
+    case Kind::Formula:
+        delete payload_.formula;
+        break;
+    case Kind::Empty:
+    case Kind::ShortNumberText:
+        break;
     }
+    kind_ = Kind::Empty;
 }
 
-std::string Cell::TextImpl::GetText() const {
-    return text_;
+const PooledText* Cell::Content::GetPooledText() const {
+    return kind_ == Kind::PooledText ? payload_.pooled_text : nullptr;
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-    return {};
+const Cell::FormulaData* Cell::Content::GetFormulaData() const {
+    return kind_ == Kind::Formula ? payload_.formula : nullptr;
 }
 
-// ===== Formula cell impl =====
-Cell::FormulaImpl::FormulaImpl(std::string text, const Sheet& sheet)
-    : formula_(ParseFormula(text.substr(1))),
-      sheet_(sheet){}
+bool Cell::Content::IsNumberText() const {
+    return kind_ == Kind::ShortNumberText || kind_ == Kind::NumberText;
+}
+
+bool Cell::Content::IsText() const {
+    return IsNumberText() || kind_ == Kind::PooledText;
+}
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-    auto value = formula_->Evaluate(sheet_);
-    if (std::holds_alternative<double>(value)) {
-        return std::get<double>(value);
+double Cell::Content::GetNumber() const {
+    return kind_ == Kind::ShortNumberText ? payload_.number : payload_.number_text->number;
+}
+
+std::string_view Cell::Content::GetText() const {
+    switch (kind_) {
+    case Kind::ShortNumberText:
+        return {short_text_, short_size_};
+    case Kind::NumberText:
+        return payload_.number_text->GetText();
+    case Kind::PooledText:
+        return payload_.pooled_text->GetText();
+    case Kind::Formula:
+        return payload_.formula->GetText();
+    case Kind::Empty:
+        break;
     }
-    else {
-        return std::get<FormulaError>(value);
+    return {};
+}
+
+bool Cell::Content::HasSameText(const Content& other) const {
+    if (kind_ == Kind::PooledText) {
+        return other.kind_ == Kind::PooledText && payload_.pooled_text == other.payload_.pooled_text;
     }
+    return IsNumberText() && other.IsNumberText() && GetText() == other.GetText();
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_->GetExpression();
+const std::vector<Position>& Cell::Content::GetReferencedCells() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->referenced_cells : NO_REFERENCES;
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+const std::vector<Range>& Cell::Content::GetReferencedRanges() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->referenced_ranges : NO_RANGES;
 }
 
 // ==== Cell methods ====
 
-Cell::Cell(Sheet& sheet, Position pos)
-    : sheet_(sheet),
-    pos_(pos),
-    impl_(std::make_unique<EmptyImpl>()) {}
+Cell::Cell() noexcept
+    : cache_(PackedValue()) {}
+
+Cell::Cell(Content content) noexcept
+    : content_(std::move(content)),
+    cache_(PackedValue()) {}
 
 Cell::~Cell() = default;
 
-void Cell::Set(std::string text) {
-    using namespace std::literals;
+Cell::Content Cell::Parse(std::string_view text, Position pos, const Sheet& sheet) {
     if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
+        return Content();
     }
     else if (text.size() > 1 && text[0] == FORMULA_SIGN) {
-        impl_ = std::make_unique<FormulaImpl>(std::move(text), sheet_);
+        StatsRecorder& stats = sheet.GetStatsRecorder();
+        StatsRecorder::Timer timer(stats, SheetTimer::Parse);
+        stats.Add(SheetCounter::FormulaParses);
+        auto formula = sheet.GetFormulaTemplates().Parse(text.substr(1), pos);
+        return Content(new FormulaData(std::move(formula)));
     }
     else {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+        // an escaped text reads as a number the same as the rest of it; the
+        // payload is the only copy of the text
+        CellInterface::NumericValue number = ParseNumber(text[0] == ESCAPE_SIGN ? text.substr(1) : text);
+        if (const double* value = std::get_if<double>(&number)) {
+            return Content::FromNumberText(text, *value);
+        }
+        return Content(sheet.GetTextPool().Intern(text));
     }
-    std::vector<Position> referenced_cells = GetReferencedCells();
+}
 
-    if (!referenced_cells.empty()) {
-        if (HasCyclicDependencies(referenced_cells)) {
-            throw CircularDependencyException("Cell formula has circular dependencies"s);
-        }
-        // tell referenced cells they have a new dependant
-        AddUpperRefToCells(referenced_cells);
+Cell::Content Cell::FromFormula(std::unique_ptr<FormulaInterface> formula) {
+    return Content(new FormulaData(std::move(formula)));
+}
+
+Cell::Content Cell::Replace(Position pos, Content content) {
+    // content keeps the previous payload until its references are diffed
+    std::swap(content_, content);
+    DependencyGraph& graph = GetSheet().GetDependencyGraph();
+    graph.UpdateReferences(pos, content.GetReferencedCells(), content_.GetReferencedCells());
+    graph.UpdateRangeReferences(pos, content.GetReferencedRanges(), content_.GetReferencedRanges());
+    return content;
+}
+
+void Cell::Set(Position pos, std::string_view text) {
+    using namespace std::literals;
+    Sheet& sheet = GetSheet();
+    // build the new content aside so that the cell stays unchanged on error
+    Content content = Parse(text, pos, sheet);
+    // the same text again changes no value
+    if (content.HasSameText(content_)) {
+        return;
     }
-    // invalidate cache of dependant cells
-    if (!upper_references_.empty()) {
-        for (const Position& cell : upper_references_) {
-            Cell* cell_data = sheet_.GetConcreteCell(cell);
-            cell_data->ClearCache();
-        }
+    const std::vector<Position>& referenced_cells = content.GetReferencedCells();
+    const std::vector<Range>& referenced_ranges = content.GetReferencedRanges();
+
+    if ((!referenced_cells.empty() || !referenced_ranges.empty()) &&
+        HasCyclicDependencies(pos, referenced_cells, referenced_ranges)) {
+        throw CircularDependencyException("Cell formula has circular dependencies"s);
     }
+    // cells of ranges are not created, a missing cell reads as empty
+    CreateMissingCells(referenced_cells);
+    Replace(pos, std::move(content));
+    InvalidateCaches(sheet, {pos});
+}
 
+void Cell::Clear(Position pos) {
+    Set(pos, {});
 }
 
-void Cell::Clear() {
-    using namespace std::literals;
-    Set(""s);
+Sheet& Cell::GetSheet() const {
+    return CellStorage::GetSheet(*this);
 }
 
 Cell::Value Cell::GetValue() const {
-    if (!cache_.has_value()) {
-        cache_ = impl_->GetValue();
+    // held until the text is copied
+    std::shared_lock lock(GetSheet().GetLock());
+    ValueView value = GetValueView();
+    if (const std::string_view* text = std::get_if<std::string_view>(&value)) {
+        return std::string(*text);
+    }
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
     }
-    return *cache_;
+    return std::get<FormulaError>(value);
+}
+
+CellInterface::ValueView Cell::GetValueView() const {
+    std::shared_lock lock(GetSheet().GetLock());
+    if (content_.IsText()) {
+        std::string_view text = content_.GetText();
+        if (text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+    if (!content_.GetFormulaData()) {
+        return 0.0;
+    }
+    PackedValue value = GetFormulaValue();
+    if (value.IsNumber()) {
+        return value.GetNumber();
+    }
+    return value.GetError();
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    std::shared_lock lock(GetSheet().GetLock());
+    return std::string(content_.GetText());
+}
+
+std::string_view Cell::GetTextView() const {
+    return content_.GetText();
+}
+
+CellInterface::NumericValue Cell::GetNumericValue() const {
+    std::shared_lock lock(GetSheet().GetLock());
+    if (content_.IsNumberText()) {
+        return content_.GetNumber();
+    }
+    if (content_.GetPooledText()) {
+        // the pool holds only the texts that aren't numbers
+        return FormulaError(FormulaError::Category::Value);
+    }
+    if (!content_.GetFormulaData()) {
+        return 0.0;
+    }
+    return GetFormulaValue().Get();
+}
+
+CellInterface::NumericValue Cell::Evaluate() const {
+    const FormulaInterface& formula = *content_.GetFormulaData()->formula;
+    const Sheet& sheet = GetSheet();
+    StatsRecorder& stats = sheet.GetStatsRecorder();
+    stats.Add(SheetCounter::Evaluations);
+    if (!StatsRecorder::ShouldSample()) {
+        return formula.Evaluate(sheet);
+    }
+    StatsRecorder::Timer timer(stats, SheetTimer::Evaluation);
+    return formula.Evaluate(sheet);
+}
+
+PackedValue Cell::GetFormulaValue() const {
+    // Readers evaluating the cell at once store the same value. The writer
+    // waits for them, so a value never outlives the edit that changes it.
+    PackedValue cached = cache_.load(std::memory_order_relaxed);
+    if (cached.HasValue()) {
+        GetSheet().GetStatsRecorder().Add(SheetCounter::CacheHits);
+        return cached;
+    }
+    if (evaluation_depth >= MAX_EVALUATION_DEPTH) {
+        EvaluatePrecedents();
+    }
+    return EvaluateToCache();
+}
+
+PackedValue Cell::EvaluateToCache() const {
+    GetSheet().GetStatsRecorder().Add(SheetCounter::CacheMisses);
+    struct DepthGuard {
+        DepthGuard() {
+            ++evaluation_depth;
+        }
+        ~DepthGuard() {
+            --evaluation_depth;
+        }
+    } guard;
+    PackedValue value(Evaluate());
+    cache_.store(value, std::memory_order_relaxed);
+    return value;
+}
+
+void Cell::EvaluatePrecedents() const {
+    // Post-order walk over the formulas without a value that this one reads,
+    // directly or not, like the levels of Sheet::RecalculateAll: a cell is
+    // evaluated after the cells it reads, so its evaluation finds their
+    // values cached and doesn't nest. An explicit stack keeps the chain off
+    // the call stack.
+    struct Frame {
+        const Cell* cell;
+        bool expanded;
+    };
+    const Sheet& sheet = GetSheet();
+    std::vector<Frame> stack{{this, false}};
+    std::unordered_set<const Cell*> visited{this};
+    auto push = [&](const Cell& cell) {
+        if (cell.IsFormula() && !cell.HasCache() && visited.insert(&cell).second) {
+            stack.push_back({&cell, false});
+        }
+    };
+    while (!stack.empty()) {
+        const Cell* cell = stack.back().cell;
+        if (stack.back().expanded) {
+            stack.pop_back();
+            // this cell is left to the caller
+            if (cell != this && !cell->HasCache()) {
+                cell->EvaluateToCache();
+            }
+            continue;
+        }
+        stack.back().expanded = true;
+        for (Position ref : cell->content_.GetReferencedCells()) {
+            if (const Cell* precedent = sheet.GetConcreteCell(ref)) {
+                push(*precedent);
+            }
+        }
+        for (const Range& range : cell->content_.GetReferencedRanges()) {
+            sheet.ForEachCellInRange(range, [&](Position /* pos */, const Cell& precedent) {
+                push(precedent);
+            });
+        }
+    }
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    std::shared_lock lock(GetSheet().GetLock());
+    return content_.GetReferencedCells();
+}
+
+const std::vector<Position>& Cell::GetReferencedCellsView() const {
+    return content_.GetReferencedCells();
 }
 
 void Cell::ClearCache() const {
-    cache_.reset();
+    cache_.store(PackedValue(), std::memory_order_relaxed);
+}
+
+bool Cell::HasCache() const {
+    return cache_.load(std::memory_order_relaxed).HasValue();
+}
+
+void Cell::InvalidateCaches(const Sheet& sheet, const std::vector<Position>& changed) {
+    // A cached cell has read cached values of all the cells it depends on, so
+    // once a dependant is already dirty everything above it is dirty as well
+    // and the walk doesn't need to go further.
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    std::vector<Position> to_visit;
+    auto visit = [&to_visit](Position dependant) {
+        to_visit.push_back(dependant);
+    };
+    size_t invalidated = 0;
+    for (Position pos : changed) {
+        if (const Cell* cell = sheet.GetConcreteCell(pos)) {
+            invalidated += cell->HasCache();
+            cell->ClearCache();
+        }
+        graph.ForEachDependant(pos, visit);
+    }
+    while (!to_visit.empty()) {
+        Position pos = to_visit.back();
+        to_visit.pop_back();
+        const Cell* cell = sheet.GetConcreteCell(pos);
+        if (!cell || !cell->HasCache()) {
+            continue;
+        }
+        ++invalidated;
+        cell->ClearCache();
+        graph.ForEachDependant(pos, visit);
+    }
+    sheet.GetStatsRecorder().Add(SheetCounter::InvalidatedCells, invalidated);
 }
 
 bool Cell::IsReferenced() const {
-    return !GetReferencedCells().empty();
+    return !content_.GetReferencedCells().empty();
 }
 
-void Cell::AddUpperRefToCells(std::vector<Position> referenced_cells) {
+bool Cell::IsEmpty() const {
+    return content_.kind_ == Content::Kind::Empty;
+}
+
+bool Cell::IsFormula() const {
+    return content_.GetFormulaData() != nullptr;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    const FormulaData* formula = content_.GetFormulaData();
+    return formula ? formula->formula.get() : nullptr;
+}
+
+void Cell::CreateMissingCells(const std::vector<Position>& referenced_cells) {
+    Sheet& sheet = GetSheet();
     for (const Position& pos : referenced_cells) {
-        Cell* cell_data = sheet_.GetConcreteCell(pos);
-        // create referenced cell if it doesn't exist
-        if (!cell_data) {
-            sheet_.SetCell(pos, "");
-            cell_data = sheet_.GetConcreteCell(pos);
+        if (!sheet.GetConcreteCell(pos)) {
+            sheet.AddPlaceholder(pos);
         }
-        // add curret cell pos as upper reference
-        cell_data->GetUpperReferences().insert(pos_);
     }
 }
 
-bool Cell::HasCyclicDependencies(const std::vector<Position> references_down) const {
-    std::set<Position> cells_to_check = { pos_ };
-    return HasCyclicDependencies(cells_to_check, references_down);
+bool Cell::HasCyclicDependencies(Position self, const std::vector<Position>& references_down,
+                                 const std::vector<Range>& ranges_down) const {
+    // The new formula closes a cycle iff a cell it is going to read depends
+    // on this cell. Two searches run in turn, a cell each: one down from the
+    // new references through what they read, one up from this cell through
+    // its dependants. They stop once they meet or either runs out, so the
+    // cost is bounded by the smaller side: a new cell has no dependants, and
+    // a reference to the end of a chain reads nothing, so a chain filled in
+    // either order checks a few cells per edit. Each cell is expanded once,
+    // and explicit stacks keep deep chains off the call stack.
+    const Sheet& sheet = GetSheet();
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    std::unordered_set<Position, PositionHasher> reached_down;
+    std::unordered_set<Position, PositionHasher> reached_up{self};
+    std::set<Range> ranges;
+    std::vector<Position> down;
+    std::vector<Range> ranges_to_expand;
+    std::vector<Position> up{self};
+    auto found = [&](bool cycle) {
+        sheet.GetStatsRecorder().Add(SheetCounter::CycleCheckNodes,
+                                     reached_down.size() + reached_up.size() + ranges.size());
+        return cycle;
+    };
+    // true once the searches meet
+    auto reach_down = [&](Position pos) {
+        if (reached_up.count(pos)) {
+            return true;
+        }
+        if (reached_down.insert(pos).second) {
+            down.push_back(pos);
+        }
+        return false;
+    };
+    // a range leads to the existing cells inside it
+    auto reach_range = [&](const Range& range) {
+        if (ranges.insert(range).second) {
+            ranges_to_expand.push_back(range);
+        }
+    };
+    // Once the search up has run out, the dependants met it are all there
+    // are, and the cycle is there iff one of them is read by the new formula
+    auto read_by_formula = [&](Position pos) {
+        return reached_down.count(pos) || std::any_of(ranges_down.begin(), ranges_down.end(), [pos](const Range& range) {
+                   return range.Contains(pos);
+               });
+    };
+
+    for (Position ref : references_down) {
+        if (reach_down(ref)) {
+            return found(true);
+        }
+    }
+    for (const Range& range : ranges_down) {
+        if (range.Contains(self)) {
+            return found(true);
+        }
+        reach_range(range);
+    }
+    while ((!down.empty() || !ranges_to_expand.empty()) && !up.empty()) {
+        bool met = false;
+        if (!ranges_to_expand.empty()) {
+            Range range = ranges_to_expand.back();
+            ranges_to_expand.pop_back();
+            sheet.ForEachCellInRange(range, [&](Position pos, const Cell& /* cell */) {
+                met = met || reach_down(pos);
+            });
+        }
+        else {
+            Position pos = down.back();
+            down.pop_back();
+            if (const Cell* cell = sheet.GetConcreteCell(pos)) {
+                for (Position ref : cell->content_.GetReferencedCells()) {
+                    met = met || reach_down(ref);
+                }
+                for (const Range& range : cell->content_.GetReferencedRanges()) {
+                    reach_range(range);
+                }
+            }
+        }
+        if (met) {
+            return found(true);
+        }
+
+        Position pos = up.back();
+        up.pop_back();
+        graph.ForEachDependant(pos, [&](Position dependant) {
+            if (!met && reached_up.insert(dependant).second) {
+                met = read_by_formula(dependant);
+                up.push_back(dependant);
+            }
+        });
+        if (met) {
+            return found(true);
+        }
+    }
+    return found(false);
 }
 
-bool Cell::HasCyclicDependencies(std::set<Position>& cells_to_check, const std::vector<Position>& references_down) const {
-    for (const Position& ref : references_down) {
-        // try insert ref cell to set
-        if (!cells_to_check.insert(ref).second) {
-            return true;
+bool Cell::HasCycleFrom(const Sheet& sheet, const std::vector<Position>& starts) {
+    // Depth-first search that keeps the nodes of the current path open: an
+    // edge to an open node closes a cycle. A range is a node of its own, so it
+    // is expanded once however many formulas read it.
+    enum class State { Open, Done };
+    // a cell is stored as a one-cell range together with the cell itself
+    struct Node {
+        Range range;
+        const Cell* cell;
+    };
+    // The children of all the frames share one stack, the ones of the top
+    // frame are [begin, children.size()) and `next` is the one to visit
+    struct Frame {
+        Node node;
+        size_t begin;
+        size_t next;
+    };
+    std::unordered_map<Position, State, PositionHasher> cell_states;
+    std::map<Range, State> range_states;
+    std::vector<Frame> stack;
+    std::vector<Node> children;
+    cell_states.reserve(starts.size());
+    auto found = [&](bool cycle) {
+        sheet.GetStatsRecorder().Add(SheetCounter::CycleCheckNodes, cell_states.size() + range_states.size());
+        return cycle;
+    };
+
+    // a cell that reads nothing can't be on a cycle, so it is never visited
+    auto reads_anything = [](const Cell* cell) {
+        return cell && (!cell->content_.GetReferencedCells().empty() || !cell->content_.GetReferencedRanges().empty());
+    };
+    auto find_state = [&](const Node& node) -> State* {
+        if (!node.cell) {
+            auto it = range_states.find(node.range);
+            return it == range_states.end() ? nullptr : &it->second;
+        }
+        auto it = cell_states.find(node.range.first);
+        return it == cell_states.end() ? nullptr : &it->second;
+    };
+    auto open = [&](const Node& node) {
+        size_t begin = children.size();
+        if (!node.cell) {
+            range_states.emplace(node.range, State::Open);
+            sheet.ForEachCellInRange(node.range, [&](Position pos, const Cell& cell) {
+                if (reads_anything(&cell)) {
+                    children.push_back({{pos, pos}, &cell});
+                }
+            });
         }
-        auto ref_data = sheet_.GetCell(ref);
-        if (ref_data) {
-            if (HasCyclicDependencies(cells_to_check, ref_data->GetReferencedCells())) {
-                return true;
+        else {
+            cell_states.emplace(node.range.first, State::Open);
+            for (Position ref : node.cell->content_.GetReferencedCells()) {
+                const Cell* cell = sheet.GetConcreteCell(ref);
+                if (reads_anything(cell)) {
+                    children.push_back({{ref, ref}, cell});
+                }
+            }
+            for (const Range& range : node.cell->content_.GetReferencedRanges()) {
+                children.push_back({range, nullptr});
+            }
+        }
+        stack.push_back({node, begin, begin});
+    };
+
+    for (Position start : starts) {
+        const Cell* cell = sheet.GetConcreteCell(start);
+        if (!reads_anything(cell)) {
+            continue;
+        }
+        Node root{{start, start}, cell};
+        if (find_state(root)) {
+            continue;
+        }
+        open(root);
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            if (frame.next == children.size()) {
+                *find_state(frame.node) = State::Done;
+                children.resize(frame.begin);
+                stack.pop_back();
+                continue;
+            }
+            Node child = children[frame.next++];
+            const State* state = find_state(child);
+            if (!state) {
+                open(child);
+            }
+            else if (*state == State::Open) {
+                return found(true);
             }
         }
     }
-    return false;
+    return found(false);
 }
@@ -2,73 +2,146 @@
 
 #include "common.h"
 #include "formula.h"
+#include "packed_value.h"
+#include "text_pool.h"
 
+#include <atomic>
+#include <cstdint>
 #include <optional>
-#include <set>
+#include <string>
+#include <string_view>
 
 class Sheet;
 
+// A cell of a sheet. Cells live only in the slabs of a CellStorage: a cell
+// finds its sheet through the header of its slab, and the methods that need
+// its position take it from the caller, so a cell holds its content and the
+// cached value alone.
 class Cell : public CellInterface {
+private:
+    struct NumberText;
+    struct FormulaData;
+
 public:
-    Cell(Sheet& sheet, Position pos);
+    // Parsed cell text that is not put into a cell yet: a tag and a payload
+    // in place. An empty cell has nothing, a short text that reads as a
+    // number keeps its characters and the number right here, a longer one or
+    // a formula has one allocation of its own and any other text is an entry
+    // of the text pool of the sheet.
+    class Content {
+    public:
+        // an empty cell
+        Content() = default;
+        Content(Content&& other) noexcept;
+        Content& operator=(Content&& other) noexcept;
+        ~Content();
+
+        const std::vector<Position>& GetReferencedCells() const;
+        const std::vector<Range>& GetReferencedRanges() const;
+
+    private:
+        friend class Cell;
+
+        enum class Kind : uint8_t { Empty, ShortNumberText, NumberText, PooledText, Formula };
+        // the longest text that reads as a number and is kept in place
+        static const size_t SHORT_TEXT_SIZE = 14;
+
+        union Payload {
+            double number;
+            NumberText* number_text;
+            PooledText* pooled_text;
+            FormulaData* formula;
+        };
+
+        Kind kind_ = Kind::Empty;
+        uint8_t short_size_ = 0;
+        char short_text_[SHORT_TEXT_SIZE];
+        Payload payload_{};
+
+        explicit Content(PooledText* text);
+        explicit Content(FormulaData* formula);
+        static Content FromNumberText(std::string_view text, double number);
+
+        // nullptr unless the content is of that kind
+        const PooledText* GetPooledText() const;
+        const FormulaData* GetFormulaData() const;
+        bool IsNumberText() const;
+        bool IsText() const;
+        // needs IsNumberText
+        double GetNumber() const;
+        std::string_view GetText() const;
+        // Texts of one pool compare by their entries
+        bool HasSameText(const Content& other) const;
+        void Reset() noexcept;
+    };
+
     ~Cell();
 
-    void Set(std::string text);
-    void Clear();
+    // Parses the text of the cell at `pos`; formulas copied from other cells
+    // share their trees through the templates of the sheet, and texts are
+    // interned in its text pool, so the content must not outlive the sheet.
+    // The text is copied once, into the content. Throws FormulaException for a
+    // bad formula.
+    static Content Parse(std::string_view text, Position pos, const Sheet& sheet);
+    static Content FromFormula(std::unique_ptr<FormulaInterface> formula);
+
+    // The cell is at `pos`. Throws as Parse does and CircularDependencyException,
+    // leaving the cell unchanged.
+    void Set(Position pos, std::string_view text);
+    void Clear(Position pos);
+    // Puts the content into the cell at `pos` and updates the dependency
+    // graph. Doesn't check for cycles, create referenced cells or drop caches.
+    // Returns the previous content, so the change can be undone with another
+    // Replace.
+    Content Replace(Position pos, Content content);
 
+    // These take the read lock of the sheet, so other threads may call them
+    // while one thread writes; see Sheet::GetLock. A view stays valid while
+    // the caller holds the lock or nobody changes the cell.
     Value GetValue() const override;
+    ValueView GetValueView() const override;
     std::string GetText() const override;
+    NumericValue GetNumericValue() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // The text without a copy; valid until the cell is changed
+    std::string_view GetTextView() const;
+    // Same for the referenced cells, sorted
+    const std::vector<Position>& GetReferencedCellsView() const;
 
     void ClearCache() const;
+    // Drops the cached values of the changed cells and of every cell that
+    // depends on them, directly or transitively, in one walk
+    static void InvalidateCaches(const Sheet& sheet, const std::vector<Position>& changed);
+    // Whether a cycle is reachable from the given cells
+    static bool HasCycleFrom(const Sheet& sheet, const std::vector<Position>& starts);
     bool IsReferenced() const;
+    bool IsEmpty() const;
+    bool IsFormula() const;
+    // nullptr unless the cell is a formula
+    const FormulaInterface* GetFormula() const;
 
 private:
+    // made by CellStorage::Emplace only
+    friend class CellStorage;
+    Cell() noexcept;
+    // Cell with ready content; its edges are not added to the dependency graph
+    explicit Cell(Content content) noexcept;
 
-    class Impl {
-    public:
-        virtual Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
-        virtual ~Impl() = default;
-    };
-    class EmptyImpl : public Impl {
-    public:
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-    };
-    class TextImpl : public Impl {
-    public:
-        explicit TextImpl(std::string text);
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-    private:
-        std::string text_;
-    };
-    class FormulaImpl : public Impl {
-    public:
-        explicit FormulaImpl(std::string text, const Sheet& sheet);
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-    private:
-        std::unique_ptr<FormulaInterface> formula_;
-        const Sheet& sheet_;
-    };
+    Content content_;
+    // The value of a formula packed into one word, so that readers publish it
+    // with one store; no value until the formula is evaluated
+    mutable std::atomic<PackedValue> cache_;
 
-    Sheet& sheet_;
-    Position pos_;
-    std::unique_ptr<Impl> impl_;
-    mutable std::optional<Value> cache_;
-    std::set<Position, Comp> upper_references_;
-
-    std::set<Position, Comp>& GetUpperReferences() {
-        return upper_references_;
-    }
-    void AddUpperRefToCells(std::vector<Position> referenced_cells);
-    bool HasCyclicDependencies(const std::vector<Position> references_down) const;
-    bool HasCyclicDependencies(std::set<Position>& cells_to_check, const std::vector<Position>& references_down) const;
+    Sheet& GetSheet() const;
+    NumericValue Evaluate() const;
+    PackedValue GetFormulaValue() const;
+    PackedValue EvaluateToCache() const;
+    // Evaluates the formulas this one reads from the bottom up, for a chain
+    // too deep to evaluate by nesting
+    void EvaluatePrecedents() const;
+    bool HasCache() const;
+    void CreateMissingCells(const std::vector<Position>& referenced_cells);
+    bool HasCyclicDependencies(Position self, const std::vector<Position>& references_down,
+                               const std::vector<Range>& ranges_down) const;
 
 };
@@ -0,0 +1,156 @@
+#include "cell_storage.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+// a slot fits a cell or, once the cell is erased, the link to the next free slot
+const size_t SLOT_SIZE = std::max(sizeof(Cell), sizeof(void*));
+static_assert(SLOT_SIZE % alignof(Cell) == 0);
+}  // namespace
+
+const size_t CellStorage::FIRST_SLOT_OFFSET = (sizeof(Slab) + alignof(Cell) - 1) / alignof(Cell) * alignof(Cell);
+const size_t CellStorage::SLOTS_PER_SLAB = (SLAB_BYTES - FIRST_SLOT_OFFSET) / SLOT_SIZE;
+
+CellStorage::CellStorage(Sheet& sheet)
+    : sheet_(sheet) {}
+
+CellStorage::~CellStorage() {
+    // the slabs go with their last cells
+    ForEach([this](Position /* pos */, Cell& cell) {
+        Destroy(&cell);
+    });
+    if (spare_slab_) {
+        FreeSlab(spare_slab_);
+    }
+}
+
+Cell* CellStorage::Get(Position pos) const {
+    auto it = chunks_.find(GetChunkIndex(pos));
+    if (it == chunks_.end()) {
+        return nullptr;
+    }
+    return it->second->cells[GetIndexInChunk(pos)];
+}
+
+void CellStorage::Insert(Position pos, Cell* cell) {
+    auto& chunk = chunks_[GetChunkIndex(pos)];
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+    }
+    Cell*& slot = chunk->cells[GetIndexInChunk(pos)];
+    assert(!slot);
+    slot = cell;
+    ++chunk->count;
+    ++cell_count_;
+}
+
+void CellStorage::Erase(Position pos) {
+    auto it = chunks_.find(GetChunkIndex(pos));
+    if (it == chunks_.end()) {
+        return;
+    }
+    Chunk& chunk = *it->second;
+    Cell*& slot = chunk.cells[GetIndexInChunk(pos)];
+    if (!slot) {
+        return;
+    }
+    Destroy(std::exchange(slot, nullptr));
+    --cell_count_;
+    if (--chunk.count == 0) {
+        chunks_.erase(it);
+    }
+}
+
+CellStorage::Slab* CellStorage::AllocateSlab() {
+    if (spare_slab_) {
+        return std::exchange(spare_slab_, nullptr);
+    }
+    // not zeroed, a page is touched when its first cell is put there
+    void* memory = ::operator new(SLAB_BYTES, std::align_val_t(SLAB_BYTES));
+    ++slab_count_;
+    return new (memory) Slab{&sheet_};
+}
+
+void CellStorage::FreeSlab(Slab* slab) noexcept {
+    slab->~Slab();
+    ::operator delete(slab, std::align_val_t(SLAB_BYTES));
+}
+
+void CellStorage::LinkSlab(Slab* slab) noexcept {
+    slab->prev = nullptr;
+    slab->next = partial_slabs_;
+    if (partial_slabs_) {
+        partial_slabs_->prev = slab;
+    }
+    partial_slabs_ = slab;
+}
+
+void CellStorage::UnlinkSlab(Slab* slab) noexcept {
+    (slab->prev ? slab->prev->next : partial_slabs_) = slab->next;
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = nullptr;
+}
+
+void* CellStorage::AllocateSlot() {
+    if (!partial_slabs_) {
+        LinkSlab(AllocateSlab());
+    }
+    Slab* slab = partial_slabs_;
+    void* slot;
+    if (slab->free_slots) {
+        FreeSlot* free_slot = slab->free_slots;
+        slab->free_slots = free_slot->next;
+        free_slot->~FreeSlot();
+        slot = free_slot;
+    }
+    else {
+        slot = reinterpret_cast<std::byte*>(slab) + FIRST_SLOT_OFFSET + slab->untouched++ * SLOT_SIZE;
+    }
+    if (++slab->used == SLOTS_PER_SLAB) {
+        UnlinkSlab(slab);
+    }
+    return slot;
+}
+
+void CellStorage::ReleaseSlot(void* slot) noexcept {
+    Slab* slab = GetSlab(slot);
+    if (slab->used-- == SLOTS_PER_SLAB) {
+        LinkSlab(slab);
+    }
+    if (slab->used == 0) {
+        UnlinkSlab(slab);
+        if (spare_slab_) {
+            FreeSlab(slab);
+            --slab_count_;
+            return;
+        }
+        // every slot is free, so the slab starts over untouched
+        slab->free_slots = nullptr;
+        slab->untouched = 0;
+        spare_slab_ = slab;
+        return;
+    }
+    slab->free_slots = new (slot) FreeSlot{slab->free_slots};
+}
+
+void CellStorage::Destroy(Cell* cell) noexcept {
+    cell->~Cell();
+    ReleaseSlot(cell);
+}
+
+size_t CellStorage::GetCellCount() const {
+    return cell_count_;
+}
+
+size_t CellStorage::GetChunkCount() const {
+    return chunks_.size();
+}
+
+size_t CellStorage::GetSlabBytes() const {
+    return slab_count_ * SLAB_BYTES;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Sparse cell storage. The sheet is split into CHUNK_SIZE x CHUNK_SIZE chunks
+// which are allocated on first use and looked up by index in a hash table, so
+// memory depends on the number of occupied chunks rather than on the farthest
+// filled position. Get/Emplace/Erase are O(1).
+//
+// The cells themselves live in slabs of the storage, back to back and without
+// a heap block each. A slab is aligned to its size and starts with a header
+// that names the sheet, so a cell finds its sheet from its own address. The
+// slot of an erased cell goes to the free list of its slab; a slab left empty
+// is freed, but for one kept for the next cells.
+class CellStorage {
+public:
+    static const int CHUNK_SIZE = 16;
+
+    // the cells made here belong to the sheet
+    explicit CellStorage(Sheet& sheet);
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+    ~CellStorage();
+
+    Cell* Get(Position pos) const;
+    // Constructs a cell from the arguments at the position, which must be free
+    template <typename... Args>
+    Cell& Emplace(Position pos, Args&&... args);
+    // Destroys the cell at the position, if any; a chunk left empty is freed
+    void Erase(Position pos);
+
+    size_t GetCellCount() const;
+    size_t GetChunkCount() const;
+    // Bytes of the slabs, free slots and the spare slab included
+    size_t GetSlabBytes() const;
+
+    // The sheet of the storage the cell was made in
+    static Sheet& GetSheet(const Cell& cell) {
+        return *GetSlab(&cell)->sheet;
+    }
+
+    // Calls func(Position, Cell&) for every stored cell, order is unspecified
+    template <typename Func>
+    void ForEach(Func func) const;
+    // Same for the cells inside the range; the chunks are looked up once each
+    template <typename Func>
+    void ForEachInRange(Range range, Func func) const;
+
+private:
+    static const int CHUNKS_PER_ROW = Position::MAX_COLS / CHUNK_SIZE;
+
+    // a power of two, so that the slab of a cell is its address rounded down
+    static const size_t SLAB_BYTES = 32 * 1024;
+
+    struct Chunk {
+        std::array<Cell*, CHUNK_SIZE * CHUNK_SIZE> cells{};
+        int count = 0;
+    };
+    // what an erased cell's slot holds until it is taken again
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+    // The start of a slab, the slots follow. The slabs with a free slot are
+    // linked, the full ones are reached through their cells only.
+    struct Slab {
+        Sheet* sheet;
+        FreeSlot* free_slots = nullptr;
+        // slots taken by cells
+        size_t used = 0;
+        // the slots from this one on were never taken
+        size_t untouched = 0;
+        Slab* prev = nullptr;
+        Slab* next = nullptr;
+    };
+
+    std::unordered_map<int, std::unique_ptr<Chunk>> chunks_;
+    size_t cell_count_ = 0;
+    Sheet& sheet_;
+    // the slabs that have a free slot, the one to take from first
+    Slab* partial_slabs_ = nullptr;
+    // an empty slab kept so that a cell put and erased at once doesn't
+    // allocate a slab each time
+    Slab* spare_slab_ = nullptr;
+    size_t slab_count_ = 0;
+
+    static Slab* GetSlab(const void* slot) {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(slot) & ~(SLAB_BYTES - 1));
+    }
+    // the slots start past the header, at the alignment of a cell
+    static const size_t FIRST_SLOT_OFFSET;
+    static const size_t SLOTS_PER_SLAB;
+
+    Slab* AllocateSlab();
+    static void FreeSlab(Slab* slab) noexcept;
+    void LinkSlab(Slab* slab) noexcept;
+    void UnlinkSlab(Slab* slab) noexcept;
+    void* AllocateSlot();
+    void ReleaseSlot(void* slot) noexcept;
+    // Puts a constructed cell to the free position
+    void Insert(Position pos, Cell* cell);
+    void Destroy(Cell* cell) noexcept;
+
+    template <typename Func>
+    static void ForEachInChunk(const Chunk& chunk, int chunk_index, Range range, Func& func);
+
+    static int GetChunkIndex(Position pos) {
+        return pos.row / CHUNK_SIZE * CHUNKS_PER_ROW + pos.col / CHUNK_SIZE;
+    }
+    static int GetIndexInChunk(Position pos) {
+        return pos.row % CHUNK_SIZE * CHUNK_SIZE + pos.col % CHUNK_SIZE;
+    }
+};
+
+template <typename... Args>
+Cell& CellStorage::Emplace(Position pos, Args&&... args) {
+    // the constructors of a cell don't throw
+    Cell* cell = new (AllocateSlot()) Cell(std::forward<Args>(args)...);
+    try {
+        Insert(pos, cell);
+    } catch (...) {
+        Destroy(cell);
+        throw;
+    }
+    return *cell;
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func func) const {
+    for (const auto& [chunk_index, chunk] : chunks_) {
+        int first_row = chunk_index / CHUNKS_PER_ROW * CHUNK_SIZE;
+        int first_col = chunk_index % CHUNKS_PER_ROW * CHUNK_SIZE;
+        for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) {
+            if (Cell* cell = chunk->cells[i]) {
+                func(Position{first_row + i / CHUNK_SIZE, first_col + i % CHUNK_SIZE}, *cell);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEachInRange(Range range, Func func) const {
+    int first_chunk_row = range.first.row / CHUNK_SIZE;
+    int last_chunk_row = range.last.row / CHUNK_SIZE;
+    int first_chunk_col = range.first.col / CHUNK_SIZE;
+    int last_chunk_col = range.last.col / CHUNK_SIZE;
+    size_t range_chunks = static_cast<size_t>(last_chunk_row - first_chunk_row + 1) *
+                          static_cast<size_t>(last_chunk_col - first_chunk_col + 1);
+    // a big range over a sparse sheet is cheaper to match against the occupied chunks
+    if (range_chunks > chunks_.size()) {
+        for (const auto& [chunk_index, chunk] : chunks_) {
+            int chunk_row = chunk_index / CHUNKS_PER_ROW;
+            int chunk_col = chunk_index % CHUNKS_PER_ROW;
+            if (chunk_row >= first_chunk_row && chunk_row <= last_chunk_row && chunk_col >= first_chunk_col &&
+                chunk_col <= last_chunk_col) {
+                ForEachInChunk(*chunk, chunk_index, range, func);
+            }
+        }
+        return;
+    }
+    for (int chunk_row = first_chunk_row; chunk_row <= last_chunk_row; ++chunk_row) {
+        for (int chunk_col = first_chunk_col; chunk_col <= last_chunk_col; ++chunk_col) {
+            int chunk_index = chunk_row * CHUNKS_PER_ROW + chunk_col;
+            auto it = chunks_.find(chunk_index);
+            if (it != chunks_.end()) {
+                ForEachInChunk(*it->second, chunk_index, range, func);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEachInChunk(const Chunk& chunk, int chunk_index, Range range, Func& func) {
+    int first_row = chunk_index / CHUNKS_PER_ROW * CHUNK_SIZE;
+    int first_col = chunk_index % CHUNKS_PER_ROW * CHUNK_SIZE;
+    int row_begin = std::max(range.first.row, first_row);
+    int row_end = std::min(range.last.row, first_row + CHUNK_SIZE - 1);
+    int col_begin = std::max(range.first.col, first_col);
+    int col_end = std::min(range.last.col, first_col + CHUNK_SIZE - 1);
+    for (int row = row_begin; row <= row_end; ++row) {
+        for (int col = col_begin; col <= col_end; ++col) {
+            if (Cell* cell = chunk.cells[GetIndexInChunk({row, col})]) {
+                func(Position{row, col}, *cell);
+            }
+        }
+    }
+}
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -16,22 +17,111 @@ struct Position {
     bool operator==(Position rhs) const;
     bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const;
     std::string ToString() const;
+    // Пишет позицию в нотации A1 в буфер длиной не меньше MAX_STRING_LENGTH и
+    // возвращает указатель за последним записанным символом. Для некорректной
+    // позиции ничего не пишет.
+    constexpr char* ToChars(char* out) const;
 
-    static Position FromString(std::string_view str);
+    // Разбирает позицию в нотации A1, для некорректной строки возвращает NONE.
+    // Не выделяет память.
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // "XFD16384"
+    static const int MAX_STRING_LENGTH = 8;
     static const Position NONE;
 };
 
+constexpr bool Position::IsValid() const {
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+constexpr char* Position::ToChars(char* out) const {
+    if (!IsValid()) {
+        return out;
+    }
+    // буквы столбца - число в биективной системе по основанию 26 (A = 1, Z = 26),
+    // цифры обеих частей получаются с младшей
+    char reversed[MAX_STRING_LENGTH] = {};
+    int count = 0;
+    for (int value = col + 1; value > 0; value = (value - 1) / 26) {
+        reversed[count++] = static_cast<char>('A' + (value - 1) % 26);
+    }
+    while (count > 0) {
+        *out++ = reversed[--count];
+    }
+    for (int value = row + 1; value > 0; value /= 10) {
+        reversed[count++] = static_cast<char>('0' + value % 10);
+    }
+    while (count > 0) {
+        *out++ = reversed[--count];
+    }
+    return out;
+}
+
+constexpr Position Position::FromString(std::string_view str) {
+    // до трёх букв, затем цифры; ведущие нули допускаются, но вся строка не
+    // длиннее MAX_LENGTH
+    constexpr size_t MAX_LETTERS = 3;
+    constexpr size_t MAX_LENGTH = 17;
+    constexpr Position none{-1, -1};
+    if (str.size() > MAX_LENGTH) {
+        return none;
+    }
+    size_t letters = 0;
+    int col = 0;
+    for (; letters < str.size() && str[letters] >= 'A' && str[letters] <= 'Z'; ++letters) {
+        if (letters == MAX_LETTERS) {
+            return none;
+        }
+        col = col * 26 + (str[letters] - 'A' + 1);
+    }
+    if (letters == 0 || letters == str.size()) {
+        return none;
+    }
+    int row = 0;
+    for (size_t i = letters; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return none;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > MAX_ROWS) {
+            return none;
+        }
+    }
+    Position result{row - 1, col - 1};
+    return result.IsValid() ? result : none;
+}
+
+// Прямоугольный диапазон ячеек, например A1:B5. Обе границы входят в
+// диапазон: first - левый верхний угол, last - правый нижний.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+};
+
 struct Comp {
     bool operator()(const Position& lhs, const Position& rhs) const {
         return std::tie(lhs.col, lhs.row) < std::tie(rhs.col, rhs.row);
     }
 };
 
+struct PositionHasher {
+    size_t operator()(const Position& pos) const {
+        return static_cast<size_t>(pos.row) * Position::MAX_COLS + pos.col;
+    }
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -87,6 +177,10 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение ячейки в роли аргумента формулы: число либо ошибка
+    using NumericValue = std::variant<double, FormulaError>;
+    // То же, что Value, но текст не копируется, а указывает внутрь ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -94,11 +188,19 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает то же значение, что GetValue, не выделяя памяти. Текст
+    // действителен, пока ячейку не изменят.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // Возвращает значение ячейки как число для подстановки в формулу, не
+    // копируя текст. Пустая ячейка даёт ноль, текст - записанное в нём число
+    // либо ошибку #VALUE!, формула - своё значение или ошибку.
+    virtual NumericValue GetNumericValue() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
@@ -133,6 +235,12 @@ public:
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Собирает числовые значения непустых ячеек диапазона для агрегатных
+    // функций формул. Значения дописываются в конец values, их порядок не
+    // определён. Ячейки с ошибкой (в том числе с текстом, который не является
+    // числом) пропускаются; возвращается ошибка первой из них по строкам.
+    virtual std::optional<FormulaError> GetNumericValues(Range range, std::vector<double>& values) const = 0;
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
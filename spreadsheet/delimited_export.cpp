@@ -0,0 +1,187 @@
+#include "delimited_export.h"
+
+#include "cell.h"
+#include "cell_storage.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <charconv>
+#include <iterator>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+// the buffer goes to the stream once it holds this many bytes
+const size_t FLUSH_SIZE = 1 << 20;
+// a round of parallel export has this many tasks per thread; their buffers
+// are kept until the round is written
+const size_t TASKS_PER_THREAD = 4;
+
+void AppendNumber(double number, int precision, std::string& out) {
+    char buffer[64];
+    auto [end, error] =
+        std::to_chars(std::begin(buffer), std::end(buffer), number, std::chars_format::general, precision);
+    if (error == std::errc()) {
+        out.append(buffer, end);
+        return;
+    }
+    // a huge precision doesn't fit the buffer
+    std::ostringstream stream;
+    stream.precision(precision);
+    stream << number;
+    out += stream.str();
+}
+
+class RowFormatter {
+public:
+    RowFormatter(const Sheet& sheet, const ExportOptions& options, Range area, int precision)
+        : sheet_(sheet),
+          options_(options),
+          area_(area),
+          precision_(precision) {
+    }
+
+    // Appends the lines of the rows [first_row, last_row)
+    void Format(int first_row, int last_row, std::string& out) {
+        int cols = area_.last.col - area_.first.col + 1;
+        // bands follow the chunk rows of the storage, so every chunk is looked up once
+        for (int band_row = first_row; band_row < last_row;) {
+            int band_end = std::min(last_row, (band_row / CellStorage::CHUNK_SIZE + 1) * CellStorage::CHUNK_SIZE);
+            band_.assign(static_cast<size_t>(band_end - band_row) * cols, nullptr);
+            Range band{{band_row, area_.first.col}, {band_end - 1, area_.last.col}};
+            sheet_.ForEachCellInRange(band, [&](Position pos, const Cell& cell) {
+                band_[static_cast<size_t>(pos.row - band_row) * cols + (pos.col - area_.first.col)] = &cell;
+            });
+            for (int row = band_row; row < band_end; ++row) {
+                const Cell* const* cells = band_.data() + static_cast<size_t>(row - band_row) * cols;
+                for (int col = 0; col < cols; ++col) {
+                    if (col > 0) {
+                        out += options_.delimiter;
+                    }
+                    if (cells[col]) {
+                        AppendCell(*cells[col], out);
+                    }
+                }
+                out += '\n';
+            }
+            band_row = band_end;
+        }
+    }
+
+private:
+    const Sheet& sheet_;
+    const ExportOptions& options_;
+    Range area_;
+    int precision_;
+    std::vector<const Cell*> band_;
+
+    void AppendCell(const Cell& cell, std::string& out) const {
+        if (options_.texts) {
+            out += cell.GetTextView();
+        }
+        else if (cell.IsEmpty()) {
+            // an empty cell prints like a missing one, though formulas read it as zero
+        }
+        else if (cell.IsFormula()) {
+            CellInterface::NumericValue value = cell.GetNumericValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                AppendNumber(*number, precision_, out);
+            }
+            else {
+                out += std::get<FormulaError>(value).ToString();
+            }
+        }
+        else {
+            std::string_view text = cell.GetTextView();
+            if (text[0] == ESCAPE_SIGN) {
+                text.remove_prefix(1);
+            }
+            out += text;
+        }
+    }
+};
+}  // namespace
+
+void ExportDelimited(const Sheet& sheet, std::ostream& output, const ExportOptions& options) {
+    // the sheet stays as it is until the last row is written
+    std::shared_lock lock(sheet.GetLock());
+    Range area;
+    if (options.area) {
+        area = *options.area;
+        if (!area.first.IsValid() || !area.last.IsValid() || area.first.row > area.last.row ||
+            area.first.col > area.last.col) {
+            throw InvalidPositionException("Invalid export area"s);
+        }
+    }
+    else {
+        Size size = sheet.GetPrintableSize();
+        if (size.rows == 0 || size.cols == 0) {
+            return;
+        }
+        area = {{0, 0}, {size.rows - 1, size.cols - 1}};
+    }
+    // a negative precision means the default one, as for operator<<
+    int precision = output.precision() < 0 ? 6 : static_cast<int>(output.precision());
+    size_t thread_count = options.thread_count;
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t rows_per_task = std::max<size_t>(options.rows_per_task, 1);
+    size_t row_count = static_cast<size_t>(area.last.row - area.first.row) + 1;
+    size_t task_count = (row_count + rows_per_task - 1) / rows_per_task;
+    auto task_rows = [&](size_t task) {
+        int first_row = area.first.row + static_cast<int>(task * rows_per_task);
+        int last_row = area.first.row + static_cast<int>(std::min(row_count, (task + 1) * rows_per_task));
+        return std::pair{first_row, last_row};
+    };
+
+    if (thread_count == 1 || task_count == 1) {
+        RowFormatter formatter(sheet, options, area, precision);
+        std::string buffer;
+        for (size_t task = 0; task < task_count; ++task) {
+            auto [first_row, last_row] = task_rows(task);
+            formatter.Format(first_row, last_row, buffer);
+            if (buffer.size() >= FLUSH_SIZE) {
+                output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            }
+        }
+        output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        return;
+    }
+
+    // after this the workers only read the cached values
+    if (!options.texts) {
+        sheet.ForEachCellInRange(area, [](Position /* pos */, const Cell& cell) {
+            if (cell.IsFormula()) {
+                cell.GetNumericValue();
+            }
+        });
+    }
+    ThreadPool pool(thread_count);
+    std::vector<std::string> buffers(thread_count * TASKS_PER_THREAD);
+    for (size_t first_task = 0; first_task < task_count; first_task += buffers.size()) {
+        size_t round = std::min(buffers.size(), task_count - first_task);
+        pool.ParallelFor(round, 1, [&](size_t begin, size_t end) {
+            sheet.GetLock().JoinShared();
+            std::shared_lock worker_lock(sheet.GetLock(), std::adopt_lock);
+            RowFormatter formatter(sheet, options, area, precision);
+            for (size_t i = begin; i < end; ++i) {
+                auto [first_row, last_row] = task_rows(first_task + i);
+                buffers[i].clear();
+                formatter.Format(first_row, last_row, buffers[i]);
+            }
+        });
+        for (size_t i = 0; i < round; ++i) {
+            output.write(buffers[i].data(), static_cast<std::streamsize>(buffers[i].size()));
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <optional>
+#include <ostream>
+
+class Sheet;
+
+struct ExportOptions {
+    // cell texts as PrintTexts writes them instead of values
+    bool texts = false;
+    char delimiter = '\t';
+    // the part of the sheet to write, the printable area by default
+    std::optional<Range> area;
+    // 0 means one thread per core
+    size_t thread_count = 0;
+    // rows formatted by one task
+    size_t rows_per_task = 256;
+};
+
+// Writes a rectangle of the sheet as delimited text, one line per row, the
+// same way PrintValues and PrintTexts do: fields are not quoted, a missing or
+// empty cell is an empty field. Numbers are formatted with std::to_chars in the
+// general format with the precision of the stream, which is what operator<<
+// gives with the default flags. Rows are formatted into a buffer that goes
+// to the stream in big writes.
+//
+// With more than one thread the rows are split into tasks formatted on a
+// pool and written in order. Formulas read each other's values, so the ones
+// of the area that have no cached value are evaluated on the calling thread
+// first. The read lock of the sheet is held for the whole export.
+void ExportDelimited(const Sheet& sheet, std::ostream& output, const ExportOptions& options = {});
@@ -0,0 +1,159 @@
+#include "delimited_import.h"
+
+#include "cell.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+// the rows of a chunk are handed to the workers in pieces of this many
+const size_t ROWS_PER_TASK = 256;
+
+// Appends the offsets of the line breaks that end rows, i.e. the ones outside quotes
+void FindRowEnds(const char* data, size_t size, bool quoted, std::vector<size_t>& row_ends) {
+    if (!quoted) {
+        const char* end = data + size;
+        for (const char* p = data; (p = static_cast<const char*>(std::memchr(p, '\n', end - p))); ++p) {
+            row_ends.push_back(p - data);
+        }
+        return;
+    }
+    // a doubled quote flips the state twice, so the parity tells if we are inside
+    bool in_quotes = false;
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == '"') {
+            in_quotes = !in_quotes;
+        }
+        else if (data[i] == '\n' && !in_quotes) {
+            row_ends.push_back(i);
+        }
+    }
+}
+
+// Calls func(col, std::string_view field) for every field of the row.
+// Quoted fields are unescaped in place, so the views point into the row.
+template <typename Func>
+void SplitRow(char* begin, char* end, const ImportOptions& options, Func func) {
+    if (end > begin && end[-1] == '\r') {
+        --end;
+    }
+    char* p = begin;
+    for (int col = 0;; ++col) {
+        char* field = p;
+        char* field_end;
+        if (options.quoted && p < end && *p == '"') {
+            char* out = p++;
+            while (p < end) {
+                if (*p == '"') {
+                    if (p + 1 < end && p[1] == '"') {
+                        *out++ = '"';
+                        p += 2;
+                        continue;
+                    }
+                    ++p;
+                    break;
+                }
+                *out++ = *p++;
+            }
+            // anything between the closing quote and the delimiter is kept
+            while (p < end && *p != options.delimiter) {
+                *out++ = *p++;
+            }
+            field_end = out;
+        }
+        else {
+            auto* delimiter = static_cast<char*>(std::memchr(p, options.delimiter, end - p));
+            p = delimiter ? delimiter : end;
+            field_end = p;
+        }
+        func(col, std::string_view(field, field_end - field));
+        if (p == end) {
+            return;
+        }
+        ++p;
+    }
+}
+
+// Parses the rows of the buffer on the pool and sets them as one batch.
+// Returns the number of cells set.
+size_t ImportRows(Sheet& sheet, ThreadPool& pool, char* data, const std::vector<size_t>& row_ends, int first_row,
+                  const ImportOptions& options) {
+    size_t task_count = (row_ends.size() + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+    std::vector<std::vector<std::pair<Position, Cell::Content>>> parts(task_count);
+    pool.ParallelFor(row_ends.size(), ROWS_PER_TASK, [&](size_t begin, size_t end) {
+        auto& part = parts[begin / ROWS_PER_TASK];
+        for (size_t i = begin; i < end; ++i) {
+            char* row_begin = data + (i == 0 ? 0 : row_ends[i - 1] + 1);
+            int row = first_row + static_cast<int>(i);
+            SplitRow(row_begin, data + row_ends[i], options, [&](int col, std::string_view field) {
+                // parsed straight from the buffer, the content holds the only copy
+                if (!field.empty()) {
+                    Position pos{row, options.origin.col + col};
+                    part.emplace_back(pos, Cell::Parse(field, pos, sheet));
+                }
+            });
+        }
+    });
+
+    size_t cell_count = 0;
+    for (const auto& part : parts) {
+        cell_count += part.size();
+    }
+    std::vector<std::pair<Position, Cell::Content>> edits;
+    edits.reserve(cell_count);
+    for (auto& part : parts) {
+        std::move(part.begin(), part.end(), std::back_inserter(edits));
+    }
+    sheet.SetCellContents(std::move(edits));
+    return cell_count;
+}
+}  // namespace
+
+ImportStats ImportDelimited(Sheet& sheet, std::istream& input, const ImportOptions& options) {
+    size_t thread_count = options.thread_count;
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t chunk_size = std::max<size_t>(options.chunk_size, 1);
+    ThreadPool pool(thread_count);
+
+    ImportStats stats;
+    // the unfinished last row of the previous chunk followed by the new one
+    std::vector<char> buffer;
+    std::vector<size_t> row_ends;
+    int row = options.origin.row;
+    bool at_end = false;
+    while (!at_end) {
+        size_t kept = buffer.size();
+        buffer.resize(kept + chunk_size);
+        input.read(buffer.data() + kept, static_cast<std::streamsize>(chunk_size));
+        auto read = static_cast<size_t>(input.gcount());
+        buffer.resize(kept + read);
+        stats.bytes += read;
+        at_end = read < chunk_size;
+
+        row_ends.clear();
+        FindRowEnds(buffer.data(), buffer.size(), options.quoted, row_ends);
+        size_t consumed = row_ends.empty() ? 0 : row_ends.back() + 1;
+        // the last row may have no line break
+        if (at_end && consumed < buffer.size()) {
+            row_ends.push_back(buffer.size());
+            consumed = buffer.size();
+        }
+        if (!row_ends.empty()) {
+            stats.cells += ImportRows(sheet, pool, buffer.data(), row_ends, row, options);
+            stats.rows += row_ends.size();
+            row += static_cast<int>(row_ends.size());
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+    }
+    return stats;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <istream>
+
+class Sheet;
+
+struct ImportOptions {
+    // '\t' for TSV, ',' for CSV
+    char delimiter = '\t';
+    // Fields may be put in double quotes, which hide delimiters and line
+    // breaks; a quote inside is doubled. TSV has no quoting.
+    bool quoted = false;
+    // where the first field of the first row goes
+    Position origin{0, 0};
+    // 0 means one thread per core
+    size_t thread_count = 0;
+    // bytes read at once; a longer row is read as a whole anyway
+    size_t chunk_size = 4 << 20;
+};
+
+struct ImportStats {
+    size_t bytes = 0;
+    size_t rows = 0;
+    size_t cells = 0;
+};
+
+// Streams delimited text into the sheet: field j of row i sets the cell
+// origin + (i, j), empty fields are skipped. The input is read in chunks;
+// the rows of a chunk are split into fields and parsed on the worker threads
+// and then set as one Sheet::SetCellContents batch. An exception stops the
+// import, and the chunks before the failing one stay in the sheet.
+ImportStats ImportDelimited(Sheet& sheet, std::istream& input, const ImportOptions& options = {});
@@ -0,0 +1,157 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+const std::vector<Position> NO_DEPENDANTS;
+}  // namespace
+
+void DependencyGraph::UpdateReferences(Position cell, const std::vector<Position>& old_refs,
+                                       const std::vector<Position>& new_refs) {
+    assert(std::is_sorted(old_refs.begin(), old_refs.end(), Comp()));
+    assert(std::is_sorted(new_refs.begin(), new_refs.end(), Comp()));
+    // merge both sorted lists: refs only in the old list lose the edge, refs
+    // only in the new one gain it, common refs are left as they are
+    auto old_it = old_refs.begin();
+    auto new_it = new_refs.begin();
+    while (old_it != old_refs.end() || new_it != new_refs.end()) {
+        if (new_it == new_refs.end() || (old_it != old_refs.end() && Comp()(*old_it, *new_it))) {
+            RemoveEdge(cell, *old_it++);
+        }
+        else if (old_it == old_refs.end() || Comp()(*new_it, *old_it)) {
+            AddEdge(cell, *new_it++);
+        }
+        else {
+            ++old_it;
+            ++new_it;
+        }
+    }
+}
+
+void DependencyGraph::UpdateRangeReferences(Position cell, const std::vector<Range>& old_ranges,
+                                            const std::vector<Range>& new_ranges) {
+    assert(std::is_sorted(old_ranges.begin(), old_ranges.end()));
+    assert(std::is_sorted(new_ranges.begin(), new_ranges.end()));
+    auto old_it = old_ranges.begin();
+    auto new_it = new_ranges.begin();
+    while (old_it != old_ranges.end() || new_it != new_ranges.end()) {
+        if (new_it == new_ranges.end() || (old_it != old_ranges.end() && *old_it < *new_it)) {
+            RemoveRangeEdge(cell, *old_it++);
+        }
+        else if (old_it == old_ranges.end() || *new_it < *old_it) {
+            AddRangeEdge(cell, *new_it++);
+        }
+        else {
+            ++old_it;
+            ++new_it;
+        }
+    }
+}
+
+const std::vector<Position>& DependencyGraph::GetDependants(Position pos) const {
+    auto it = dependants_.find(pos);
+    return it == dependants_.end() ? NO_DEPENDANTS : it->second;
+}
+
+bool DependencyGraph::HasDependants(Position pos) const {
+    return dependants_.count(pos) > 0;
+}
+
+bool DependencyGraph::SetDependants(Position pos, std::vector<Position> dependants) {
+    assert(std::is_sorted(dependants.begin(), dependants.end()));
+    if (dependants.empty()) {
+        return !HasDependants(pos);
+    }
+    size_t count = dependants.size();
+    if (!dependants_.try_emplace(pos, std::move(dependants)).second) {
+        return false;
+    }
+    edge_count_ += count;
+    return true;
+}
+
+void DependencyGraph::Reserve(size_t referenced_cell_count) {
+    dependants_.reserve(referenced_cell_count);
+}
+
+size_t DependencyGraph::GetEdgeCount() const {
+    return edge_count_;
+}
+
+size_t DependencyGraph::GetReferencedCellCount() const {
+    return dependants_.size();
+}
+
+size_t DependencyGraph::GetRangeEdgeCount() const {
+    return range_edge_count_;
+}
+
+void DependencyGraph::AddEdge(Position from, Position to) {
+    std::vector<Position>& dependants = dependants_[to];
+    auto it = std::lower_bound(dependants.begin(), dependants.end(), from);
+    if (it == dependants.end() || !(*it == from)) {
+        dependants.insert(it, from);
+        ++edge_count_;
+    }
+}
+
+void DependencyGraph::RemoveEdge(Position from, Position to) {
+    auto map_it = dependants_.find(to);
+    if (map_it == dependants_.end()) {
+        return;
+    }
+    std::vector<Position>& dependants = map_it->second;
+    auto it = std::lower_bound(dependants.begin(), dependants.end(), from);
+    if (it == dependants.end() || !(*it == from)) {
+        return;
+    }
+    dependants.erase(it);
+    --edge_count_;
+    if (dependants.empty()) {
+        dependants_.erase(map_it);
+    }
+}
+
+void DependencyGraph::AddRangeEdge(Position from, Range to) {
+    auto [map_it, inserted] = range_dependants_.try_emplace(to);
+    std::vector<Position>& dependants = map_it->second;
+    auto it = std::lower_bound(dependants.begin(), dependants.end(), from);
+    if (it != dependants.end() && *it == from) {
+        return;
+    }
+    dependants.insert(it, from);
+    ++range_edge_count_;
+    if (inserted) {
+        ForEachTile(to, [&](int tile) {
+            range_tiles_[tile].push_back(&*map_it);
+        });
+    }
+}
+
+void DependencyGraph::RemoveRangeEdge(Position from, Range to) {
+    auto map_it = range_dependants_.find(to);
+    if (map_it == range_dependants_.end()) {
+        return;
+    }
+    std::vector<Position>& dependants = map_it->second;
+    auto it = std::lower_bound(dependants.begin(), dependants.end(), from);
+    if (it == dependants.end() || !(*it == from)) {
+        return;
+    }
+    dependants.erase(it);
+    --range_edge_count_;
+    if (!dependants.empty()) {
+        return;
+    }
+    ForEachTile(to, [&](int tile) {
+        auto tile_it = range_tiles_.find(tile);
+        std::vector<const RangeDependants::value_type*>& ranges = tile_it->second;
+        *std::find(ranges.begin(), ranges.end(), &*map_it) = ranges.back();
+        ranges.pop_back();
+        if (ranges.empty()) {
+            range_tiles_.erase(tile_it);
+        }
+    });
+    range_dependants_.erase(map_it);
+}
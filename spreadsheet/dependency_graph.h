@@ -0,0 +1,112 @@
+#pragma once
+
+#include "common.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Reverse dependency index: for every cell keeps the sorted list of cells
+// whose formulas reference it. Edges are replaced on each edit by diffing the
+// old and the new reference lists, so the index never keeps stale dependants.
+class DependencyGraph {
+public:
+    // Both lists must be sorted with Comp, as returned by
+    // FormulaInterface::GetReferencedCells()
+    void UpdateReferences(Position cell, const std::vector<Position>& old_refs,
+                          const std::vector<Position>& new_refs);
+
+    // Ranges read by aggregate functions are not expanded into cells: each
+    // distinct range keeps the sorted list of its dependants and is put into
+    // the RANGE_TILE_SIZE x RANGE_TILE_SIZE tiles it covers, so a lookup checks
+    // the ranges of a single tile. Lists are sorted.
+    void UpdateRangeReferences(Position cell, const std::vector<Range>& old_ranges,
+                               const std::vector<Range>& new_ranges);
+
+    // Direct dependants only, ranges are not included
+    const std::vector<Position>& GetDependants(Position pos) const;
+    bool HasDependants(Position pos) const;
+    // Calls func(Position) for every cell that references pos directly or
+    // through a range; a cell may be reported more than once
+    template <typename Func>
+    void ForEachDependant(Position pos, Func func) const;
+
+    // Calls func(Position, const std::vector<Position>& dependants) for every
+    // cell that has direct dependants
+    template <typename Func>
+    void ForEachReferencedCell(Func func) const {
+        for (const auto& [pos, dependants] : dependants_) {
+            func(pos, dependants);
+        }
+    }
+
+    // Bulk loading of direct edges, e.g. from a snapshot: `dependants` must be
+    // sorted. Does nothing and returns false if `pos` has dependants already.
+    bool SetDependants(Position pos, std::vector<Position> dependants);
+    void Reserve(size_t referenced_cell_count);
+
+    // Number of live cell -> referenced cell edges
+    size_t GetEdgeCount() const;
+    // Number of cells that have at least one dependant
+    size_t GetReferencedCellCount() const;
+    // Number of live cell -> range edges
+    size_t GetRangeEdgeCount() const;
+
+private:
+    static const int RANGE_TILE_SIZE = 64;
+    static const int TILES_PER_ROW = Position::MAX_COLS / RANGE_TILE_SIZE;
+
+    struct RangeHasher {
+        size_t operator()(const Range& range) const {
+            return PositionHasher()(range.first) * 37 + PositionHasher()(range.last);
+        }
+    };
+    using RangeDependants = std::unordered_map<Range, std::vector<Position>, RangeHasher>;
+
+    std::unordered_map<Position, std::vector<Position>, PositionHasher> dependants_;
+    size_t edge_count_ = 0;
+    RangeDependants range_dependants_;
+    // elements of an unordered_map don't move, so tiles point right at them
+    std::unordered_map<int, std::vector<const RangeDependants::value_type*>> range_tiles_;
+    size_t range_edge_count_ = 0;
+
+    void AddEdge(Position from, Position to);
+    void RemoveEdge(Position from, Position to);
+    void AddRangeEdge(Position from, Range to);
+    void RemoveRangeEdge(Position from, Range to);
+
+    static int GetTileIndex(Position pos) {
+        return pos.row / RANGE_TILE_SIZE * TILES_PER_ROW + pos.col / RANGE_TILE_SIZE;
+    }
+    template <typename Func>
+    static void ForEachTile(Range range, Func func);
+};
+
+template <typename Func>
+void DependencyGraph::ForEachDependant(Position pos, Func func) const {
+    for (Position dependant : GetDependants(pos)) {
+        func(dependant);
+    }
+    if (range_tiles_.empty()) {
+        return;
+    }
+    auto it = range_tiles_.find(GetTileIndex(pos));
+    if (it == range_tiles_.end()) {
+        return;
+    }
+    for (const RangeDependants::value_type* range : it->second) {
+        if (range->first.Contains(pos)) {
+            for (Position dependant : range->second) {
+                func(dependant);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void DependencyGraph::ForEachTile(Range range, Func func) {
+    for (int row = range.first.row / RANGE_TILE_SIZE; row <= range.last.row / RANGE_TILE_SIZE; ++row) {
+        for (int col = range.first.col / RANGE_TILE_SIZE; col <= range.last.col / RANGE_TILE_SIZE; ++col) {
+            func(row * TILES_PER_ROW + col);
+        }
+    }
+}
@@ -5,7 +5,9 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <functional>
 #include <sstream>
+#include <utility>
 
 using namespace std::literals;
 
@@ -33,77 +35,89 @@ std::string_view FormulaError::ToString() const {
         return "#VALUE!"sv;
     }
     else {
-        return "REF!"sv;
+        return "#REF!"sv;
     }
 }
 
 namespace {
-    class Formula : public FormulaInterface {
-    public:
-        explicit Formula(std::string expression)
-            try : ast_(ParseFormulaAST(expression))
-        {
+    Position Shift(Position pos, Position shift) {
+        return {pos.row + shift.row, pos.col + shift.col};
+    }
 
+    FormulaAST ParseExpression(const std::string& expression) {
+        try {
+            return ParseFormulaAST(expression);
         }
         catch (const std::exception& ex) {
             throw FormulaException(ex.what());
         }
+    }
+
+    // The tree may be shared with the formulas of other cells: its references
+    // are the ones of this formula moved back by `shift_`
+    class Formula : public FormulaInterface {
+    public:
+        Formula(std::shared_ptr<const FormulaAST> ast, Position shift)
+            : ast_(std::move(ast)),
+              shift_(shift) {
+        }
 
         Value Evaluate(const SheetInterface& sheet) const override {
-            try {
-                std::function<double(Position)> func = [&sheet](Position pos) {
-                    if (!pos.IsValid()) {
-                        throw FormulaError(FormulaError::Category::Ref);
-                    }
-                    const CellInterface* cell = sheet.GetCell(pos);
-                    double result = 0.0;
-                    if (cell) {
-                        auto value = cell->GetValue();
-                        if (std::holds_alternative<std::string>(value)) {
-                            try {
-                                size_t size;
-                                std::string str_value = std::get<std::string>(value);
-                                result = std::stod(str_value, &size);
-                                if (size != str_value.size()) {
-                                    throw FormulaError(FormulaError::Category::Value);
-                                }
-                            }
-                            catch (...) {
-                                throw FormulaError(FormulaError::Category::Value);
-                            }
-                        }
-                        else if (std::holds_alternative<double>(value)) {
-                            result = std::get<double>(value);
-                        }
-                        else {
-                            throw FormulaError(FormulaError::Category::Value);
-                        }
-                    }
-
-                    return result;
-                    };
-
-                return ast_.Execute(func);
-            }
-            catch (const FormulaError& fe) {
-                return fe;
-            }
+            std::function<ExecResult(Position)> func = [&sheet, shift = shift_](Position pos) -> ExecResult {
+                pos = Shift(pos, shift);
+                if (!pos.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                const CellInterface* cell = sheet.GetCell(pos);
+                if (!cell) {
+                    return 0.0;
+                }
+                return cell->GetNumericValue();
+            };
+            RangeReader read_range = [&sheet, shift = shift_](Range range, std::vector<double>& values) {
+                return sheet.GetNumericValues({Shift(range.first, shift), Shift(range.last, shift)}, values);
+            };
+
+            return ast_->Execute(func, read_range);
         }
         std::string GetExpression() const override {
             std::ostringstream output;
-            ast_.PrintFormula(output);
+            ast_->PrintFormula(output, shift_);
             return output.str();
         }
         std::vector<Position> GetReferencedCells() const override {
-            // the list is already sorted
-            const std::forward_list<Position> cells = ast_.GetCells();
-            std::vector<Position> referenced_cells(cells.begin(), cells.end());
+            // the list is already sorted, a shift keeps the order
+            auto cells = ast_->GetCells();
+            std::vector<Position> referenced_cells;
+            referenced_cells.reserve(cells.size());
+            for (Position pos : cells) {
+                referenced_cells.push_back(Shift(pos, shift_));
+            }
             DeleteDuplicates(referenced_cells);
             return referenced_cells;
         }
+        std::vector<Range> GetReferencedRanges() const override {
+            auto ranges = ast_->GetRanges();
+            std::vector<Range> referenced_ranges;
+            referenced_ranges.reserve(ranges.size());
+            for (Range range : ranges) {
+                referenced_ranges.push_back({Shift(range.first, shift_), Shift(range.last, shift_)});
+            }
+            referenced_ranges.erase(std::unique(referenced_ranges.begin(), referenced_ranges.end()),
+                                    referenced_ranges.end());
+            return referenced_ranges;
+        }
+
+        const FormulaAST& GetAST() const override {
+            return *ast_;
+        }
+        Position GetASTShift() const override {
+            return shift_;
+        }
 
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_;
+        Position shift_;
 
         static void DeleteDuplicates(std::vector<Position>& cells) {
             auto it = std::unique(cells.begin(), cells.end());
@@ -116,5 +130,84 @@ namespace {
 
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    return MakeFormula(ParseExpression(expression));
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(FormulaAST ast) {
+    return MakeFormula(std::make_shared<const FormulaAST>(std::move(ast)), {0, 0});
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position shift) {
+    return std::make_unique<Formula>(std::move(ast), shift);
+}
+
+std::unique_ptr<FormulaInterface> FormulaTemplates::Parse(std::string_view expression, Position pos) {
+    // reused, so that a lookup allocates nothing
+    thread_local std::string key;
+    key.clear();
+    if (!AppendRelativeKey(expression, pos, key)) {
+        return ParseFormula(std::string(expression));
+    }
+    {
+        std::lock_guard lock(mutex_);
+        auto it = templates_.find(key);
+        if (it != templates_.end()) {
+            if (auto ast = it->second.ast.lock()) {
+                return MakeFormula(std::move(ast), {pos.row - it->second.anchor.row, pos.col - it->second.anchor.col});
+            }
+        }
+    }
+
+    // parsed outside the lock, so that threads parse different formulas at once
+    auto ast = std::make_shared<const FormulaAST>(ParseExpression(std::string(expression)));
+    std::lock_guard lock(mutex_);
+    Template& entry = templates_[key];
+    // another thread may have parsed the same key meanwhile
+    if (auto existing = entry.ast.lock()) {
+        return MakeFormula(std::move(existing), {pos.row - entry.anchor.row, pos.col - entry.anchor.col});
+    }
+    entry = {ast, pos};
+    if (templates_.size() >= sweep_size_) {
+        SweepExpired();
+    }
+    return MakeFormula(std::move(ast), {0, 0});
+}
+
+std::pair<std::shared_ptr<const FormulaAST>, Position> FormulaTemplates::Add(std::shared_ptr<const FormulaAST> ast,
+                                                                             Position pos) {
+    // the key is built from the text, the same as the one of a typed formula
+    std::ostringstream output;
+    ast->PrintFormula(output);
+    std::string key;
+    if (!AppendRelativeKey(output.str(), pos, key)) {
+        return {std::move(ast), pos};
+    }
+    std::lock_guard lock(mutex_);
+    Template& entry = templates_[key];
+    if (auto existing = entry.ast.lock()) {
+        return {std::move(existing), entry.anchor};
+    }
+    entry = {ast, pos};
+    if (templates_.size() >= sweep_size_) {
+        SweepExpired();
+    }
+    return {std::move(ast), pos};
+}
+
+size_t FormulaTemplates::GetKeyCount() const {
+    std::lock_guard lock(mutex_);
+    return templates_.size();
+}
+
+void FormulaTemplates::SweepExpired() {
+    for (auto it = templates_.begin(); it != templates_.end();) {
+        if (it->second.ast.expired()) {
+            it = templates_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    // amortized: the map grows twice before the next sweep
+    sweep_size_ = std::max<size_t>(1024, templates_.size() * 2);
 }
@@ -3,12 +3,21 @@
 #include "common.h"
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+class FormulaAST;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT, аргументы которых -
+//   выражения и диапазоны: SUM(A1:A500), MAX(A1:B2,C3*2)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +43,58 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны, которые читают агрегатные функции формулы. Ячейки
+    // диапазонов не входят в GetReferencedCells(). Список отсортирован по
+    // возрастанию и не содержит повторов.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Возвращает разобранное дерево формулы, по нему формула сохраняется в
+    // снимок таблицы. Дерево может быть общим с другими формулами, тогда его
+    // ссылки нужно сдвинуть на GetASTShift().
+    virtual const FormulaAST& GetAST() const = 0;
+    virtual Position GetASTShift() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Создаёт формулу из готового дерева, без разбора текста.
+std::unique_ptr<FormulaInterface> MakeFormula(FormulaAST ast);
+// Создаёт формулу с общим деревом, ссылки которого сдвинуты на shift.
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position shift);
+
+// Общие деревья формул. Формулы, скопированные вдоль столбца (=A2*B2, =A3*B3,
+// ...), отличаются только ссылками, сдвинутыми на смещение своей ячейки. Если
+// записать ссылки относительно ячейки (R[0]C[-2]*R[0]C[-1]), тексты совпадут.
+// По такому ключу формула разбирается один раз, а остальные ячейки хранят
+// общее неизменяемое дерево и свой сдвиг. Шаблон живёт, пока на него ссылается
+// хоть одна формула. Потокобезопасен.
+class FormulaTemplates {
+public:
+    // Разбирает формулу, записанную в ячейке pos, или берёт готовое дерево.
+    // Бросает FormulaException так же, как ParseFormula.
+    std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position pos);
+    // Добавляет готовое дерево формулы ячейки pos, например прочитанное из
+    // снимка, под ключом её текста, чтобы Parse потом брал его. Если дерево с
+    // таким ключом уже есть, возвращает его и ячейку, для которой оно разобрано.
+    std::pair<std::shared_ptr<const FormulaAST>, Position> Add(std::shared_ptr<const FormulaAST> ast, Position pos);
+
+    // Число ключей, в том числе тех, чьи деревья уже удалены
+    size_t GetKeyCount() const;
+
+private:
+    struct Template {
+        std::weak_ptr<const FormulaAST> ast;
+        // ячейка, для которой дерево разобрано
+        Position anchor;
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Template> templates_;
+    // при таком числе ключей удаляются те, чьи деревья уже удалены
+    size_t sweep_size_ = 1024;
+
+    void SweepExpired();
+};
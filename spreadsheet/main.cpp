@@ -1,11 +1,39 @@
+#include "FormulaAST.h"
+#include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "delimited_export.h"
+#include "delimited_import.h"
 #include "formula.h"
+#include "packed_value.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <tuple>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
+inline std::ostream& operator<<(std::ostream& output, Range range) {
+    return output << range.first << ":" << range.last;
+}
+
 inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
@@ -23,8 +51,17 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::NumericValue& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
-std::string ToString(FormulaError::Category category) {
+[[maybe_unused]] std::string ToString(FormulaError::Category category) {
     return std::string(FormulaError(category).ToString());
 }
 
@@ -76,6 +113,60 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+// the codecs also work at compile time
+constexpr bool ToCharsEquals(Position pos, std::string_view expected) {
+    char buffer[Position::MAX_STRING_LENGTH] = {};
+    return std::string_view(buffer, pos.ToChars(buffer) - buffer) == expected;
+}
+static_assert(ToCharsEquals({16383, 16383}, "XFD16384"));
+static_assert(ToCharsEquals({0, 1352}, "AZA1"));
+static_assert(ToCharsEquals({-1, 0}, ""));
+static_assert(Position::FromString("AZA1").col == 1352);
+static_assert(!Position::FromString("XFD16385").IsValid());
+
+void TestPositionCodecs() {
+    // Letters and digits are coded independently, so every column goes to its
+    // string and back with the rows where the number of digits changes, and
+    // every row with such columns. The bench goes over the whole sheet.
+    const std::vector<int> row_edges = {0, 8, 9, 98, 99, 998, 999, 9998, 9999, Position::MAX_ROWS - 1};
+    const std::vector<int> col_edges = {0, 25, 26, 701, 702, Position::MAX_COLS - 1};
+    auto roundTrip = [](Position pos) {
+        char buffer[Position::MAX_STRING_LENGTH];
+        char* end = pos.ToChars(buffer);
+        Position parsed = Position::FromString(std::string_view(buffer, end - buffer));
+        if (!(parsed == pos)) {
+            ASSERT_EQUAL(parsed, pos);
+        }
+    };
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        for (int row : row_edges) {
+            roundTrip({row, col});
+        }
+    }
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        for (int col : col_edges) {
+            roundTrip({row, col});
+        }
+    }
+    ASSERT_EQUAL((Position{9999, 702}).ToString(), "AAA10000");
+    // the columns are in the order of their names: shorter first, then alphabetically
+    std::string previous = Position{0, 0}.ToString();
+    for (int col = 1; col < Position::MAX_COLS; ++col) {
+        std::string name = Position{0, col}.ToString();
+        ASSERT(name.size() > previous.size() || (name.size() == previous.size() && name > previous));
+        previous = std::move(name);
+    }
+
+    ASSERT_EQUAL(Position::FromString("A01"), "A1"_pos);
+    // at most 17 characters, leading zeros included
+    ASSERT_EQUAL(Position::FromString("B0000000000000042"), "B42"_pos);
+    ASSERT(!Position::FromString("B00000000000000042").IsValid());
+    ASSERT(!Position::FromString("AB").IsValid());
+    ASSERT(!Position::FromString("a1").IsValid());
+    ASSERT(!Position::FromString("AAAA1").IsValid());
+    ASSERT(!Position::FromString("A99999999999").IsValid());
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -133,6 +224,40 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestClearReferencedCell() {
+    auto print = [](const SheetInterface& sheet) {
+        std::ostringstream values;
+        std::ostringstream texts;
+        sheet.PrintValues(values);
+        sheet.PrintTexts(texts);
+        return std::pair{values.str(), texts.str()};
+    };
+
+    // B1 keeps A1 alive as a placeholder, which prints as nothing
+    auto cleared = CreateSheet();
+    cleared->SetCell("A1"_pos, "5");
+    cleared->SetCell("B1"_pos, "=A1");
+    cleared->SetCell("C1"_pos, "x");
+    cleared->ClearCell("A1"_pos);
+    ASSERT(cleared->GetCell("A1"_pos) != nullptr);
+    auto never_set = CreateSheet();
+    never_set->SetCell("B1"_pos, "=A1");
+    never_set->SetCell("C1"_pos, "x");
+    ASSERT_EQUAL(cleared->GetPrintableSize(), never_set->GetPrintableSize());
+    ASSERT(print(*cleared) == print(*never_set));
+    auto [values, texts] = print(*cleared);
+    ASSERT_EQUAL(values, "\t0\tx\n");
+    ASSERT_EQUAL(texts, "\t=A1\tx\n");
+
+    // nobody reads A1 any more, so clearing it removes the cell
+    cleared->SetCell("B1"_pos, "7");
+    cleared->ClearCell("B1"_pos);
+    ASSERT(cleared->GetCell("B1"_pos) == nullptr);
+    std::tie(values, texts) = print(*cleared);
+    ASSERT_EQUAL(values, "\t\tx\n");
+    ASSERT_EQUAL(texts, "\t\tx\n");
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -193,6 +318,304 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaParserEdgeCases() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT_EQUAL(reformat(".5+1e3"), "0.5+1000");
+    ASSERT_EQUAL(reformat("1.25E-2"), "0.0125");
+    ASSERT_EQUAL(reformat("-2*3"), "-2*3");
+    ASSERT_EQUAL(reformat("-(2+3)"), "-(2+3)");
+    ASSERT_EQUAL(reformat("2--3"), "2--3");
+    ASSERT_EQUAL(reformat("+-+A1"), "+-+A1");
+    ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+    ASSERT_EQUAL(reformat("1/(2*3)"), "1/(2*3)");
+    ASSERT_EQUAL(reformat("\t(A1)\r\n*\nB2"), "A1*B2");
+    ASSERT_EQUAL(reformat("1e-400"), "0");
+
+    ASSERT(isIncorrect(""));
+    ASSERT(isIncorrect("1."));
+    ASSERT(isIncorrect("."));
+    ASSERT(isIncorrect("1e"));
+    ASSERT(isIncorrect("1e+"));
+    ASSERT(isIncorrect("1.5.5"));
+    ASSERT(isIncorrect("1e400"));
+    ASSERT(isIncorrect("a1"));
+    ASSERT(isIncorrect("A1B2"));
+    ASSERT(isIncorrect("()"));
+    ASSERT(isIncorrect("1 2"));
+    ASSERT(isIncorrect("2*"));
+    ASSERT(isIncorrect("1\v+2"));
+}
+
+void TestFormulaArena() {
+    Arena arena(64);
+    std::vector<double*> numbers;
+    for (int i = 0; i < 1000; ++i) {
+        arena.New<char>('x');
+        numbers.push_back(arena.New<double>(i));
+    }
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQUAL(reinterpret_cast<uintptr_t>(numbers[i]) % alignof(double), 0u);
+        ASSERT_EQUAL(*numbers[i], i);
+    }
+    ASSERT(arena.GetBlockCount() > 1);
+
+    // the parser sizes the arena up front
+    FormulaAST ast = ParseFormulaAST("-(C1+A1)*3.5/B2-A1");
+    ASSERT_EQUAL(ast.GetArena().GetBlockCount(), 1u);
+    std::vector<Position> cells(ast.GetCells().begin(), ast.GetCells().end());
+    ASSERT_EQUAL(cells, (std::vector{"A1"_pos, "A1"_pos, "B2"_pos, "C1"_pos}));
+
+    std::string long_formula = "A1";
+    for (int i = 0; i < 1000; ++i) {
+        long_formula += "+B" + std::to_string(i + 1) + "*2";
+    }
+    FormulaAST moved = ParseFormulaAST(long_formula);
+    ast = std::move(moved);
+    ASSERT_EQUAL(ast.GetArena().GetBlockCount(), 1u);
+    ASSERT_EQUAL(ast.GetCells().size(), 1001u);
+    ASSERT_EQUAL(std::get<double>(ast.Execute([](Position pos) -> ExecResult {
+                     return pos.row + 1.0;
+                 })),
+                 1.0 + 2 * 1000 * 1001 / 2);
+}
+
+// Random expressions for the parser fuzz tests
+class FormulaGenerator {
+public:
+    explicit FormulaGenerator(unsigned seed)
+        : gen_(seed) {
+    }
+
+    std::string Expression(int depth) {
+        std::string result = Space();
+        switch (depth > 0 ? Uniform(0, 6) : Uniform(0, 1)) {
+            case 0:
+                result += Number();
+                break;
+            case 1:
+                result += Position{Uniform(0, 99), Uniform(0, 30)}.ToString();
+                break;
+            case 2:
+                result += "(" + Expression(depth - 1) + ")";
+                break;
+            case 3:
+                result += std::string(1, "+-"[Uniform(0, 1)]) + Expression(depth - 1);
+                break;
+            case 6:
+                result += Call(depth - 1);
+                break;
+            default:
+                result += Expression(depth - 1) + std::string(1, "+-*/"[Uniform(0, 3)]) + Expression(depth - 1);
+        }
+        return result + Space();
+    }
+
+    // inserts, deletes or replaces a few characters
+    std::string Mutate(std::string expression) {
+        static const std::string alphabet = "0123456789.eE+-*/() AZ\t:,SUM";
+        for (int i = Uniform(1, 3); i > 0; --i) {
+            size_t at = Uniform(0, int(expression.size()));
+            char c = alphabet[Uniform(0, int(alphabet.size()) - 1)];
+            switch (Uniform(0, 2)) {
+                case 0:
+                    expression.insert(expression.begin() + at, c);
+                    break;
+                case 1:
+                    if (at < expression.size()) {
+                        expression.erase(at, 1);
+                    }
+                    break;
+                default:
+                    if (at < expression.size()) {
+                        expression[at] = c;
+                    }
+            }
+        }
+        return expression;
+    }
+
+private:
+    std::mt19937 gen_;
+
+    int Uniform(int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(gen_);
+    }
+
+    std::string Space() {
+        return std::string(Uniform(0, 3) == 0 ? 1 : 0, ' ');
+    }
+
+    std::string Call(int depth) {
+        static const char* names[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+        std::string result = std::string(names[Uniform(0, 4)]) + Space() + "(";
+        for (int i = Uniform(1, 3); i > 0; --i) {
+            if (Uniform(0, 1)) {
+                result += Space() + Position{Uniform(0, 99), Uniform(0, 30)}.ToString() + Space() + ":" + Space() +
+                          Position{Uniform(0, 99), Uniform(0, 30)}.ToString() + Space();
+            } else {
+                result += Expression(depth);
+            }
+            result += i > 1 ? "," : ")";
+        }
+        return result;
+    }
+
+    std::string Number() {
+        std::string digits = std::to_string(Uniform(0, 999));
+        switch (Uniform(0, 3)) {
+            case 0:
+                return digits;
+            case 1:
+                return digits + "." + std::to_string(Uniform(0, 99));
+            case 2:
+                return "." + digits;
+            default:
+                return digits + "eE"[Uniform(0, 1)] + std::string(Uniform(0, 1) ? "-" : "") +
+                       std::to_string(Uniform(0, 20));
+        }
+    }
+};
+
+void TestFormulaParserFuzz() {
+    FormulaGenerator generator(2024);
+    for (int i = 0; i < 2000; ++i) {
+        std::string expression = generator.Expression(i % 6);
+        auto formula = ParseFormula(expression);
+        // the printed form parses back to the same formula
+        auto reparsed = ParseFormula(formula->GetExpression());
+        ASSERT_EQUAL(reparsed->GetExpression(), formula->GetExpression());
+        ASSERT_EQUAL(reparsed->GetReferencedCells(), formula->GetReferencedCells());
+
+        // so does the serialized tree
+        std::vector<ASTImpl::SerializedNode> nodes;
+        formula->GetAST().Serialize(nodes);
+        auto restored = MakeFormula(FormulaAST::Deserialize(nodes.data(), nodes.size()));
+        ASSERT_EQUAL(restored->GetExpression(), formula->GetExpression());
+        ASSERT_EQUAL(restored->GetReferencedCells(), formula->GetReferencedCells());
+        ASSERT_EQUAL(restored->GetReferencedRanges(), formula->GetReferencedRanges());
+
+        // broken input is either rejected with FormulaException or accepted
+        std::string mutated = generator.Mutate(expression);
+        try {
+            auto mutated_formula = ParseFormula(mutated);
+            ASSERT_EQUAL(ParseFormula(mutated_formula->GetExpression())->GetExpression(),
+                         mutated_formula->GetExpression());
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestFormulaBytecode() {
+    // the compiled code gives what the tree gives, bit for bit, and fails
+    // with the error of the same cell
+    auto cell_value = [](Position pos) -> ExecResult {
+        switch (pos.col) {
+            case 0:
+                return 0.0;
+            case 1:
+                return -0.0;
+            case 2:
+                return 1.0;
+            case 3:
+                return std::numeric_limits<double>::infinity();
+            case 4:
+                return FormulaError(FormulaError::Category::Value);
+            default:
+                return FormulaError(FormulaError::Category::Ref);
+        }
+    };
+    auto same = [](const ExecResult& lhs, const ExecResult& rhs) {
+        if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+            double l = std::get<double>(lhs);
+            double r = std::get<double>(rhs);
+            return (l == r && std::signbit(l) == std::signbit(r)) || (std::isnan(l) && std::isnan(r));
+        }
+        return lhs == rhs;
+    };
+    std::mt19937 gen(6);
+    auto uniform = [&gen](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(gen);
+    };
+    std::function<std::string(int)> expression = [&](int depth) -> std::string {
+        static const char* atoms[] = {"0", "1", "2", "0.5", "1e308", "A1", "B1", "C1", "D1", "E1", "F1"};
+        switch (depth > 0 ? uniform(0, 5) : 0) {
+            case 0:
+                return atoms[uniform(0, 10)];
+            case 1:
+                return std::string(uniform(0, 1) ? "-(" : "+(") + expression(depth - 1) + ")";
+            case 2:
+                return std::string(uniform(0, 1) ? "SUM(" : "MIN(") + expression(depth - 1) + "," +
+                       expression(depth - 1) + ")";
+            default:
+                return "(" + expression(depth - 1) + ")" + "+-*/"[uniform(0, 3)] + "(" + expression(depth - 1) + ")";
+        }
+    };
+    for (int i = 0; i < 20000; ++i) {
+        FormulaAST ast = ParseFormulaAST(expression(i % 6));
+        ASSERT(same(ast.Execute(cell_value), ast.ExecuteTree(cell_value)));
+    }
+}
+
+void TestFormulaOptimization() {
+    // constants and identities are gone from the code, the text stays as written
+    auto code_size = [](const std::string& expression) {
+        return ParseFormulaAST(expression).GetCode().size();
+    };
+    ASSERT_EQUAL(code_size("2*3+(A1+B1)*1-0"), 5u);
+    ASSERT_EQUAL(code_size("1*(A1-B1)/1+SUM(1,2,MAX(3,4))"), 5u);
+    ASSERT_EQUAL(code_size("--A1-(-B1)"), 3u);
+    ASSERT_EQUAL(code_size("-A1*-B1"), 3u);
+    ASSERT_EQUAL(code_size("-(2+3)*4"), 1u);
+    ASSERT_EQUAL(ParseFormula("2*3+(A1+B1)*1-0")->GetExpression(), "2*3+(A1+B1)*1-0");
+    ASSERT_EQUAL(ParseFormula("--A1-(-B1)")->GetExpression(), "--A1--B1");
+    // -0+0 is +0, and a cell may hold inf, which times one is #ARITHM!
+    ASSERT_EQUAL(code_size("A1+0"), 3u);
+    ASSERT_EQUAL(code_size("A1*1"), 3u);
+    ASSERT_EQUAL(code_size("(A1+B1)*1"), 3u);
+    // a constant error is left to the run
+    ASSERT_EQUAL(code_size("1/0"), 3u);
+    ASSERT_EQUAL(code_size("AVERAGE(1e308,1e308)"), 3u);
+    ASSERT_EQUAL(ParseFormula("1/0+1")->Evaluate(Sheet{}), FormulaInterface::Value(FormulaError::Category::Arithmetic));
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+void TestFormulaParserMatchesAntlr() {
+    // the result of a parse: the AST dump, or nothing on error
+    auto parse = [](const std::string& expression, FormulaParserKind kind) -> std::string {
+        try {
+            std::ostringstream out;
+            FormulaAST ast = ParseFormulaAST(expression, kind);
+            ast.Print(out);
+            for (Position cell : ast.GetCells()) {
+                out << ' ' << cell.ToString();
+            }
+            return out.str();
+        } catch (const FormulaException&) {
+            return "<error>";
+        }
+    };
+
+    FormulaGenerator generator(42);
+    for (int i = 0; i < 5000; ++i) {
+        std::string expression = generator.Expression(i % 6);
+        ASSERT_EQUAL(parse(expression, FormulaParserKind::Fast), parse(expression, FormulaParserKind::Antlr));
+        std::string mutated = generator.Mutate(expression);
+        ASSERT_EQUAL(parse(mutated, FormulaParserKind::Fast), parse(mutated, FormulaParserKind::Antlr));
+    }
+}
+#endif
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -212,22 +635,22 @@ void TestErrorDiv0() {
 
     sheet->SetCell("A1"_pos, "=1/0");
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
 
     sheet->SetCell("A1"_pos, "=1e+200/1e-200");
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
 
     sheet->SetCell("A1"_pos, "=0/0");
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 CellInterface::Value(FormulaError::Category::Div0));
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
 
     {
         std::ostringstream formula;
         formula << '=' << max << '+' << max;
         sheet->SetCell("A1"_pos, formula.str());
         ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
+                     CellInterface::Value(FormulaError::Category::Arithmetic));
     }
 
     {
@@ -235,7 +658,7 @@ void TestErrorDiv0() {
         formula << '=' << -max << '-' << max;
         sheet->SetCell("A1"_pos, formula.str());
         ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
+                     CellInterface::Value(FormulaError::Category::Arithmetic));
     }
 
     {
@@ -243,14 +666,52 @@ void TestErrorDiv0() {
         formula << '=' << max << '*' << max;
         sheet->SetCell("A1"_pos, formula.str());
         ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
+                     CellInterface::Value(FormulaError::Category::Arithmetic));
     }
 }
 
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=-A2*2");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("A1"_pos, " 1.5e1");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(-32.0));
+
+    ASSERT_EQUAL(FormulaError(FormulaError::Category::Ref).ToString(), "#REF!");
+}
+
+void TestNumericValueOfText() {
+    auto sheet = CreateSheet();
+    auto numeric = [&](Position pos, std::string text) {
+        sheet->SetCell(pos, std::move(text));
+        return sheet->GetCell(pos)->GetNumericValue();
+    };
+    const CellInterface::NumericValue value_error = FormulaError(FormulaError::Category::Value);
+
+    ASSERT_EQUAL(numeric("A1"_pos, "42"), CellInterface::NumericValue(42.0));
+    ASSERT_EQUAL(numeric("A1"_pos, "'-1.5"), CellInterface::NumericValue(-1.5));
+    ASSERT_EQUAL(numeric("A1"_pos, "1e3"), CellInterface::NumericValue(1000.0));
+    ASSERT_EQUAL(numeric("A1"_pos, "12px"), value_error);
+    ASSERT_EQUAL(numeric("A1"_pos, "'"), value_error);
+    ASSERT_EQUAL(numeric("A1"_pos, "1e999"), value_error);
+    ASSERT_EQUAL(numeric("A1"_pos, ""), CellInterface::NumericValue(0.0));
+    ASSERT_EQUAL(numeric("A2"_pos, "=A3/2"), CellInterface::NumericValue(0.0));
+    ASSERT_EQUAL(numeric("A3"_pos, "'5"), CellInterface::NumericValue(5.0));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetNumericValue(), CellInterface::NumericValue(2.5));
+}
+
 void TestEmptyCellTreatedAsZero() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "=B2");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
 }
 
 void TestFormulaInvalidPosition() {
@@ -289,6 +750,27 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintableSizeShrink() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "top");
+    sheet->SetCell("C300"_pos, "far");
+    sheet->SetCell("B2"_pos, "=C300");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{300, 3}));
+
+    // clearing the farthest cell shrinks the area back to the remaining ones
+    sheet->ClearCell("C300"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    // cells with empty text don't count
+    sheet->SetCell("B2"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->SetCell("A1"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    sheet->SetCell("Z200"_pos, "again");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{200, 26}));
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -313,6 +795,1059 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
 }
 
+void TestTransitiveInvalidation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2+1");
+    sheet->SetCell("A4"_pos, "=A3+1");
+    sheet->SetCell("B1"_pos, "=A4*2");
+    sheet->SetCell("B2"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(9.0));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    // a cleared cell keeps its dependants
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(7.0));
+    sheet->SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(27.0));
+
+    // an empty placeholder gets the dependants of the formula referring to it
+    sheet->SetCell("C1"_pos, "=C5");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("C5"_pos, "=A2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+}
+
+void TestAggregateFunctions() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "2");
+    sheet->SetCell("A3"_pos, "=1+2");
+    sheet->SetCell("A4"_pos, "'4");
+    auto evaluate = [&sheet](std::string expression) {
+        return ParseFormula(std::move(expression))->Evaluate(*sheet);
+    };
+
+    // empty cells are skipped by all the functions
+    ASSERT_EQUAL(evaluate("SUM(A1:A5)"), FormulaInterface::Value(10.0));
+    ASSERT_EQUAL(evaluate("AVERAGE(A1:A5)"), FormulaInterface::Value(2.5));
+    ASSERT_EQUAL(evaluate("MIN(A1:A5)"), FormulaInterface::Value(1.0));
+    ASSERT_EQUAL(evaluate("MAX(A5:A1)"), FormulaInterface::Value(4.0));
+    ASSERT_EQUAL(evaluate("COUNT(A1:A5)"), FormulaInterface::Value(4.0));
+    ASSERT_EQUAL(evaluate("COUNT(A1:A5,7,A5)"), FormulaInterface::Value(6.0));
+    ASSERT_EQUAL(evaluate("SUM(A1:A2,A3*10,0.5)"), FormulaInterface::Value(33.5));
+    ASSERT_EQUAL(evaluate("MAX(SUM(A1:A2),-1)*2"), FormulaInterface::Value(6.0));
+    ASSERT_EQUAL(evaluate("MIN(C1:C3)"), FormulaInterface::Value(0.0));
+    ASSERT_EQUAL(evaluate("AVERAGE(C1:C3)"), FormulaInterface::Value(FormulaError::Category::Arithmetic));
+
+    // the first erroneous cell by rows wins, COUNT skips errors
+    sheet->SetCell("B2"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "abc");
+    ASSERT_EQUAL(evaluate("SUM(A1:B4)"), FormulaInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(evaluate("MAX(B1:B4)"), FormulaInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(evaluate("COUNT(A1:B4)"), FormulaInterface::Value(3.0));
+    // also when the cells are passed one by one
+    ASSERT_EQUAL(evaluate("COUNT(A1:A2)"), FormulaInterface::Value(1.0));
+    ASSERT_EQUAL(evaluate("COUNT(A1,A2)"), FormulaInterface::Value(1.0));
+    ASSERT_EQUAL(evaluate("COUNT(B1:B4)"), FormulaInterface::Value(0.0));
+    ASSERT_EQUAL(evaluate("COUNT(B1,B2,B3,B4)"), FormulaInterface::Value(3.0));
+    ASSERT_EQUAL(evaluate("COUNT(A2,B2,1/0,A1*2)+1"), FormulaInterface::Value(2.0));
+    ASSERT_EQUAL(evaluate("SUM(A1,A2)"), FormulaInterface::Value(FormulaError::Category::Value));
+
+    // without a range reader every cell of a range is read as a number
+    FormulaAST ast = ParseFormulaAST("SUM(A1:B3,MAX(A1:A2),AVERAGE(C1:C2,10))-COUNT(B1:B2)");
+    auto cell_value = [](Position pos) -> ExecResult {
+        return pos.row * 10.0 + pos.col;
+    };
+    ASSERT_EQUAL(std::get<double>(ast.Execute(cell_value)), 63.0 + 10.0 + 8.0 - 2.0);
+    ASSERT_EQUAL(std::get<double>(ast.ExecuteTree(cell_value)), 63.0 + 10.0 + 8.0 - 2.0);
+    FormulaAST count = ParseFormulaAST("COUNT(A1,B1:B2,A2/0)*2");
+    ASSERT_EQUAL(std::get<double>(count.Execute(cell_value)), 6.0);
+    ASSERT_EQUAL(std::get<double>(count.ExecuteTree(cell_value)), 6.0);
+
+    ASSERT_EQUAL(ParseFormula(" SUM ( A5 : A1 , 2*(3+1) ) ")->GetExpression(), "SUM(A1:A5,2*(3+1))");
+    ASSERT_EQUAL(ParseFormula("-MIN(A1:B2,C1)")->GetExpression(), "-MIN(A1:B2,C1)");
+    auto formula = ParseFormula("SUM(A1:A500,B1:C2)+SUM(B1:C2)+D7");
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{"D7"_pos});
+    ASSERT_EQUAL(formula->GetReferencedRanges(),
+                 (std::vector{Range{"A1"_pos, "A500"_pos}, Range{"B1"_pos, "C2"_pos}}));
+
+    std::vector<std::string> accepted;
+    for (const char* expression : {"SUM()", "SUMX(A1)", "FOO(1)", "SUM(A1:)", "SUM(:A1)", "A1:A2", "SUM(A1:A2",
+                                   "SUM(1,)", "SUM A1", "1+SUM", "SUM(A1:B2:C3)", "SUM(A1:ZZZZ1)"}) {
+        try {
+            ParseFormula(expression);
+            accepted.push_back(expression);
+        } catch (const FormulaException&) {
+        }
+    }
+    ASSERT_EQUAL(accepted, std::vector<std::string>{});
+}
+
+void TestRangeDependencies() {
+    Sheet sheet;
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    ASSERT_EQUAL(graph.GetRangeEdgeCount(), 1u);
+    // the range is not expanded into cells
+    ASSERT(sheet.GetCell("A500"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.SetCell("A500"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet.SetCell("A1"_pos, "=A500+1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(22.0));
+    sheet.ClearCell("A500"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    auto isCircular = [&sheet](Position pos, std::string text) {
+        try {
+            sheet.SetCell(pos, std::move(text));
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(isCircular("B2"_pos, "=MAX(A1:C3)"));
+    ASSERT(isCircular("A7"_pos, "=C1"));
+    ASSERT(isCircular("A7"_pos, "=COUNT(B1:C1)"));
+    ASSERT(!isCircular("A1001"_pos, "=COUNT(B1:C1)"));
+    ASSERT(!isCircular("D1"_pos, "=SUM(A1:C1)+SUM(A1:C1)"));
+
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(!isCircular("A1000"_pos, "=C1"));
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("A1001"_pos);
+    sheet.ClearCell("D1"_pos);
+    ASSERT_EQUAL(graph.GetRangeEdgeCount(), 0u);
+}
+
+void TestThreadPool() {
+    for (size_t threads : {1, 3}) {
+        ThreadPool pool(threads);
+        std::vector<int> hits(1000);
+        pool.ParallelFor(hits.size(), 7, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ++hits[i];
+            }
+        });
+        ASSERT_EQUAL(hits, std::vector<int>(1000, 1));
+
+        bool thrown = false;
+        try {
+            pool.ParallelFor(100, 1, [](size_t begin, size_t /* end */) {
+                if (begin == 42) {
+                    throw std::runtime_error("task failed");
+                }
+            });
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void TestRecalculateAll() {
+    Sheet sheet;
+    std::mt19937 gen(5);
+    // every formula reads cells to its left, so random sheets are acyclic
+    for (int row = 0; row < 300; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(gen() % 100));
+        for (int col = 1; col < 12; ++col) {
+            Position left{int(gen() % 300), int(gen() % col)};
+            Position other{int(gen() % 300), int(gen() % col)};
+            switch (gen() % 4) {
+                case 0:
+                    sheet.SetCell({row, col}, "=" + left.ToString() + "*1.5-" + other.ToString());
+                    break;
+                case 1:
+                    sheet.SetCell({row, col}, "=SUM(A1:" + Position{row, col - 1}.ToString() + ")/1000");
+                    break;
+                case 2:
+                    sheet.SetCell({row, col}, "=" + left.ToString() + "/(" + other.ToString() + "-50)");
+                    break;
+                default:
+                    sheet.SetCell({row, col}, "=MAX(" + left.ToString() + "," + other.ToString() + ")");
+            }
+        }
+    }
+    std::ostringstream lazy;
+    sheet.PrintValues(lazy);
+
+    for (size_t threads : {1, 2, 4, 8}) {
+        sheet.RecalculateAll(threads);
+        std::ostringstream recalculated;
+        sheet.PrintValues(recalculated);
+        ASSERT_EQUAL(recalculated.str(), lazy.str());
+    }
+
+    // an edit after the recalculation invalidates as usual
+    sheet.SetCell("A1"_pos, "1000");
+    sheet.RecalculateAll(3);
+    std::ostringstream recalculated;
+    sheet.PrintValues(recalculated);
+    ASSERT(recalculated.str() != lazy.str());
+}
+
+void TestSetCells() {
+    Sheet sheet;
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    // references go forward and backward inside the batch
+    sheet.SetCells({{"A1"_pos, "=A2+1"}, {"A2"_pos, "=B5*2"}, {"A3"_pos, "=SUM(A1:A2)"},
+                    {"B1"_pos, "text"}, {"B1"_pos, "1"}});
+    ASSERT(sheet.GetCell("B5"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 2}));
+
+    // the cached values above the edited cells are dropped
+    sheet.SetCells({{"B5"_pos, "3"}, {"C1"_pos, "=A3"}});
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 3}));
+
+    std::ostringstream texts_before;
+    sheet.PrintTexts(texts_before);
+    size_t edges_before = graph.GetEdgeCount();
+    size_t range_edges_before = graph.GetRangeEdgeCount();
+    auto assertUnchanged = [&] {
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), texts_before.str());
+        ASSERT_EQUAL(graph.GetEdgeCount(), edges_before);
+        ASSERT_EQUAL(graph.GetRangeEdgeCount(), range_edges_before);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+    };
+    auto failsWith = [&sheet](std::vector<std::pair<Position, std::string>> edits, auto exception) {
+        try {
+            sheet.SetCells(std::move(edits));
+        } catch (const decltype(exception)&) {
+            return true;
+        }
+        return false;
+    };
+
+    // a cycle inside the batch, through existing cells and through a range
+    ASSERT(failsWith({{"D1"_pos, "=D2"}, {"D2"_pos, "=D1"}}, CircularDependencyException("")));
+    assertUnchanged();
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT(failsWith({{"E1"_pos, "1"}, {"B5"_pos, "=C1"}}, CircularDependencyException("")));
+    assertUnchanged();
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT(failsWith({{"A2"_pos, "=7"}, {"D3"_pos, "=A3"}, {"A1"_pos, "=D3"}},
+                     CircularDependencyException("")));
+    assertUnchanged();
+    ASSERT(failsWith({{"A1"_pos, "=A1"}}, CircularDependencyException("")));
+    assertUnchanged();
+    // nothing is applied before a bad formula or position is found
+    ASSERT(failsWith({{"B5"_pos, "4"}, {"D1"_pos, "=1+"}}, FormulaException("")));
+    assertUnchanged();
+    ASSERT(failsWith({{"B5"_pos, "4"}, {Position::NONE, "1"}}, InvalidPositionException("")));
+    assertUnchanged();
+
+    // a diamond and a range read twice are not cycles
+    sheet.SetCells({{"D1"_pos, "=D2+D3"}, {"D2"_pos, "=D4"}, {"D3"_pos, "=D4+SUM(A1:A2)"},
+                    {"D4"_pos, "=SUM(A1:A2)"}});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(39.0));
+
+    // a cell cleared by its last edit leaves the printable area
+    sheet.SetCells({{"F9"_pos, "x"}, {"F9"_pos, ""}, {"C1"_pos, "y"}, {"C1"_pos, ""}});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "=");
+    sheet.SetCell("B1"_pos, "=+A1*-(A3+C7)");
+    sheet.SetCell("B2"_pos, "=SUM(A1:A3,B1,1)/COUNT(D1:D9)");
+    sheet.SetCell("B3"_pos, "=1/0");
+    sheet.SetCell("ZZ100"_pos, "=B1+B2");
+    sheet.SetCell("C1"_pos, "text");
+    sheet.ClearCell("C1"_pos);
+
+    std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    Snapshot::Save(sheet, path);
+    std::unique_ptr<Sheet> loaded = Snapshot::Load(path);
+
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT(loaded->GetCell("C7"_pos) != nullptr);
+    const DependencyGraph& graph = loaded->GetDependencyGraph();
+    ASSERT_EQUAL(graph.GetEdgeCount(), sheet.GetDependencyGraph().GetEdgeCount());
+    ASSERT_EQUAL(graph.GetRangeEdgeCount(), sheet.GetDependencyGraph().GetRangeEdgeCount());
+
+    // the loaded sheet tracks dependencies as the original one does
+    for (Sheet* target : {&sheet, loaded.get()}) {
+        target->SetCell("C7"_pos, "1");
+        target->SetCell("D5"_pos, "4");
+        target->SetCell("A2"_pos, "3");
+        target->SetCell("A3"_pos, "-1");
+    }
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    ASSERT_EQUAL(loaded->GetCell("ZZ100"_pos)->GetValue(), CellInterface::Value(5.0));
+    try {
+        loaded->SetCell("A1"_pos, "=ZZ100");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // a file is rejected as a whole when it is not a snapshot or is damaged
+    auto fails = [&path](std::string data) {
+        std::ofstream(path, std::ios::binary) << data;
+        try {
+            Snapshot::Load(path);
+        } catch (const SnapshotError&) {
+            return true;
+        }
+        return false;
+    };
+    std::string data;
+    {
+        Snapshot::Save(sheet, path);
+        std::ifstream input(path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    ASSERT(!fails(data));
+    ASSERT(fails(""));
+    ASSERT(fails("not a snapshot at all, just some text"));
+    ASSERT(fails(data.substr(0, data.size() / 2)));
+    std::string wrong_version = data;
+    wrong_version[8] = 99;
+    ASSERT(fails(wrong_version));
+    // an index with the right number of edges, but not the ones of the formulas
+    {
+        Sheet swapped;
+        swapped.SetCell("C300"_pos, "=A1");
+        swapped.SetCell("D400"_pos, "=A2");
+        Snapshot::Save(swapped, path);
+        std::ifstream input(path, std::ios::binary);
+        std::string swapped_data(std::istreambuf_iterator<char>(input), {});
+        input.close();
+        ASSERT(!fails(swapped_data));
+        // the two dependants are adjacent position records only in the index
+        auto record = [](int16_t row, int16_t col) {
+            return std::string(reinterpret_cast<const char*>(&row), 2) + std::string(reinterpret_cast<const char*>(&col), 2);
+        };
+        std::string c300 = record(299, 2);
+        std::string d400 = record(399, 3);
+        size_t at = swapped_data.find(c300 + d400);
+        if (at == std::string::npos) {
+            at = swapped_data.find(d400 + c300);
+        }
+        ASSERT(at != std::string::npos);
+        std::string first = swapped_data.substr(at, 4);
+        swapped_data.replace(at, 4, swapped_data.substr(at + 4, 4));
+        swapped_data.replace(at + 4, 4, first);
+        ASSERT(fails(swapped_data));
+
+        // moving the cell record of C300 to C1 closes a cycle through ranges,
+        // which the index doesn't hold
+        Sheet cyclic;
+        cyclic.SetCell("A1"_pos, "=SUM(C1:C2)");
+        cyclic.SetCell("C300"_pos, "=SUM(A1:A2)");
+        Snapshot::Save(cyclic, path);
+        input.open(path, std::ios::binary);
+        std::string cyclic_data(std::istreambuf_iterator<char>(input), {});
+        input.close();
+        ASSERT(!fails(cyclic_data));
+        at = cyclic_data.find(c300);
+        ASSERT(at != std::string::npos && at == cyclic_data.rfind(c300));
+        cyclic_data.replace(at, 4, record(0, 2));
+        ASSERT(fails(cyclic_data));
+    }
+    // every single corrupted byte is either caught or gives a working sheet
+    for (size_t i = 0; i < data.size(); ++i) {
+        std::string corrupted = data;
+        corrupted[i] ^= 0x5a;
+        std::ofstream(path, std::ios::binary) << corrupted;
+        try {
+            std::unique_ptr<Sheet> sheet = Snapshot::Load(path);
+            std::ostringstream out;
+            sheet->PrintTexts(out);
+        } catch (const SnapshotError&) {
+        }
+    }
+    std::remove(path.c_str());
+    try {
+        Snapshot::Load(path);
+        ASSERT(false);
+    } catch (const SnapshotError&) {
+    }
+}
+
+void TestImportDelimited() {
+    auto import = [](const std::string& data, ImportOptions options) {
+        Sheet sheet;
+        std::istringstream input(data);
+        ImportStats stats = ImportDelimited(sheet, input, options);
+        ASSERT_EQUAL(stats.bytes, data.size());
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    auto texts = [](const std::vector<std::pair<Position, std::string>>& edits) {
+        Sheet sheet;
+        sheet.SetCells(edits);
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    ImportOptions tsv;
+    std::string tsv_data = "1\ttext\t=A1*2\r\n\t\t'=x\n\n=SUM(A1:C1)\t3.5";
+    std::string expected = texts({{"A1"_pos, "1"}, {"B1"_pos, "text"}, {"C1"_pos, "=A1*2"}, {"C2"_pos, "'=x"},
+                                  {"A4"_pos, "=SUM(A1:C1)"}, {"B4"_pos, "3.5"}});
+    ASSERT_EQUAL(import(tsv_data, tsv), expected);
+    // rows cut by small chunks and spread over threads give the same sheet
+    for (size_t chunk_size : {1, 3, 7, 64}) {
+        for (size_t threads : {1, 3}) {
+            tsv.chunk_size = chunk_size;
+            tsv.thread_count = threads;
+            ASSERT_EQUAL(import(tsv_data, tsv), expected);
+        }
+    }
+
+    ImportOptions csv;
+    csv.delimiter = ',';
+    csv.quoted = true;
+    csv.origin = "B2"_pos;
+    std::string csv_data = "\"a,b\",\"say \"\"hi\"\"\",\"two\nlines\"\n=B2+1,,\"\"\n\"=C3\"";
+    expected = texts({{"B2"_pos, "a,b"}, {"C2"_pos, "say \"hi\""}, {"D2"_pos, "two\nlines"},
+                      {"B3"_pos, "=B2+1"}, {"B4"_pos, "=C3"}});
+    for (size_t chunk_size : {2, 5, 1024}) {
+        csv.chunk_size = chunk_size;
+        ASSERT_EQUAL(import(csv_data, csv), expected);
+    }
+
+    // many rows, so that every thread gets some
+    std::ostringstream big;
+    for (int row = 0; row < 3000; ++row) {
+        big << row << '\t' << "=A" << row + 1 << "*2\t=B" << row + 1 << "+1\n";
+    }
+    tsv.chunk_size = 4096;
+    tsv.thread_count = 1;
+    std::string one_thread = import(big.str(), tsv);
+    tsv.thread_count = 4;
+    ASSERT_EQUAL(import(big.str(), tsv), one_thread);
+
+    Sheet sheet;
+    std::istringstream bad_formula("1\t=1+\n");
+    try {
+        ImportDelimited(sheet, bad_formula, tsv);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    std::istringstream too_wide(std::string(Position::MAX_COLS, '\t') + "1");
+    try {
+        ImportDelimited(sheet, too_wide, tsv);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestExportDelimited() {
+    // the cell by cell iostream printing the exporter replaces
+    auto reference = [](const Sheet& sheet, Range area, bool texts, std::streamsize precision) {
+        std::ostringstream out;
+        out.precision(precision);
+        for (int row = area.first.row; row <= area.last.row; ++row) {
+            for (int col = area.first.col; col <= area.last.col; ++col) {
+                if (col > area.first.col) {
+                    out << '\t';
+                }
+                const CellInterface* cell = sheet.GetCell({row, col});
+                // an empty cell prints as an empty field, as a missing one
+                if (!cell || cell->GetText().empty()) {
+                    continue;
+                }
+                if (texts) {
+                    out << cell->GetText();
+                }
+                else {
+                    std::visit([&out](const auto& x) { out << x; }, cell->GetValue());
+                }
+            }
+            out << '\n';
+        }
+        return out.str();
+    };
+    auto fill = [](Sheet& sheet) {
+        sheet.SetCells({{"A1"_pos, "=1/3"}, {"B1"_pos, "=1e20*7"}, {"C1"_pos, "=123456789"},
+                        {"D1"_pos, "=-0.00001234"}, {"A2"_pos, "=1/0"}, {"B2"_pos, "'=x"},
+                        {"C2"_pos, "=D4+1"}, {"D2"_pos, "text"}, {"A3"_pos, "=SUM(A1:D1)"},
+                        {"C3"_pos, "0.1"}, {"B4"_pos, "=B2"}, {"A5"_pos, "=   (1+2)*A3"}});
+    };
+    auto doExport = [](const Sheet& sheet, ExportOptions options, std::streamsize precision = 6) {
+        std::ostringstream out;
+        out.precision(precision);
+        ExportDelimited(sheet, out, options);
+        return out.str();
+    };
+
+    Sheet sheet;
+    fill(sheet);
+    Range all{"A1"_pos, "D5"_pos};
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+    for (bool texts : {false, true}) {
+        ExportOptions options;
+        options.texts = texts;
+        options.thread_count = 1;
+        ASSERT_EQUAL(doExport(sheet, options), reference(sheet, all, texts, 6));
+        ASSERT_EQUAL(doExport(sheet, options, 15), reference(sheet, all, texts, 15));
+        // a sub-rectangle, also one that goes beyond the printable area
+        for (Range area : {Range{"B2"_pos, "C4"_pos}, Range{"C5"_pos, "F7"_pos}}) {
+            options.area = area;
+            ASSERT_EQUAL(doExport(sheet, options), reference(sheet, area, texts, 6));
+        }
+    }
+
+    // rows spread over threads are written in order; the values of a fresh
+    // sheet are evaluated before the workers read them
+    std::string expected_values = reference(sheet, all, false, 6);
+    std::string expected_texts = reference(sheet, all, true, 6);
+    for (size_t rows_per_task : {1, 2, 100}) {
+        Sheet fresh;
+        fill(fresh);
+        ExportOptions options;
+        options.thread_count = 3;
+        options.rows_per_task = rows_per_task;
+        ASSERT_EQUAL(doExport(fresh, options), expected_values);
+        options.texts = true;
+        ASSERT_EQUAL(doExport(fresh, options), expected_texts);
+    }
+
+    ExportOptions options;
+    options.area = Range{"B2"_pos, "A1"_pos};
+    try {
+        doExport(sheet, options);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(doExport(Sheet(), {}), "");
+}
+
+void TestPrintEmptyCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.SetCell("C1"_pos, "x");
+    // A2 exists only as a placeholder for the reference
+    sheet.SetCell("C3"_pos, "=A2");
+    // A1 stays as a placeholder, B1 depends on it
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) && sheet.GetCell("A2"_pos));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+
+    const std::string values = "\t0\tx\n\t\t\n\t\t0\n";
+    const std::string texts = "\t=A1\tx\n\t\t\n\t\t=A2\n";
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    ASSERT_EQUAL(out.str(), values);
+    out.str({});
+    sheet.PrintTexts(out);
+    ASSERT_EQUAL(out.str(), texts);
+    for (bool as_texts : {false, true}) {
+        ExportOptions options;
+        options.texts = as_texts;
+        options.thread_count = 2;
+        options.rows_per_task = 1;
+        out.str({});
+        ExportDelimited(sheet, out, options);
+        ASSERT_EQUAL(out.str(), as_texts ? texts : values);
+    }
+}
+
+void TestDependencyEdgesAreReplaced() {
+    Sheet sheet;
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A1");
+    ASSERT_EQUAL(graph.GetEdgeCount(), 3u);
+    ASSERT_EQUAL(graph.GetDependants("A1"_pos), (std::vector{"B1"_pos, "B2"_pos}));
+
+    // overwriting drops the edges that are gone and keeps the common ones
+    sheet.SetCell("B1"_pos, "=A2*C1");
+    ASSERT_EQUAL(graph.GetEdgeCount(), 3u);
+    ASSERT_EQUAL(graph.GetDependants("A1"_pos), std::vector{"B2"_pos});
+    ASSERT_EQUAL(graph.GetDependants("C1"_pos), std::vector{"B1"_pos});
+
+    sheet.SetCell("B2"_pos, "text");
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 0u);
+    ASSERT_EQUAL(graph.GetReferencedCellCount(), 0u);
+    ASSERT(!graph.HasDependants("A2"_pos));
+}
+
+void TestFormulaTemplates() {
+    FormulaTemplates templates;
+    // copies of a formula along a column and along a row share one tree
+    auto first = templates.Parse("A2*B2+SUM(C1:D3)", "E2"_pos);
+    auto down = templates.Parse("A5*B5+SUM(C4:D6)", "E5"_pos);
+    auto right = templates.Parse("B2*C2+SUM(D1:E3)", "F2"_pos);
+    ASSERT_EQUAL(templates.GetKeyCount(), 1u);
+    ASSERT(&first->GetAST() == &down->GetAST());
+    ASSERT(&first->GetAST() == &right->GetAST());
+    ASSERT_EQUAL(down->GetASTShift(), (Position{3, 0}));
+    ASSERT_EQUAL(down->GetExpression(), "A5*B5+SUM(C4:D6)");
+    ASSERT_EQUAL(right->GetExpression(), "B2*C2+SUM(D1:E3)");
+    ASSERT_EQUAL(down->GetReferencedCells(), (std::vector{"A5"_pos, "B5"_pos}));
+    ASSERT_EQUAL(right->GetReferencedRanges(), (std::vector{Range{"D1"_pos, "E3"_pos}}));
+
+    // other relative references or another text make another key
+    auto other = templates.Parse("A2*B3+SUM(C1:D3)", "E2"_pos);
+    auto spaced = templates.Parse("A5 * B5+SUM(C4:D6)", "E5"_pos);
+    ASSERT_EQUAL(templates.GetKeyCount(), 3u);
+    ASSERT(&other->GetAST() != &first->GetAST());
+    ASSERT(&spaced->GetAST() != &first->GetAST());
+    ASSERT_EQUAL(spaced->GetExpression(), down->GetExpression());
+
+    // the rest behaves as ParseFormula does
+    for (std::string expression : {"A1+", "1+(2", "A1B1", "SUM(A1", "ZZZZ1+1", "A16385*2", "1/0"}) {
+        std::string expected;
+        try {
+            expected = ParseFormula(expression)->GetExpression();
+        } catch (const FormulaException&) {
+            expected = "throws";
+        }
+        std::string actual;
+        try {
+            actual = templates.Parse(expression, "B2"_pos)->GetExpression();
+        } catch (const FormulaException&) {
+            actual = "throws";
+        }
+        ASSERT_EQUAL(actual, expected);
+    }
+
+    // a tree lives while a formula holds it
+    {
+        FormulaTemplates local;
+        auto formula = local.Parse("A1+1", "B1"_pos);
+        auto copy = local.Parse("A2+1", "B2"_pos);
+        formula.reset();
+        ASSERT_EQUAL(copy->GetExpression(), "A2+1");
+        copy.reset();
+        auto again = local.Parse("A3+1", "B3"_pos);
+        ASSERT_EQUAL(again->GetASTShift(), (Position{0, 0}));
+        ASSERT_EQUAL(local.GetKeyCount(), 1u);
+    }
+
+    // the copy-filled columns of a sheet keep one tree each, also after a snapshot
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + r + "*2");
+        sheet.SetCell({row, 2}, "=SUM(A" + r + ":B" + r + ")");
+    }
+    ASSERT_EQUAL(sheet.GetFormulaTemplates().GetKeyCount(), 2u);
+    std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_templates.snapshot").string();
+    Snapshot::Save(sheet, path);
+    std::unique_ptr<Sheet> loaded = Snapshot::Load(path);
+    std::remove(path.c_str());
+    for (const Sheet* target : {&sheet, loaded.get()}) {
+        const FormulaAST& ast = target->GetConcreteCell("C1"_pos)->GetFormula()->GetAST();
+        for (int row = 0; row < 100; ++row) {
+            const FormulaInterface* formula = target->GetConcreteCell({row, 2})->GetFormula();
+            ASSERT(&formula->GetAST() == &ast);
+            std::string r = std::to_string(row + 1);
+            ASSERT_EQUAL(target->GetCell({row, 2})->GetText(), "=SUM(A" + r + ":B" + r + ")");
+            ASSERT_EQUAL(target->GetCell({row, 2})->GetValue(), CellInterface::Value(3.0 * row));
+        }
+    }
+
+    // a copy set after the load takes the loaded tree
+    size_t loaded_keys = loaded->GetFormulaTemplates().GetKeyCount();
+    ASSERT_EQUAL(loaded_keys, 2u);
+    loaded->SetCell("C101"_pos, "=SUM(A101:B101)");
+    loaded->SetCell("B101"_pos, "=A101*2");
+    ASSERT(&loaded->GetConcreteCell("C101"_pos)->GetFormula()->GetAST() ==
+           &loaded->GetConcreteCell("C1"_pos)->GetFormula()->GetAST());
+    ASSERT(&loaded->GetConcreteCell("B101"_pos)->GetFormula()->GetAST() ==
+           &loaded->GetConcreteCell("B1"_pos)->GetFormula()->GetAST());
+    ASSERT_EQUAL(loaded->GetFormulaTemplates().GetKeyCount(), loaded_keys);
+
+    // an edit of one copy doesn't touch the others
+    sheet.SetCell("A50"_pos, "1000");
+    ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetValue(), CellInterface::Value(2000.0));
+    ASSERT_EQUAL(sheet.GetCell("B51"_pos)->GetValue(), CellInterface::Value(100.0));
+}
+
+void TestConcurrentReaders() {
+    {
+        // reentrant on both sides, and the writer reads under its own write
+        ReadWriteLock lock;
+        ASSERT_EQUAL(lock.GetVersion(), 0u);
+        lock.lock_shared();
+        lock.lock_shared();
+        lock.unlock_shared();
+        lock.unlock_shared();
+        lock.lock();
+        ASSERT_EQUAL(lock.GetVersion(), 1u);
+        lock.lock_shared();
+        lock.lock();
+        lock.unlock();
+        lock.unlock_shared();
+        lock.unlock();
+        ASSERT_EQUAL(lock.GetVersion(), 2u);
+        // a reader may become the writer once it is the only one
+        lock.lock_shared();
+        lock.lock();
+        lock.unlock();
+        lock.unlock_shared();
+        ASSERT_EQUAL(lock.GetVersion(), 4u);
+    }
+
+    // Every write sets the whole column A to one number k, so a reader that
+    // sees a half-done write or a value left from an older one breaks B = 2A+1
+    // or the sum
+    const int rows = 200;
+    const int writes = 100;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> column;
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, "0");
+        sheet.SetCell({row, 1}, "=A" + r + "*2+1");
+        column.emplace_back(Position{row, 0}, "");
+    }
+    sheet.SetCell("C1"_pos, "=SUM(B1:B" + std::to_string(rows) + ")");
+
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+    auto reader = [&](int seed) {
+        std::mt19937 gen(seed);
+        std::uniform_int_distribution<int> row_dist(0, rows - 1);
+        while (!done.load()) {
+            {
+                std::shared_lock lock(sheet.GetLock());
+                double k = std::get<double>(sheet.GetConcreteCell("A1"_pos)->GetNumericValue());
+                int row = row_dist(gen);
+                if (std::get<double>(sheet.GetCell({row, 1})->GetValue()) != 2 * k + 1 ||
+                    std::get<double>(sheet.GetCell("C1"_pos)->GetValue()) != rows * (2 * k + 1)) {
+                    ++failures;
+                }
+            }
+            // a single call sees one state of the sheet as well
+            double b = std::get<double>(sheet.GetCell({row_dist(gen), 1})->GetValue());
+            if (b < 1 || b > 2 * writes + 1 || static_cast<int>(b) % 2 != 1) {
+                ++failures;
+            }
+        }
+    };
+    auto exporter = [&] {
+        while (!done.load()) {
+            std::ostringstream out;
+            ExportOptions options;
+            options.area = Range{"B1"_pos, {rows - 1, 1}};
+            options.thread_count = 2;
+            options.rows_per_task = 16;
+            ExportDelimited(sheet, out, options);
+            std::string text = out.str();
+            std::string first_line = text.substr(0, text.find('\n') + 1);
+            std::string expected;
+            for (int row = 0; row < rows; ++row) {
+                expected += first_line;
+            }
+            if (text != expected) {
+                ++failures;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.emplace_back(reader, 1);
+    threads.emplace_back(reader, 2);
+    threads.emplace_back(exporter);
+    for (int k = 1; k <= writes; ++k) {
+        for (auto& [pos, text] : column) {
+            text = std::to_string(k);
+        }
+        sheet.SetCells(column);
+        if (k % 10 == 0) {
+            sheet.RecalculateAll(2);
+        }
+        std::this_thread::yield();
+    }
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(rows * (2.0 * writes + 1)));
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    if (!SheetStats::ENABLED) {
+        sheet.SetCell("A1"_pos, "=B1");
+        ASSERT_EQUAL(sheet.GetStats().Get(SheetCounter::Edits), 0u);
+        return;
+    }
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    // D5 becomes a placeholder; each cycle check reaches the new references
+    // and the edited cell, then stops as the edited cell has no dependants
+    sheet.SetCell("C1"_pos, "=B1+D5");
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.Get(SheetCounter::Edits), 3u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::FormulaParses), 2u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::PlaceholderCells), 1u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::CycleCheckNodes), 2u + 3u);
+    ASSERT_EQUAL(stats.Get(SheetTimer::Edit).GetCount(), 3u);
+    ASSERT_EQUAL(stats.Get(SheetTimer::Parse).GetCount(), 2u);
+
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.Get(SheetCounter::CacheMisses), 2u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::CacheHits), 1u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::Evaluations), 2u);
+
+    // the difference tells what one edit did
+    SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "2");
+    SheetStats edit = sheet.GetStats() - before;
+    ASSERT_EQUAL(edit.Get(SheetCounter::Edits), 1u);
+    ASSERT_EQUAL(edit.Get(SheetCounter::InvalidatedCells), 2u);
+    ASSERT_EQUAL(edit.Get(SheetCounter::FormulaParses), 0u);
+    ASSERT_EQUAL(edit.Get(SheetTimer::Edit).GetCount(), 1u);
+    // nothing is cached any more, so the next edit drops nothing
+    before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL((sheet.GetStats() - before).Get(SheetCounter::InvalidatedCells), 0u);
+
+    sheet.SetCells({{"E1"_pos, "=A1"}, {"E2"_pos, "=E1+F9"}});
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.Get(SheetCounter::Edits), 7u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::FormulaParses), 4u);
+    ASSERT_EQUAL(stats.Get(SheetCounter::PlaceholderCells), 2u);
+    ASSERT_EQUAL(stats.Get(SheetTimer::Edit).GetCount(), 6u);
+
+    // the workers of RecalculateAll count into the same sheet
+    before = sheet.GetStats();
+    sheet.RecalculateAll(2);
+    ASSERT_EQUAL((sheet.GetStats() - before).Get(SheetCounter::Evaluations), 4u);
+
+    std::ostringstream dump;
+    sheet.GetStats().Print(dump);
+    ASSERT(dump.str().find("edits 7\n") != std::string::npos);
+    ASSERT(dump.str().find("evaluation_us count ") != std::string::npos);
+
+    // one evaluation in SAMPLE_PERIOD is timed
+    before = sheet.GetStats();
+    for (int i = 0; i < 64; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        sheet.GetCell("C1"_pos)->GetValue();
+    }
+    SheetStats reads = sheet.GetStats() - before;
+    ASSERT_EQUAL(reads.Get(SheetCounter::Evaluations), 128u);
+    ASSERT_EQUAL(reads.Get(SheetTimer::Evaluation).GetCount(), 128u / StatsRecorder::SAMPLE_PERIOD);
+    ASSERT(reads.Get(SheetTimer::Evaluation).GetPercentileNs(50) > 0);
+
+    sheet.ResetStats();
+    stats = sheet.GetStats();
+    for (uint64_t counter : stats.counters) {
+        ASSERT_EQUAL(counter, 0u);
+    }
+    ASSERT_EQUAL(stats.Get(SheetTimer::Edit).GetCount(), 0u);
+}
+
+void TestValueView() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "some text longer than a small string");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "2.5");
+    sheet.SetCell("B1"_pos, "=A3*2");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("B3"_pos, "=C9");
+    for (Position pos : {"A1"_pos, "A2"_pos, "A3"_pos, "B1"_pos, "B2"_pos, "B3"_pos, "C9"_pos}) {
+        const CellInterface* cell = sheet.GetCell(pos);
+        CellInterface::Value value = cell->GetValue();
+        CellInterface::ValueView view = cell->GetValueView();
+        ASSERT_EQUAL(view.index(), value.index());
+        if (const std::string* text = std::get_if<std::string>(&value)) {
+            ASSERT_EQUAL(std::get<std::string_view>(view), *text);
+        }
+        else if (const double* number = std::get_if<double>(&value)) {
+            ASSERT_EQUAL(std::get<double>(view), *number);
+        }
+        else {
+            ASSERT_EQUAL(std::get<FormulaError>(view), std::get<FormulaError>(value));
+        }
+    }
+    // the text points into the cell, past the escape sign
+    std::string_view text = std::get<std::string_view>(sheet.GetCell("A2"_pos)->GetValueView());
+    ASSERT_EQUAL(text, "=escaped");
+    ASSERT(text.data() == sheet.GetConcreteCell("A2"_pos)->GetTextView().data() + 1);
+}
+
+void TestPackedValue() {
+    const double inf = std::numeric_limits<double>::infinity();
+    for (double number : {0.0, -0.0, 1.5, -1e300, 5e-324, inf, -inf}) {
+        PackedValue value(number);
+        ASSERT(value.HasValue() && value.IsNumber());
+        ASSERT_EQUAL(std::signbit(value.GetNumber()), std::signbit(number));
+        ASSERT_EQUAL(value.GetNumber(), number);
+    }
+    // every NaN stays a number, also one whose bits look like a tag
+    uint64_t tag_bits = 0x7ff4'0000'0000'0001;
+    double tag_like;
+    std::memcpy(&tag_like, &tag_bits, sizeof(tag_like));
+    for (double nan : {std::numeric_limits<double>::quiet_NaN(), tag_like, std::nan("1")}) {
+        PackedValue value{CellInterface::NumericValue(nan)};
+        ASSERT(value.IsNumber());
+        ASSERT(std::isnan(value.GetNumber()));
+    }
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value,
+                          FormulaError::Category::Arithmetic}) {
+        PackedValue value{CellInterface::NumericValue(FormulaError(category))};
+        ASSERT(value.HasValue() && !value.IsNumber());
+        ASSERT_EQUAL(value.GetError(), FormulaError(category));
+        ASSERT(value.Get() == CellInterface::NumericValue(FormulaError(category)));
+    }
+    ASSERT(!PackedValue().HasValue());
+    ASSERT(PackedValue(0.0) != PackedValue());
+    static_assert(sizeof(PackedValue) == 8);
+    static_assert(std::atomic<PackedValue>::is_always_lock_free);
+}
+
+void TestCellStorage() {
+    Sheet sheet;
+    {
+        CellStorage storage(sheet);
+        auto fill = [&](int count, int step) {
+            for (int i = 0; i < count; i += step) {
+                Position pos{i / 40, i % 40};
+                Cell& cell = i % 2 ? storage.Emplace(pos) : storage.Emplace(pos, Cell::Parse(std::to_string(i), pos, sheet));
+                ASSERT_EQUAL(&CellStorage::GetSheet(cell), &sheet);
+            }
+        };
+        auto erase = [&](int count, int step) {
+            for (int i = 0; i < count; i += step) {
+                storage.Erase({i / 40, i % 40});
+            }
+        };
+        fill(1000, 1);
+        ASSERT_EQUAL(storage.GetCellCount(), 1000u);
+        ASSERT_EQUAL(storage.Get({24, 8})->GetText(), "968");
+        ASSERT(storage.Get({24, 9})->IsEmpty());
+        ASSERT(!storage.Get({25, 0}));
+        size_t slab_bytes = storage.GetSlabBytes();
+        ASSERT(slab_bytes >= 1000 * sizeof(Cell));
+
+        // erased cells leave their slots to the next ones
+        erase(1000, 2);
+        ASSERT_EQUAL(storage.GetCellCount(), 500u);
+        ASSERT_EQUAL(storage.GetSlabBytes(), slab_bytes);
+        fill(1000, 2);
+        ASSERT_EQUAL(storage.GetSlabBytes(), slab_bytes);
+
+        // the slabs left empty are freed, but for a spare one
+        erase(1000, 1);
+        storage.Erase({0, 0});
+        ASSERT_EQUAL(storage.GetCellCount(), 0u);
+        ASSERT_EQUAL(storage.GetChunkCount(), 0u);
+        size_t spare_bytes = storage.GetSlabBytes();
+        ASSERT(spare_bytes > 0 && spare_bytes < slab_bytes);
+        fill(1000, 1);
+        ASSERT_EQUAL(storage.GetSlabBytes(), slab_bytes);
+
+        // memory doesn't stay at its peak once the cells are gone
+        erase(1000, 1);
+        for (int i = 0; i < 100000; ++i) {
+            Position pos{i / 40, i % 40};
+            storage.Emplace(pos, Cell::Parse(std::to_string(i), pos, sheet));
+        }
+        ASSERT(storage.GetSlabBytes() >= 100000 * sizeof(Cell));
+        erase(100000, 1);
+        ASSERT_EQUAL(storage.GetSlabBytes(), spare_bytes);
+    }
+
+    // a new cell that doesn't take its text is not left behind
+    bool caught = false;
+    try {
+        sheet.SetCell("B2"_pos, "=B2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    caught = false;
+    try {
+        sheet.SetCell("B3"_pos, "=1+");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(!sheet.GetCell("B2"_pos) && !sheet.GetCell("B3"_pos));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestTextPool() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "north");
+    sheet.SetCell("B7"_pos, "north");
+    sheet.SetCell("C1"_pos, "'north");
+    sheet.SetCell("D1"_pos, "12");
+    sheet.SetCell("D2"_pos, "'12");
+    TextPool& pool = sheet.GetTextPool();
+    // texts that read as numbers stay with their cells
+    ASSERT_EQUAL(pool.GetTextCount(), 2u);
+    ASSERT(sheet.GetConcreteCell("A1"_pos)->GetTextView().data() ==
+           sheet.GetConcreteCell("B7"_pos)->GetTextView().data());
+    ASSERT(std::get<FormulaError>(sheet.GetCell("A1"_pos)->GetNumericValue()) ==
+           FormulaError(FormulaError::Category::Value));
+    ASSERT(std::get<double>(sheet.GetCell("D2"_pos)->GetNumericValue()) == 12.0);
+    ASSERT(std::get<std::string>(sheet.GetCell("C1"_pos)->GetValue()) == "north");
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(pool.GetTextCount(), 2u);
+    sheet.SetCell("B7"_pos, "south");
+    ASSERT_EQUAL(pool.GetTextCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), "south");
+
+    // the same text again keeps the values computed from it
+    sheet.SetCell("E1"_pos, "=D1*2");
+    sheet.SetCell("E2"_pos, "=B7");
+    ASSERT(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()) == 24.0);
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("E2"_pos)->GetValue()));
+    sheet.ResetStats();
+    sheet.SetCell("D1"_pos, "12");
+    sheet.SetCell("B7"_pos, "south");
+    if (SheetStats::ENABLED) {
+        ASSERT_EQUAL(sheet.GetStats().Get(SheetCounter::InvalidatedCells), 0u);
+    }
+    sheet.SetCell("D1"_pos, "13");
+    ASSERT(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()) == 26.0);
+
+    // a snapshot stores a pooled text once
+    const std::string label(200, 'x');
+    Sheet labels;
+    for (int row = 0; row < 100; ++row) {
+        labels.SetCell({row, 0}, label);
+    }
+    std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_text_pool.snapshot").string();
+    Snapshot::Save(labels, path);
+    ASSERT(std::filesystem::file_size(path) < 100 * label.size());
+    std::unique_ptr<Sheet> loaded = Snapshot::Load(path);
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(loaded->GetTextPool().GetTextCount(), 1u);
+    ASSERT_EQUAL(loaded->GetCell({99, 0})->GetText(), label);
+}
+
 void TestFormulaIncorrect() {
     auto isIncorrect = [](std::string expression) {
         try {
@@ -347,6 +1882,85 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestCellDiamondIsNotCircular() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("B2"_pos, "=A1*2");
+    sheet->SetCell("C1"_pos, "=B1+B2+A1");
+    sheet->SetCell("D1"_pos, "=C1+B1");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    bool caught = false;
+    try {
+        sheet->SetCell("A1"_pos, "=D1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
+
+    // a cell that read A1 before doesn't make a cycle any more
+    sheet->SetCell("E1"_pos, "=A1");
+    sheet->SetCell("E1"_pos, "2");
+    sheet->SetCell("A1"_pos, "=E1");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+}
+
+void TestDeepChainCircularReferences() {
+    const int length = 100'000;
+    auto at = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    // each cell reads the next one, set from the top and from the bottom
+    for (bool from_top : {true, false}) {
+        auto sheet = CreateSheet();
+        for (int k = 0; k + 1 < length; ++k) {
+            int i = from_top ? k : length - 2 - k;
+            sheet->SetCell(at(i), "=" + at(i + 1).ToString() + "+1");
+        }
+        sheet->SetCell(at(length - 1), "1");
+
+        bool caught = false;
+        try {
+            sheet->SetCell(at(length - 1), "=" + at(0).ToString());
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell(at(length - 1))->GetText(), "1");
+
+        // a cold read evaluates the whole chain without nesting as deep
+        ASSERT_EQUAL(sheet->GetCell(at(0))->GetValue(), CellInterface::Value(static_cast<double>(length)));
+        sheet->SetCell(at(length - 1), "2");
+        ASSERT_EQUAL(sheet->GetCell(at(0))->GetValue(), CellInterface::Value(length + 1.0));
+    }
+}
+
+void TestChainFillCycleChecks() {
+    if (!SheetStats::ENABLED) {
+        return;
+    }
+    // filling a column in the natural order checks a few cells per edit
+    const int length = 16'000;
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    for (int row = 1; row < length; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    ASSERT(sheet.GetStats().Get(SheetCounter::CycleCheckNodes) <= 4u * length);
+    ASSERT_EQUAL(sheet.GetCell({length - 1, 0})->GetValue(), CellInterface::Value(static_cast<double>(length)));
+
+    // and so does the bottom-up order, where each cell has the chain below
+    Sheet reversed;
+    for (int row = length - 1; row > 0; --row) {
+        reversed.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    reversed.SetCell({0, 0}, "1");
+    ASSERT(reversed.GetStats().Get(SheetCounter::CycleCheckNodes) <= 4u * length);
+    ASSERT_EQUAL(reversed.GetCell({length - 1, 0})->GetValue(), CellInterface::Value(static_cast<double>(length)));
+}
 }  // namespace
 
 int main() {
@@ -354,20 +1968,54 @@ int main() {
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionCodecs);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestClearReferencedCell);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaParserEdgeCases);
+    RUN_TEST(tr, TestFormulaParserFuzz);
+    RUN_TEST(tr, TestFormulaArena);
+    RUN_TEST(tr, TestFormulaBytecode);
+    RUN_TEST(tr, TestFormulaOptimization);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+#endif
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestNumericValueOfText);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintableSizeShrink);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestTransitiveInvalidation);
+    RUN_TEST(tr, TestDependencyEdgesAreReplaced);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestThreadPool);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestImportDelimited);
+    RUN_TEST(tr, TestExportDelimited);
+    RUN_TEST(tr, TestPrintEmptyCells);
+    RUN_TEST(tr, TestFormulaTemplates);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestPackedValue);
+    RUN_TEST(tr, TestCellStorage);
+    RUN_TEST(tr, TestTextPool);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCellDiamondIsNotCircular);
+    RUN_TEST(tr, TestDeepChainCircularReferences);
+    RUN_TEST(tr, TestChainFillCycleChecks);
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <variant>
+
+// A number or a FormulaError in one word. A number is stored as its bits,
+// and signaling NaNs with payloads no arithmetic yields stand for the errors
+// and for no value at all. Trivially copyable, so std::atomic<PackedValue>
+// is a plain atomic word.
+class PackedValue {
+public:
+    // no value
+    PackedValue() = default;
+
+    explicit PackedValue(const CellInterface::NumericValue& value) {
+        if (const double* number = std::get_if<double>(&value)) {
+            *this = PackedValue(*number);
+        }
+        else {
+            bits_ = TAG + 1 + static_cast<uint64_t>(std::get<FormulaError>(value).GetCategory());
+        }
+    }
+
+    explicit PackedValue(double number) {
+        std::memcpy(&bits_, &number, sizeof(bits_));
+        if (IsTagged()) {
+            // a NaN read from a text like "nan(...)" may look like a tag
+            double nan = std::numeric_limits<double>::quiet_NaN();
+            std::memcpy(&bits_, &nan, sizeof(bits_));
+        }
+    }
+
+    bool HasValue() const {
+        return bits_ != TAG;
+    }
+    bool IsNumber() const {
+        return !IsTagged();
+    }
+
+    // These three need a value
+    double GetNumber() const {
+        double number;
+        std::memcpy(&number, &bits_, sizeof(number));
+        return number;
+    }
+    FormulaError GetError() const {
+        return FormulaError(static_cast<FormulaError::Category>(bits_ - TAG - 1));
+    }
+    CellInterface::NumericValue Get() const {
+        if (IsNumber()) {
+            return GetNumber();
+        }
+        return GetError();
+    }
+
+    bool operator==(PackedValue other) const {
+        return bits_ == other.bits_;
+    }
+    bool operator!=(PackedValue other) const {
+        return bits_ != other.bits_;
+    }
+
+private:
+    static const uint64_t TAG = 0x7ff4'0000'0000'0000;
+    static const uint64_t TAG_MASK = 0xffff'ffff'ffff'0000;
+
+    uint64_t bits_ = TAG;
+
+    bool IsTagged() const {
+        return (bits_ & TAG_MASK) == TAG;
+    }
+};
@@ -0,0 +1,51 @@
+#include "printable_area.h"
+
+#include <algorithm>
+#include <cassert>
+
+PrintableArea::AxisCounter::AxisCounter(int size)
+    : counts_(size),
+      block_counts_((size + BLOCK_SIZE - 1) / BLOCK_SIZE) {}
+
+void PrintableArea::AxisCounter::Add(int index) {
+    ++counts_[index];
+    ++block_counts_[index / BLOCK_SIZE];
+    end_ = std::max(end_, index + 1);
+}
+
+void PrintableArea::AxisCounter::Remove(int index) {
+    assert(counts_[index] > 0);
+    --counts_[index];
+    --block_counts_[index / BLOCK_SIZE];
+    if (index + 1 != end_ || counts_[index] > 0) {
+        return;
+    }
+    // the last line became empty: skip empty blocks, then empty lines inside
+    // the last non-empty block
+    int block = index / BLOCK_SIZE;
+    while (block >= 0 && block_counts_[block] == 0) {
+        --block;
+    }
+    if (block < 0) {
+        end_ = 0;
+        return;
+    }
+    end_ = std::min(end_, (block + 1) * BLOCK_SIZE);
+    while (counts_[end_ - 1] == 0) {
+        --end_;
+    }
+}
+
+void PrintableArea::Add(Position pos) {
+    rows_.Add(pos.row);
+    cols_.Add(pos.col);
+}
+
+void PrintableArea::Remove(Position pos) {
+    rows_.Remove(pos.row);
+    cols_.Remove(pos.col);
+}
+
+Size PrintableArea::GetSize() const {
+    return {rows_.GetEnd(), cols_.GetEnd()};
+}
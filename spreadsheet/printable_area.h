@@ -0,0 +1,41 @@
+#pragma once
+
+#include "common.h"
+
+#include <vector>
+
+// Bounding box of non-empty cells, maintained incrementally on every edit.
+// Each axis keeps the number of non-empty cells per row (column) and per block
+// of rows (columns), so growing is O(1) and shrinking after the last row or
+// column is cleared scans at most one block of counters plus block totals.
+class PrintableArea {
+public:
+    void Add(Position pos);
+    void Remove(Position pos);
+
+    Size GetSize() const;
+
+private:
+    class AxisCounter {
+    public:
+        explicit AxisCounter(int size);
+
+        void Add(int index);
+        void Remove(int index);
+
+        // One past the last index with a non-zero count
+        int GetEnd() const {
+            return end_;
+        }
+
+    private:
+        static const int BLOCK_SIZE = 128;
+
+        std::vector<int> counts_;
+        std::vector<int> block_counts_;
+        int end_ = 0;
+    };
+
+    AxisCounter rows_{Position::MAX_ROWS};
+    AxisCounter cols_{Position::MAX_COLS};
+};
@@ -0,0 +1,157 @@
+#include "read_write_lock.h"
+
+#include <cassert>
+#include <vector>
+
+namespace {
+static_assert(ReadWriteLock::SLOT_COUNT == 64, "used_slots_ has a bit per slot");
+
+// A read lock held by this thread
+struct Hold {
+    const ReadWriteLock* lock;
+    size_t depth;
+    size_t slot;
+    // false when the lock is joined or taken inside the own write
+    bool counted;
+};
+
+// Formulas read every referenced cell under the lock, so the reentrant case
+// is the hot one. The first hold is a plain thread_local, which needs no
+// guard on access; the holds of other locks, rarely any, go to the vector.
+thread_local Hold t_hold{nullptr, 0, 0, false};
+thread_local std::vector<Hold> t_more_holds;
+
+Hold* FindHold(const ReadWriteLock* lock) {
+    if (t_hold.lock == lock) {
+        return &t_hold;
+    }
+    if (t_hold.lock == nullptr) {
+        // the vector is used only while the first hold is taken
+        return nullptr;
+    }
+    for (Hold& hold : t_more_holds) {
+        if (hold.lock == lock) {
+            return &hold;
+        }
+    }
+    return nullptr;
+}
+
+void AddHold(const Hold& hold) {
+    if (t_hold.lock == nullptr) {
+        t_hold = hold;
+    }
+    else {
+        t_more_holds.push_back(hold);
+    }
+}
+
+void RemoveHold(Hold* hold) {
+    if (hold != &t_hold) {
+        t_more_holds.erase(t_more_holds.begin() + (hold - t_more_holds.data()));
+    }
+    else if (t_more_holds.empty()) {
+        t_hold.lock = nullptr;
+    }
+    else {
+        t_hold = t_more_holds.back();
+        t_more_holds.pop_back();
+    }
+}
+
+// Threads take the slots in turn, so a few threads never share one
+size_t GetThreadSlot() {
+    static std::atomic<size_t> next_slot{0};
+    thread_local size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % ReadWriteLock::SLOT_COUNT;
+    return slot;
+}
+}  // namespace
+
+void ReadWriteLock::lock_shared() const {
+    if (Hold* hold = FindHold(this)) {
+        ++hold->depth;
+        return;
+    }
+    // only this thread stores its own id there
+    if (writer_.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+        AddHold({this, 1, 0, false});
+        return;
+    }
+    size_t index = GetThreadSlot();
+    uint64_t bit = uint64_t{1} << index;
+    if (!(used_slots_.load(std::memory_order_relaxed) & bit)) {
+        used_slots_.fetch_or(bit);
+    }
+    // Sequentially consistent: either the writer sees the counter or this
+    // thread sees the odd version the writer has made
+    std::atomic<size_t>& readers = slots_[index].readers;
+    for (;;) {
+        readers.fetch_add(1);
+        if (version_.load() % 2 == 0) {
+            break;
+        }
+        readers.fetch_sub(1);
+        while (version_.load(std::memory_order_relaxed) % 2 != 0) {
+            std::this_thread::yield();
+        }
+    }
+    AddHold({this, 1, index, true});
+}
+
+void ReadWriteLock::unlock_shared() const {
+    Hold* hold = FindHold(this);
+    assert(hold);
+    if (--hold->depth > 0) {
+        return;
+    }
+    if (hold->counted) {
+        slots_[hold->slot].readers.fetch_sub(1);
+    }
+    RemoveHold(hold);
+}
+
+void ReadWriteLock::JoinShared() const {
+    if (Hold* hold = FindHold(this)) {
+        ++hold->depth;
+        return;
+    }
+    AddHold({this, 1, 0, false});
+}
+
+void ReadWriteLock::lock() {
+    std::thread::id self = std::this_thread::get_id();
+    if (writer_.load(std::memory_order_relaxed) == self) {
+        ++write_depth_;
+        return;
+    }
+    writer_mutex_.lock();
+    writer_.store(self, std::memory_order_relaxed);
+    write_depth_ = 1;
+    version_.fetch_add(1);
+
+    // a read lock of this thread stays counted in its slot
+    const Hold* own = FindHold(this);
+    uint64_t used = used_slots_.load();
+    for (size_t i = 0; i < SLOT_COUNT; ++i) {
+        if (!(used & (uint64_t{1} << i))) {
+            continue;
+        }
+        size_t own_readers = own && own->counted && own->slot == i ? 1 : 0;
+        while (slots_[i].readers.load() != own_readers) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ReadWriteLock::unlock() {
+    if (--write_depth_ > 0) {
+        return;
+    }
+    writer_.store(std::thread::id(), std::memory_order_relaxed);
+    version_.fetch_add(1);
+    writer_mutex_.unlock();
+}
+
+uint64_t ReadWriteLock::GetVersion() const {
+    return version_.load();
+}
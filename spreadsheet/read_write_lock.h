@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Reader-writer lock for many reading threads and one writer at a time.
+// Threads are spread over SLOT_COUNT reader counters, each on a cache line of
+// its own, so readers of different threads don't write to a shared line and
+// taking the lock costs an uncontended atomic increment. The writer makes the
+// version odd, which holds new readers back, and waits until the counters of
+// the other threads drop to zero. Readers never see a half-done write, so
+// nothing a write replaces has to outlive it.
+//
+// Both sides are reentrant, and the writer may read under its own write. A
+// thread that holds the read lock must not wait for another writer. The
+// method names are the standard ones, so std::lock_guard and std::shared_lock
+// work with it.
+class ReadWriteLock {
+public:
+    static const size_t SLOT_COUNT = 64;
+
+    ReadWriteLock() = default;
+    ReadWriteLock(const ReadWriteLock&) = delete;
+    ReadWriteLock& operator=(const ReadWriteLock&) = delete;
+
+    void lock_shared() const;
+    void unlock_shared() const;
+    // For the helper threads of a thread that holds the lock and waits for
+    // them, e.g. the workers of a parallel read or write: takes the read lock
+    // without waiting, the holder keeps other writers out meanwhile.
+    // Released with unlock_shared.
+    void JoinShared() const;
+
+    void lock();
+    void unlock();
+
+    // Even while nobody writes, grows by two with every write
+    uint64_t GetVersion() const;
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<size_t> readers{0};
+    };
+
+    mutable std::array<Slot, SLOT_COUNT> slots_;
+    // bit i is set once slot i has had a reader, the writer checks only those
+    mutable std::atomic<uint64_t> used_slots_{0};
+    std::atomic<uint64_t> version_{0};
+    std::mutex writer_mutex_;
+    std::atomic<std::thread::id> writer_{};
+    size_t write_depth_ = 0;
+};
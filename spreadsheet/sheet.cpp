@@ -2,30 +2,25 @@
 
 #include "cell.h"
 #include "common.h"
+#include "delimited_export.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <cassert>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 
 using namespace std::literals;
 
+Sheet::Sheet()
+    : cells_(*this) {}
 Sheet::~Sheet() = default;
 
-std::unique_ptr<Cell> Sheet::CreateCell(Position pos, std::string text) {
-    std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this, pos);
-    new_cell->Set(text);
-    return new_cell;
-}
-
-void Sheet::EmplaceCell(Position pos, std::unique_ptr<Cell>& new_cell) {
-    sheet_.resize(std::max(pos.row + 1, int(sheet_.size())));
-    sheet_[pos.row].resize(std::max(pos.col + 1, int(sheet_[pos.row].size())));
-
-    auto& ptr_to_cell = sheet_[pos.row][pos.col];
-    ptr_to_cell.reset(new_cell.release());
-}
-
 void Sheet::ValidatePosition(Position pos) {
     using namespace std::literals;
     if (!pos.IsValid()) {
@@ -35,90 +30,274 @@ void Sheet::ValidatePosition(Position pos) {
 
 void Sheet::SetCell(Position pos, std::string text) {
     ValidatePosition(pos);
-    std::unique_ptr<Cell> new_cell = CreateCell(pos, text);
-    EmplaceCell(pos, new_cell);
+    StatsRecorder::Timer timer(stats_, SheetTimer::Edit);
+    stats_.Add(SheetCounter::Edits);
+    std::lock_guard lock(lock_);
+    // the existing cell is updated in place to keep its dependants
+    if (Cell* cell = cells_.Get(pos)) {
+        bool was_empty = cell->IsEmpty();
+        cell->Set(pos, text);
+        UpdatePrintableArea(pos, was_empty, cell->IsEmpty());
+        return;
+    }
+    Cell& cell = cells_.Emplace(pos);
+    try {
+        cell.Set(pos, text);
+    } catch (...) {
+        // a text the cell doesn't take leaves no cell behind
+        cells_.Erase(pos);
+        throw;
+    }
+    UpdatePrintableArea(pos, true, cell.IsEmpty());
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> edits) {
+    for (const auto& [pos, text] : edits) {
+        ValidatePosition(pos);
+    }
+    StatsRecorder::Timer timer(stats_, SheetTimer::Edit);
+    stats_.Add(SheetCounter::Edits, edits.size());
+    std::vector<Position> positions;
+    std::vector<Cell::Content> contents;
+    positions.reserve(edits.size());
+    contents.reserve(edits.size());
+    for (auto& [pos, text] : edits) {
+        positions.push_back(pos);
+        contents.push_back(Cell::Parse(text, pos, *this));
+    }
+    std::lock_guard lock(lock_);
+    ApplyContents(positions, std::move(contents));
+}
+
+void Sheet::SetCellContents(std::vector<std::pair<Position, Cell::Content>> edits) {
+    for (const auto& [pos, content] : edits) {
+        ValidatePosition(pos);
+    }
+    StatsRecorder::Timer timer(stats_, SheetTimer::Edit);
+    stats_.Add(SheetCounter::Edits, edits.size());
+    std::vector<Position> positions;
+    std::vector<Cell::Content> contents;
+    positions.reserve(edits.size());
+    contents.reserve(edits.size());
+    for (auto& [pos, content] : edits) {
+        positions.push_back(pos);
+        contents.push_back(std::move(content));
+    }
+    std::lock_guard lock(lock_);
+    ApplyContents(positions, std::move(contents));
+}
 
+void Sheet::ApplyContents(const std::vector<Position>& positions, std::vector<Cell::Content> contents) {
+    // The contents go in first, the old ones are kept to undo the batch if it
+    // has made a cycle. A position edited twice is replaced twice, and the
+    // undo in reverse order brings back what it had before the batch.
+    std::vector<bool> created(positions.size());
+    auto replace = [&](size_t i) {
+        Cell* cell = cells_.Get(positions[i]);
+        bool was_empty = cell->IsEmpty();
+        contents[i] = cell->Replace(positions[i], std::move(contents[i]));
+        UpdatePrintableArea(positions[i], was_empty, cell->IsEmpty());
+    };
+    for (size_t i = 0; i < positions.size(); ++i) {
+        if (!cells_.Get(positions[i])) {
+            cells_.Emplace(positions[i]);
+            created[i] = true;
+        }
+        replace(i);
+    }
+    if (Cell::HasCycleFrom(*this, positions)) {
+        for (size_t i = positions.size(); i-- > 0;) {
+            replace(i);
+            if (created[i]) {
+                cells_.Erase(positions[i]);
+            }
+        }
+        throw CircularDependencyException("Cell formula has circular dependencies"s);
+    }
+
+    for (Position pos : positions) {
+        // cells of ranges are not created, a missing cell reads as empty
+        for (Position ref : cells_.Get(pos)->GetReferencedCells()) {
+            if (!cells_.Get(ref)) {
+                AddPlaceholder(ref);
+            }
+        }
+    }
+    Cell::InvalidateCaches(*this, positions);
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     ValidatePosition(pos);
-    if (pos.row >= int(sheet_.size()) || pos.col >= int(sheet_[pos.row].size())) {
-        return nullptr;
-    }
-    return sheet_[pos.row][pos.col].get();
+    std::shared_lock lock(lock_);
+    return cells_.Get(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
     ValidatePosition(pos);
-    if (pos.row >= int(sheet_.size()) || pos.col >= int(sheet_[pos.row].size())) {
-        return nullptr;
-    }
-    return sheet_[pos.row][pos.col].get();
+    std::shared_lock lock(lock_);
+    return cells_.Get(pos);
 }
 
 const Cell* Sheet::GetConcreteCell(Position pos) const {
-    return dynamic_cast<const Cell*>(GetCell(pos));
+    ValidatePosition(pos);
+    return cells_.Get(pos);
 }
 Cell* Sheet::GetConcreteCell(Position pos) {
-    return dynamic_cast<Cell*>(GetCell(pos));
+    ValidatePosition(pos);
+    return cells_.Get(pos);
+}
+
+void Sheet::AddPlaceholder(Position pos) {
+    // an empty cell reads the same as a missing one, so no cache changes
+    cells_.Emplace(pos);
+    stats_.Add(SheetCounter::PlaceholderCells);
 }
 
 void Sheet::ClearCell(Position pos) {
     ValidatePosition(pos);
-    if (pos.row < int(sheet_.size()) && pos.col < int(sheet_[pos.row].size()) && sheet_[pos.row][pos.col]) {
-        sheet_[pos.row][pos.col]->Clear();
-        sheet_[pos.row][pos.col].reset();
+    StatsRecorder::Timer timer(stats_, SheetTimer::Edit);
+    stats_.Add(SheetCounter::Edits);
+    std::lock_guard lock(lock_);
+    if (Cell* cell = cells_.Get(pos)) {
+        bool was_empty = cell->IsEmpty();
+        cell->Clear(pos);
+        // a cell other cells depend on stays as an empty placeholder
+        if (!dependencies_.HasDependants(pos)) {
+            cells_.Erase(pos);
+        }
+        UpdatePrintableArea(pos, was_empty, true);
     }
 }
 
-Size Sheet::GetPrintableSize() const {
-    Size result;
-    for (int row = 0; row < int(sheet_.size()); ++row) {
-        for (int col = int(sheet_[row].size()) - 1; col >= 0; --col) {
-            if (!sheet_[row][col] || sheet_[row][col]->GetText().empty()) {
-                continue;
-            }
-            result.rows = std::max(result.rows, row + 1);
-            result.cols = std::max(result.cols, col + 1);
-            break;
+std::optional<FormulaError> Sheet::GetNumericValues(Range range, std::vector<double>& values) const {
+    ValidatePosition(range.first);
+    ValidatePosition(range.last);
+    std::shared_lock lock(lock_);
+    std::optional<FormulaError> error;
+    Position error_pos;
+    cells_.ForEachInRange(range, [&](Position pos, const Cell& cell) {
+        if (cell.IsEmpty()) {
+            return;
         }
-    }
-    return result;
+        CellInterface::NumericValue value = cell.GetNumericValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            values.push_back(*number);
+        }
+        // chunks are visited out of row order
+        else if (!error || pos < error_pos) {
+            error = std::get<FormulaError>(value);
+            error_pos = pos;
+        }
+    });
+    return error;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    Size printable_size = GetPrintableSize();
-    for (int row = 0; row < printable_size.rows; ++row) {
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
-            }
-            if (col >= int(sheet_[row].size()) || !sheet_[row][col]) {
-                continue;
+Size Sheet::GetPrintableSize() const {
+    std::shared_lock lock(lock_);
+    return printable_area_.GetSize();
+}
+
+SheetStats Sheet::GetStats() const {
+    return stats_.Collect();
+}
+
+void Sheet::ResetStats() {
+    stats_.Reset();
+}
+
+void Sheet::RecalculateAll(size_t thread_count) {
+    // cells per task: small enough to balance, big enough to pay for the queueing
+    const size_t MAX_GRAIN = 64;
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // it rewrites every cache and the pool, the workers read under this lock
+    std::lock_guard lock(lock_);
+    if (!pool_ || pool_->GetThreadCount() != thread_count) {
+        pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+
+    std::vector<Cell*> formulas;
+    std::vector<Position> positions;
+    std::unordered_map<Position, size_t, PositionHasher> index;
+    index.reserve(cells_.GetCellCount());
+    formulas.reserve(cells_.GetCellCount());
+    positions.reserve(cells_.GetCellCount());
+    cells_.ForEach([&](Position pos, Cell& cell) {
+        if (cell.IsFormula()) {
+            index.emplace(pos, formulas.size());
+            formulas.push_back(&cell);
+            positions.push_back(pos);
+        }
+    });
+
+    // formula -> dependant formula edges in CSR form, and for every formula
+    // the number of formulas it still waits for
+    std::vector<size_t> offsets{0};
+    std::vector<size_t> targets;
+    std::vector<size_t> waiting(formulas.size());
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        formulas[i]->ClearCache();
+        dependencies_.ForEachDependant(positions[i], [&](Position dependant) {
+            auto it = index.find(dependant);
+            if (it != index.end()) {
+                targets.push_back(it->second);
+                ++waiting[it->second];
             }
-            std::visit(
-                [&](const auto& x) {
-                    output << x;
-                },
-                sheet_[row][col]->GetValue());
+        });
+        offsets.push_back(targets.size());
+    }
 
+    std::vector<size_t> level;
+    std::vector<size_t> next_level;
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        if (waiting[i] == 0) {
+            level.push_back(i);
         }
-        output << '\n';
     }
-}
-void Sheet::PrintTexts(std::ostream& output) const {
-    Size printable_size = GetPrintableSize();
-    for (int row = 0; row < printable_size.rows; ++row) {
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
+    size_t evaluated = 0;
+    while (!level.empty()) {
+        size_t grain = std::clamp<size_t>(level.size() / (thread_count * 4), 1, MAX_GRAIN);
+        pool_->ParallelFor(level.size(), grain, [&](size_t begin, size_t end) {
+            lock_.JoinShared();
+            std::shared_lock worker_lock(lock_, std::adopt_lock);
+            for (size_t i = begin; i < end; ++i) {
+                formulas[level[i]]->GetNumericValue();
             }
-            if (col >= int(sheet_[row].size()) || !sheet_[row][col]) {
-                continue;
+        });
+        evaluated += level.size();
+
+        next_level.clear();
+        for (size_t i : level) {
+            for (size_t edge = offsets[i]; edge < offsets[i + 1]; ++edge) {
+                if (--waiting[targets[edge]] == 0) {
+                    next_level.push_back(targets[edge]);
+                }
             }
-            output << sheet_[row][col]->GetText();
         }
-        output << '\n';
+        level.swap(next_level);
+    }
+    assert(evaluated == formulas.size());
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool was_empty, bool is_empty) {
+    if (was_empty && !is_empty) {
+        printable_area_.Add(pos);
     }
+    else if (!was_empty && is_empty) {
+        printable_area_.Remove(pos);
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    ExportOptions options;
+    options.thread_count = 1;
+    ExportDelimited(*this, output, options);
+}
+void Sheet::PrintTexts(std::ostream& output) const {
+    ExportOptions options;
+    options.texts = true;
+    options.thread_count = 1;
+    ExportDelimited(*this, output, options);
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
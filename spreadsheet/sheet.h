@@ -1,34 +1,121 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "printable_area.h"
+#include "read_write_lock.h"
+#include "sheet_stats.h"
+#include "text_pool.h"
 
 #include <functional>
+#include <string>
+#include <utility>
+#include <vector>
 
+class ThreadPool;
+
+// Many threads may read a sheet while one thread writes it. The methods that
+// change cells and RecalculateAll take the write lock, and GetCell,
+// GetPrintableSize, GetNumericValues, PrintValues, PrintTexts and the value
+// and text getters of the cells take the read lock. A reader that keeps a cell
+// pointer between calls holds the read lock meanwhile, since a concurrent
+// ClearCell may delete the cell.
 class Sheet : public SheetInterface {
 public:
+    Sheet();
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // Sets many cells at once, the same as SetCell for each edit in order but
+    // with one cycle check and one cache invalidation for the whole batch.
+    // Either every edit is applied or, when any of them throws, none is.
+    void SetCells(std::vector<std::pair<Position, std::string>> edits);
+    // Same for contents parsed beforehand, e.g. on other threads
+    void SetCellContents(std::vector<std::pair<Position, Cell::Content>> edits);
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
 
+    std::optional<FormulaError> GetNumericValues(Range range, std::vector<double>& values) const override;
+
     Size GetPrintableSize() const override;
 
+    // Drops all cached values and evaluates every formula again. Formulas are
+    // split into levels by the longest chain of formulas below them; a level
+    // reads only the levels before it, so its cells are evaluated in parallel.
+    // `thread_count` 0 means one thread per core. The values do not depend on
+    // the number of threads.
+    void RecalculateAll(size_t thread_count = 0);
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
     const Cell* GetConcreteCell(Position pos) const;
     Cell* GetConcreteCell(Position pos);
 
+    // The counters since the sheet was made or ResetStats was called; all
+    // zero when built without SPREADSHEET_WITH_STATS
+    SheetStats GetStats() const;
+    void ResetStats();
+    StatsRecorder& GetStatsRecorder() const {
+        return stats_;
+    }
+
+    // Creates an empty cell at a missing position for a formula to reference.
+    // Doesn't lock, it is for the writer.
+    void AddPlaceholder(Position pos);
+
+    // std::shared_lock on it keeps the cells of the sheet from changing
+    ReadWriteLock& GetLock() const {
+        return lock_;
+    }
+
+    // shared by the formulas of the sheet and filled from any thread
+    FormulaTemplates& GetFormulaTemplates() const {
+        return formula_templates_;
+    }
+    // the texts of the text cells, interned from any thread
+    TextPool& GetTextPool() const {
+        return text_pool_;
+    }
+
+    const DependencyGraph& GetDependencyGraph() const {
+        return dependencies_;
+    }
+    DependencyGraph& GetDependencyGraph() {
+        return dependencies_;
+    }
+
+    // Calls func(Position, const Cell&) for the existing cells of the range.
+    // Like GetConcreteCell, it doesn't lock: it is for the writer and for the
+    // code that holds the read lock.
+    template <typename Func>
+    void ForEachCellInRange(Range range, Func func) const {
+        cells_.ForEachInRange(range, func);
+    }
+
 
 private:
-    std::vector<std::vector<std::unique_ptr<Cell>>> sheet_;
+    // reads and fills the storage and the graph directly
+    friend class Snapshot;
+
+    // outlives the cells, which hold its texts
+    mutable TextPool text_pool_;
+    CellStorage cells_;
+    PrintableArea printable_area_;
+    DependencyGraph dependencies_;
+    mutable FormulaTemplates formula_templates_;
+    mutable ReadWriteLock lock_;
+    mutable StatsRecorder stats_;
+    std::unique_ptr<ThreadPool> pool_;
 
-    std::unique_ptr<Cell> CreateCell(Position pos, std::string text);
-    void EmplaceCell(Position pos, std::unique_ptr<Cell>& new_cell);
+    // Positions must be valid
+    void ApplyContents(const std::vector<Position>& positions, std::vector<Cell::Content> contents);
+    void UpdatePrintableArea(Position pos, bool was_empty, bool is_empty);
     static void ValidatePosition(Position pos);
 };
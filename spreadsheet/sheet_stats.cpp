@@ -0,0 +1,145 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+using namespace std::literals;
+
+namespace {
+const std::string_view COUNTER_NAMES[] = {
+    "formula_parses"sv, "evaluations"sv,        "cache_hits"sv,        "cache_misses"sv,
+    "invalidated_cells"sv, "cycle_check_nodes"sv, "placeholder_cells"sv, "edits"sv,
+};
+const std::string_view TIMER_NAMES[] = {"parse"sv, "evaluation"sv, "edit"sv};
+static_assert(std::size(COUNTER_NAMES) == SheetStats::COUNTER_COUNT);
+static_assert(std::size(TIMER_NAMES) == SheetStats::TIMER_COUNT);
+
+#ifdef SPREADSHEET_WITH_STATS
+size_t GetBucket(uint64_t ns) {
+    size_t bucket = 0;
+    while (ns > 1 && bucket + 1 < SheetStats::BUCKET_COUNT) {
+        ns >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+#endif
+}  // namespace
+
+std::string_view ToString(SheetCounter counter) {
+    return COUNTER_NAMES[static_cast<size_t>(counter)];
+}
+
+std::string_view ToString(SheetTimer timer) {
+    return TIMER_NAMES[static_cast<size_t>(timer)];
+}
+
+uint64_t SheetStats::Histogram::GetCount() const {
+    uint64_t count = 0;
+    for (uint64_t bucket : buckets) {
+        count += bucket;
+    }
+    return count;
+}
+
+uint64_t SheetStats::Histogram::GetPercentileNs(double percent) const {
+    uint64_t count = GetCount();
+    if (count == 0) {
+        return 0;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(percent / 100 * static_cast<double>(count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if (seen >= rank && buckets[i] > 0) {
+            return uint64_t{2} << i;
+        }
+    }
+    return uint64_t{2} << (BUCKET_COUNT - 1);
+}
+
+void SheetStats::Print(std::ostream& output) const {
+    std::ostringstream text;
+    if (!ENABLED) {
+        text << "statistics are compiled out (SPREADSHEET_WITH_STATS)\n"sv;
+    }
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        text << COUNTER_NAMES[i] << ' ' << counters[i] << '\n';
+    }
+    text << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < TIMER_COUNT; ++i) {
+        const Histogram& histogram = timers[i];
+        uint64_t count = histogram.GetCount();
+        double mean_us = count > 0 ? static_cast<double>(histogram.total_ns) / static_cast<double>(count) / 1000 : 0;
+        text << TIMER_NAMES[i] << "_us count "sv << count << " mean "sv << mean_us << " p50 <"sv
+             << histogram.GetPercentileNs(50) / 1000.0 << " p99 <"sv << histogram.GetPercentileNs(99) / 1000.0
+             << " total "sv << static_cast<double>(histogram.total_ns) / 1000 << '\n';
+    }
+    output << text.str();
+}
+
+SheetStats operator-(const SheetStats& lhs, const SheetStats& rhs) {
+    SheetStats result;
+    for (size_t i = 0; i < SheetStats::COUNTER_COUNT; ++i) {
+        result.counters[i] = lhs.counters[i] - rhs.counters[i];
+    }
+    for (size_t i = 0; i < SheetStats::TIMER_COUNT; ++i) {
+        for (size_t j = 0; j < SheetStats::BUCKET_COUNT; ++j) {
+            result.timers[i].buckets[j] = lhs.timers[i].buckets[j] - rhs.timers[i].buckets[j];
+        }
+        result.timers[i].total_ns = lhs.timers[i].total_ns - rhs.timers[i].total_ns;
+    }
+    return result;
+}
+
+void StatsRecorder::Record(SheetTimer timer, std::chrono::nanoseconds duration) {
+#ifdef SPREADSHEET_WITH_STATS
+    auto ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+    Shard& shard = GetShard();
+    auto index = static_cast<size_t>(timer);
+    shard.buckets[index][GetBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    shard.total_ns[index].fetch_add(ns, std::memory_order_relaxed);
+#else
+    static_cast<void>(timer);
+    static_cast<void>(duration);
+#endif
+}
+
+SheetStats StatsRecorder::Collect() const {
+    SheetStats stats;
+#ifdef SPREADSHEET_WITH_STATS
+    for (const Shard& shard : shards_) {
+        for (size_t i = 0; i < SheetStats::COUNTER_COUNT; ++i) {
+            stats.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < SheetStats::TIMER_COUNT; ++i) {
+            for (size_t j = 0; j < SheetStats::BUCKET_COUNT; ++j) {
+                stats.timers[i].buckets[j] += shard.buckets[i][j].load(std::memory_order_relaxed);
+            }
+            stats.timers[i].total_ns += shard.total_ns[i].load(std::memory_order_relaxed);
+        }
+    }
+#endif
+    return stats;
+}
+
+void StatsRecorder::Reset() {
+#ifdef SPREADSHEET_WITH_STATS
+    for (Shard& shard : shards_) {
+        for (auto& counter : shard.counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for (auto& buckets : shard.buckets) {
+            for (auto& bucket : buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+        for (auto& total : shard.total_ns) {
+            total.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+}
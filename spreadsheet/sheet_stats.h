@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+enum class SheetCounter {
+    // formula texts parsed into cells, whether or not the tree came from a template
+    FormulaParses,
+    // formulas evaluated because they had no cached value
+    Evaluations,
+    // reads of a formula value that found it cached and that didn't
+    CacheHits,
+    CacheMisses,
+    // cached values dropped by edits
+    InvalidatedCells,
+    // cells and ranges the cycle checks expanded
+    CycleCheckNodes,
+    // empty cells created for the references of formulas
+    PlaceholderCells,
+    // cells set or cleared through the sheet
+    Edits,
+    COUNT,
+};
+
+enum class SheetTimer {
+    // Cell::Parse of a formula
+    Parse,
+    // a formula evaluation, including the cells it evaluates on the way; too
+    // frequent to time each, so one in SAMPLE_PERIOD is timed
+    Evaluation,
+    // one SetCell, SetCells, SetCellContents or ClearCell call
+    Edit,
+    COUNT,
+};
+
+std::string_view ToString(SheetCounter counter);
+std::string_view ToString(SheetTimer timer);
+
+// The counters of a sheet at one moment, see Sheet::GetStats. The difference
+// of two snapshots shows what happened in between, e.g. during a slow edit.
+struct SheetStats {
+#ifdef SPREADSHEET_WITH_STATS
+    static constexpr bool ENABLED = true;
+#else
+    static constexpr bool ENABLED = false;
+#endif
+    static const size_t COUNTER_COUNT = static_cast<size_t>(SheetCounter::COUNT);
+    static const size_t TIMER_COUNT = static_cast<size_t>(SheetTimer::COUNT);
+    // bucket i holds the durations of [2^i, 2^(i+1)) ns, bucket 0 also the shorter ones
+    static const size_t BUCKET_COUNT = 40;
+
+    struct Histogram {
+        std::array<uint64_t, BUCKET_COUNT> buckets{};
+        uint64_t total_ns = 0;
+
+        uint64_t GetCount() const;
+        // The upper bound of the bucket the percentile falls into, 0 when empty
+        uint64_t GetPercentileNs(double percent) const;
+    };
+
+    std::array<uint64_t, COUNTER_COUNT> counters{};
+    std::array<Histogram, TIMER_COUNT> timers{};
+
+    uint64_t Get(SheetCounter counter) const {
+        return counters[static_cast<size_t>(counter)];
+    }
+    const Histogram& Get(SheetTimer timer) const {
+        return timers[static_cast<size_t>(timer)];
+    }
+
+    // One line per counter and per timer with its count, mean and percentiles
+    void Print(std::ostream& output) const;
+};
+
+SheetStats operator-(const SheetStats& lhs, const SheetStats& rhs);
+
+// Collects the counters of a sheet from any thread. A thread adds to a shard
+// of its own with relaxed atomics, so readers on other cores don't share the
+// cache lines. Built without SPREADSHEET_WITH_STATS it holds nothing and the
+// recording methods compile to nothing.
+class StatsRecorder {
+public:
+    void Add(SheetCounter counter, uint64_t value = 1) {
+#ifdef SPREADSHEET_WITH_STATS
+        GetShard().counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+#else
+        static_cast<void>(counter);
+        static_cast<void>(value);
+#endif
+    }
+
+    void Record(SheetTimer timer, std::chrono::nanoseconds duration);
+
+    static const unsigned SAMPLE_PERIOD = 16;
+
+    // True for every SAMPLE_PERIOD-th call on a thread
+    static bool ShouldSample() {
+#ifdef SPREADSHEET_WITH_STATS
+        thread_local unsigned calls = 0;
+        return ++calls % SAMPLE_PERIOD == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Records the time from its construction to its destruction
+    class Timer {
+    public:
+        Timer(StatsRecorder& recorder, SheetTimer timer)
+#ifdef SPREADSHEET_WITH_STATS
+            : recorder_(recorder),
+              timer_(timer),
+              start_(std::chrono::steady_clock::now())
+#endif
+        {
+#ifndef SPREADSHEET_WITH_STATS
+            static_cast<void>(recorder);
+            static_cast<void>(timer);
+#endif
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+#ifdef SPREADSHEET_WITH_STATS
+            recorder_.Record(timer_, std::chrono::steady_clock::now() - start_);
+#endif
+        }
+
+#ifdef SPREADSHEET_WITH_STATS
+    private:
+        StatsRecorder& recorder_;
+        SheetTimer timer_;
+        std::chrono::steady_clock::time_point start_;
+#endif
+    };
+
+    SheetStats Collect() const;
+    void Reset();
+
+#ifdef SPREADSHEET_WITH_STATS
+private:
+    static const size_t SHARD_COUNT = 16;
+
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, SheetStats::COUNTER_COUNT> counters{};
+        std::array<std::array<std::atomic<uint64_t>, SheetStats::BUCKET_COUNT>, SheetStats::TIMER_COUNT> buckets{};
+        std::array<std::atomic<uint64_t>, SheetStats::TIMER_COUNT> total_ns{};
+    };
+
+    std::array<Shard, SHARD_COUNT> shards_;
+    // threads take the shards in turn
+    inline static std::atomic<size_t> next_shard_{0};
+
+    Shard& GetShard() {
+        thread_local size_t index = next_shard_.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+        return shards_[index];
+    }
+#endif
+};
@@ -0,0 +1,485 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_HAS_MMAP
+#endif
+
+using namespace std::literals;
+
+namespace {
+using ASTImpl::SerializedNode;
+
+const char MAGIC[8] = {'S', 'P', 'S', 'H', 'E', 'E', 'T', '\0'};
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+// sections start at multiples of it, so their records can be read in place
+const size_t SECTION_ALIGNMENT = 8;
+
+enum SectionKind : uint32_t {
+    CELLS = 1,
+    TEXTS,
+    PROGRAMS,
+    DEPENDANT_LISTS,
+    DEPENDANTS,
+};
+
+enum CellKind : uint32_t {
+    EMPTY,
+    TEXT,
+    FORMULA,
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t section_count;
+    uint32_t reserved;
+};
+
+// `offset` and `size` are in bytes from the start of the file
+struct SectionEntry {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Positions are stored as 16-bit row and column
+static_assert(Position::MAX_ROWS <= INT16_MAX && Position::MAX_COLS <= INT16_MAX);
+static_assert(sizeof(SerializedNode) == 16);
+
+// `count` items starting at `first`: bytes of TEXTS for a text cell, nodes
+// of PROGRAMS for a formula
+struct CellRecord {
+    int16_t row;
+    int16_t col;
+    uint32_t kind;
+    uint32_t first;
+    uint32_t count;
+};
+
+// Direct dependants of a cell, `count` positions of DEPENDANTS from `first`
+struct DependantListRecord {
+    int16_t row;
+    int16_t col;
+    uint32_t first;
+    uint32_t count;
+};
+
+struct PositionRecord {
+    int16_t row;
+    int16_t col;
+};
+
+const std::vector<Range> NO_RANGES;
+
+[[noreturn]] void FailDamaged(const std::string& path, std::string_view what) {
+    throw SnapshotError("Damaged snapshot "s + path + ": "s + std::string(what));
+}
+
+// The whole file, read-only. It is mapped where mmap is available and read
+// into memory elsewhere.
+class FileView {
+public:
+    explicit FileView(const std::string& path) {
+#ifdef SPREADSHEET_HAS_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SnapshotError("Can't open snapshot "s + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw SnapshotError("Can't open snapshot "s + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw SnapshotError("Can't map snapshot "s + path);
+            }
+            // the sections are read front to back
+            madvise(data, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+#else
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            throw SnapshotError("Can't open snapshot "s + path);
+        }
+        // uint64_t elements keep the data aligned for the records
+        input.seekg(0, std::ios::end);
+        size_ = static_cast<size_t>(input.tellg());
+        input.seekg(0);
+        buffer_.resize((size_ + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        input.read(reinterpret_cast<char*>(buffer_.data()), size_);
+        data_ = reinterpret_cast<const char*>(buffer_.data());
+#endif
+    }
+
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+
+    ~FileView() {
+#ifdef SPREADSHEET_HAS_MMAP
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifndef SPREADSHEET_HAS_MMAP
+    std::vector<uint64_t> buffer_;
+#endif
+};
+
+// A section as an array of records; a missing section is empty
+template <typename Record>
+struct SectionView {
+    const Record* data = nullptr;
+    size_t size = 0;
+
+    // Whether [first, first + count) is inside the section
+    bool Contains(uint64_t first, uint64_t count) const {
+        return first <= size && count <= size - first;
+    }
+};
+
+template <typename Record>
+SectionView<Record> FindSection(const FileView& file, const std::string& path, SectionKind kind) {
+    const auto* header = reinterpret_cast<const FileHeader*>(file.GetData());
+    const auto* entries = reinterpret_cast<const SectionEntry*>(header + 1);
+    for (uint32_t i = 0; i < header->section_count; ++i) {
+        const SectionEntry& entry = entries[i];
+        if (entry.kind != kind) {
+            continue;
+        }
+        if (entry.offset % SECTION_ALIGNMENT != 0 || entry.size % sizeof(Record) != 0 ||
+            entry.offset > file.GetSize() || entry.size > file.GetSize() - entry.offset) {
+            FailDamaged(path, "bad section bounds"sv);
+        }
+        return {reinterpret_cast<const Record*>(file.GetData() + entry.offset), entry.size / sizeof(Record)};
+    }
+    return {};
+}
+
+Position ToPosition(int16_t row, int16_t col) {
+    return {row, col};
+}
+
+// Appends the program with the coordinates made relative to `pos`, so the
+// programs of the formulas copied along a row or a column get one key.
+// Returns false when a coordinate is not a valid position; Deserialize
+// rejects such a program.
+bool AppendRelativeProgramKey(const SerializedNode* nodes, size_t count, Position pos, std::string& key) {
+    auto append = [&key](const auto& value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    for (size_t i = 0; i < count; ++i) {
+        const SerializedNode& node = nodes[i];
+        append(node.kind);
+        append(node.function);
+        append(node.arg_count);
+        if (node.kind == SerializedNode::Number) {
+            append(node.number);
+        }
+        else if (node.kind == SerializedNode::Cell || node.kind == SerializedNode::Range) {
+            int corners = node.kind == SerializedNode::Range ? 2 : 1;
+            for (int corner = 0; corner < corners; ++corner) {
+                Position cell = ToPosition(node.coords[2 * corner], node.coords[2 * corner + 1]);
+                if (!cell.IsValid()) {
+                    return false;
+                }
+                append(cell.row - pos.row);
+                append(cell.col - pos.col);
+            }
+        }
+    }
+    return true;
+}
+
+PositionRecord ToRecord(Position pos) {
+    return {static_cast<int16_t>(pos.row), static_cast<int16_t>(pos.col)};
+}
+
+// Offsets in the sections are 32-bit
+uint32_t ToOffset(size_t offset) {
+    if (offset > UINT32_MAX) {
+        throw SnapshotError("Sheet is too large for a snapshot"s);
+    }
+    return static_cast<uint32_t>(offset);
+}
+
+// Collects the sections in memory and writes them after the section table
+class SnapshotWriter {
+public:
+    template <typename Record>
+    void AddSection(SectionKind kind, const std::vector<Record>& records) {
+        sections_.push_back({kind, reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record)});
+    }
+
+    void Write(const std::string& path) const {
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        if (!output) {
+            throw SnapshotError("Can't create snapshot "s + path);
+        }
+        FileHeader header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = Snapshot::VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.section_count = static_cast<uint32_t>(sections_.size());
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        uint64_t offset = AlignUp(sizeof(FileHeader) + sections_.size() * sizeof(SectionEntry));
+        for (const Section& section : sections_) {
+            SectionEntry entry{section.kind, 0, offset, section.size};
+            output.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            offset = AlignUp(offset + section.size);
+        }
+        WritePadding(output);
+        for (const Section& section : sections_) {
+            output.write(section.data, static_cast<std::streamsize>(section.size));
+            WritePadding(output);
+        }
+        if (!output.flush()) {
+            throw SnapshotError("Can't write snapshot "s + path);
+        }
+    }
+
+private:
+    struct Section {
+        SectionKind kind;
+        const char* data;
+        size_t size;
+    };
+    std::vector<Section> sections_;
+
+    static uint64_t AlignUp(uint64_t offset) {
+        return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+
+    static void WritePadding(std::ofstream& output) {
+        static const char ZEROS[SECTION_ALIGNMENT] = {};
+        auto offset = static_cast<uint64_t>(output.tellp());
+        output.write(ZEROS, static_cast<std::streamsize>(AlignUp(offset) - offset));
+    }
+};
+}  // namespace
+
+void Snapshot::Save(const Sheet& sheet, const std::string& path) {
+    std::shared_lock lock(sheet.GetLock());
+    // cells go in row order, so the same sheet always gives the same file
+    std::vector<std::pair<Position, const Cell*>> cells;
+    cells.reserve(sheet.cells_.GetCellCount());
+    sheet.cells_.ForEach([&cells](Position pos, const Cell& cell) {
+        cells.emplace_back(pos, &cell);
+    });
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    std::vector<CellRecord> cell_records;
+    std::vector<char> texts;
+    // the cells of one pooled text share its bytes
+    std::unordered_map<const char*, uint32_t> text_offsets;
+    std::vector<SerializedNode> programs;
+    cell_records.reserve(cells.size());
+    for (const auto& [pos, cell] : cells) {
+        PositionRecord pos_record = ToRecord(pos);
+        CellRecord record{pos_record.row, pos_record.col, EMPTY, 0, 0};
+        if (const FormulaInterface* formula = cell->GetFormula()) {
+            record.kind = FORMULA;
+            record.first = ToOffset(programs.size());
+            formula->GetAST().Serialize(programs, formula->GetASTShift());
+            record.count = ToOffset(programs.size() - record.first);
+        }
+        else if (!cell->IsEmpty()) {
+            std::string_view text = cell->GetTextView();
+            record.kind = TEXT;
+            auto [offset, added] = text_offsets.emplace(text.data(), ToOffset(texts.size()));
+            record.first = offset->second;
+            record.count = ToOffset(text.size());
+            if (added) {
+                texts.insert(texts.end(), text.begin(), text.end());
+            }
+        }
+        cell_records.push_back(record);
+    }
+
+    std::vector<DependantListRecord> list_records;
+    std::vector<PositionRecord> dependants;
+    sheet.dependencies_.ForEachReferencedCell([&](Position pos, const std::vector<Position>& cell_dependants) {
+        PositionRecord pos_record = ToRecord(pos);
+        list_records.push_back({pos_record.row, pos_record.col, ToOffset(dependants.size()),
+                                ToOffset(cell_dependants.size())});
+        for (Position dependant : cell_dependants) {
+            dependants.push_back(ToRecord(dependant));
+        }
+    });
+
+    SnapshotWriter writer;
+    writer.AddSection(CELLS, cell_records);
+    writer.AddSection(TEXTS, texts);
+    writer.AddSection(PROGRAMS, programs);
+    writer.AddSection(DEPENDANT_LISTS, list_records);
+    writer.AddSection(DEPENDANTS, dependants);
+    writer.Write(path);
+}
+
+std::unique_ptr<Sheet> Snapshot::Load(const std::string& path) {
+    FileView file(path);
+    const auto* header = reinterpret_cast<const FileHeader*>(file.GetData());
+    if (file.GetSize() < sizeof(FileHeader) || std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw SnapshotError("Not a snapshot: "s + path);
+    }
+    if (header->byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotError("Snapshot "s + path + " was written with another byte order"s);
+    }
+    if (header->version != VERSION) {
+        throw SnapshotError("Snapshot "s + path + " has unsupported version "s + std::to_string(header->version));
+    }
+    if (header->section_count > (file.GetSize() - sizeof(FileHeader)) / sizeof(SectionEntry)) {
+        FailDamaged(path, "bad section table"sv);
+    }
+    auto cell_records = FindSection<CellRecord>(file, path, CELLS);
+    auto texts = FindSection<char>(file, path, TEXTS);
+    auto programs = FindSection<SerializedNode>(file, path, PROGRAMS);
+    auto list_records = FindSection<DependantListRecord>(file, path, DEPENDANT_LISTS);
+    auto dependants = FindSection<PositionRecord>(file, path, DEPENDANTS);
+
+    auto sheet = std::make_unique<Sheet>();
+    DependencyGraph& graph = sheet->dependencies_;
+    // formula -> referenced cell edges; the index must have each of them once
+    size_t reference_count = 0;
+    std::vector<Position> formulas;
+    // The programs met so far and their trees in the templates of the sheet,
+    // so that a copy is matched without printing its formula
+    FormulaTemplates& sheet_templates = sheet->GetFormulaTemplates();
+    std::unordered_map<std::string, std::pair<std::shared_ptr<const FormulaAST>, Position>> templates;
+    std::string key;
+    for (size_t i = 0; i < cell_records.size; ++i) {
+        const CellRecord& record = cell_records.data[i];
+        Position pos = ToPosition(record.row, record.col);
+        if (!pos.IsValid() || sheet->cells_.Get(pos)) {
+            FailDamaged(path, "bad cell position"sv);
+        }
+        Cell::Content content;
+        if (record.kind == EMPTY) {
+            // the content is empty as it is
+        }
+        else if (record.kind == TEXT && texts.Contains(record.first, record.count) && record.count > 0) {
+            std::string_view text(texts.data + record.first, record.count);
+            if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+                FailDamaged(path, "formula stored as text"sv);
+            }
+            content = Cell::Parse(text, pos, *sheet);
+        }
+        else if (record.kind == FORMULA && programs.Contains(record.first, record.count)) {
+            const SerializedNode* nodes = programs.data + record.first;
+            std::unique_ptr<FormulaInterface> formula;
+            key.clear();
+            bool shareable = AppendRelativeProgramKey(nodes, record.count, pos, key);
+            auto found = shareable ? templates.find(key) : templates.end();
+            if (found != templates.end()) {
+                const auto& [ast, anchor] = found->second;
+                formula = MakeFormula(ast, {pos.row - anchor.row, pos.col - anchor.col});
+            }
+            else {
+                std::shared_ptr<const FormulaAST> ast;
+                try {
+                    ast = std::make_shared<const FormulaAST>(FormulaAST::Deserialize(nodes, record.count));
+                } catch (const ParsingError& error) {
+                    FailDamaged(path, error.what());
+                }
+                if (shareable) {
+                    // formulas set after the load share the tree as well
+                    auto added = templates.emplace(key, sheet_templates.Add(std::move(ast), pos)).first;
+                    const auto& [shared, anchor] = added->second;
+                    formula = MakeFormula(shared, {pos.row - anchor.row, pos.col - anchor.col});
+                }
+                else {
+                    formula = MakeFormula(std::move(ast), {0, 0});
+                }
+            }
+            content = Cell::FromFormula(std::move(formula));
+            reference_count += content.GetReferencedCells().size();
+            formulas.push_back(pos);
+            // range edges are few and are added the usual way
+            graph.UpdateRangeReferences(pos, NO_RANGES, content.GetReferencedRanges());
+        }
+        else {
+            FailDamaged(path, "bad cell record"sv);
+        }
+        const Cell& cell = sheet->cells_.Emplace(pos, std::move(content));
+        sheet->UpdatePrintableArea(pos, true, cell.IsEmpty());
+    }
+
+    graph.Reserve(list_records.size);
+    for (size_t i = 0; i < list_records.size; ++i) {
+        const DependantListRecord& record = list_records.data[i];
+        Position pos = ToPosition(record.row, record.col);
+        if (!pos.IsValid() || !sheet->cells_.Get(pos) || !dependants.Contains(record.first, record.count)) {
+            FailDamaged(path, "bad dependency list"sv);
+        }
+        std::vector<Position> cell_dependants;
+        cell_dependants.reserve(record.count);
+        for (uint64_t j = record.first; j < record.first + record.count; ++j) {
+            Position dependant = ToPosition(dependants.data[j].row, dependants.data[j].col);
+            if (!dependant.IsValid() || (!cell_dependants.empty() && !(cell_dependants.back() < dependant))) {
+                FailDamaged(path, "bad dependency list"sv);
+            }
+            // An edge is kept only if the dependant's formula reads the cell.
+            // The edges are distinct, so with the count checked below the
+            // index holds exactly the references of the formulas.
+            const Cell* reader = sheet->cells_.Get(dependant);
+            if (!reader) {
+                FailDamaged(path, "dependency index doesn't match the formulas"sv);
+            }
+            const std::vector<Position>& references = reader->GetReferencedCellsView();
+            if (!std::binary_search(references.begin(), references.end(), pos)) {
+                FailDamaged(path, "dependency index doesn't match the formulas"sv);
+            }
+            cell_dependants.push_back(dependant);
+        }
+        if (!graph.SetDependants(pos, std::move(cell_dependants))) {
+            FailDamaged(path, "bad dependency list"sv);
+        }
+    }
+    if (graph.GetEdgeCount() != reference_count) {
+        FailDamaged(path, "dependency index doesn't match the formulas"sv);
+    }
+    // a cycle would never finish evaluating; each cell and range is walked once
+    if (Cell::HasCycleFrom(*sheet, formulas)) {
+        FailDamaged(path, "formulas reference each other in a cycle"sv);
+    }
+    return sheet;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Binary image of a sheet. The file is a header, a table of sections and the
+// sections themselves: cell records, a blob of cell texts in which a text of
+// the pool is stored once, the postfix programs of the formulas
+// (FormulaAST::Serialize) and the direct dependency index. Every section is
+// a flat array, so loading maps the file and walks the arrays: no formula
+// text is parsed and no reference lists are merged. Numbers are stored in
+// the byte order of the writer; a reader with another byte order rejects the
+// file.
+//
+// Load checks the structure, so a damaged file is rejected rather than read
+// out of bounds. It also checks the formulas for a cycle once, in one walk
+// over all of them, as a file that doesn't come from Save may hold one.
+class Snapshot {
+public:
+    static const uint32_t VERSION = 1;
+
+    // Throws SnapshotError when the file can't be written
+    static void Save(const Sheet& sheet, const std::string& path);
+    // Throws SnapshotError when the file can't be read, has another version,
+    // its structure is damaged or its formulas make a cycle
+    static std::unique_ptr<Sheet> Load(const std::string& path);
+};
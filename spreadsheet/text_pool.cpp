@@ -0,0 +1,44 @@
+#include "text_pool.h"
+
+#include <cassert>
+#include <cstring>
+#include <new>
+
+TextPool::~TextPool() {
+    assert(texts_.empty());
+}
+
+PooledText* TextPool::Intern(std::string_view text) {
+    std::lock_guard lock(mutex_);
+    auto it = texts_.find(text);
+    if (it != texts_.end()) {
+        ++it->second->references_;
+        return it->second;
+    }
+    PooledText* entry = new (::operator new(sizeof(PooledText) + text.size())) PooledText;
+    entry->pool_ = this;
+    entry->size_ = text.size();
+    entry->references_ = 1;
+    std::memcpy(entry + 1, text.data(), text.size());
+    try {
+        texts_.emplace(entry->GetText(), entry);
+    } catch (...) {
+        ::operator delete(entry);
+        throw;
+    }
+    return entry;
+}
+
+void TextPool::Release(PooledText* text) {
+    TextPool& pool = *text->pool_;
+    std::lock_guard lock(pool.mutex_);
+    if (--text->references_ == 0) {
+        pool.texts_.erase(text->GetText());
+        ::operator delete(text);
+    }
+}
+
+size_t TextPool::GetTextCount() const {
+    std::lock_guard lock(mutex_);
+    return texts_.size();
+}
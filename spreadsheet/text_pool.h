@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+class TextPool;
+
+// A text of the pool; the characters follow it in the same allocation
+class PooledText {
+public:
+    std::string_view GetText() const {
+        return {reinterpret_cast<const char*>(this + 1), size_};
+    }
+
+private:
+    friend class TextPool;
+
+    TextPool* pool_;
+    size_t size_;
+    // the holders of the text, guarded by the mutex of the pool
+    size_t references_;
+};
+
+// The texts of the text cells of a sheet. Equal texts share one entry that
+// counts its holders, so a label repeated over many cells is stored once and
+// two texts of the pool are equal iff they are the same entry. Any thread may
+// intern and release texts.
+class TextPool {
+public:
+    TextPool() = default;
+    TextPool(const TextPool&) = delete;
+    TextPool& operator=(const TextPool&) = delete;
+    // every text must have been released
+    ~TextPool();
+
+    // The entry of the text, with one more holder
+    PooledText* Intern(std::string_view text);
+    // Drops a holder of the text; the last one frees it
+    static void Release(PooledText* text);
+
+    // Distinct texts held
+    size_t GetTextCount() const;
+
+private:
+    mutable std::mutex mutex_;
+    // the keys point into the entries
+    std::unordered_map<std::string_view, PooledText*> texts_;
+};
@@ -0,0 +1,125 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    thread_count = std::max<size_t>(thread_count, 1);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i + 1 < thread_count; ++i) {
+        workers_.emplace_back([this, i] {
+            WorkerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    has_tasks_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& func) {
+    grain = std::max<size_t>(grain, 1);
+    size_t pieces = (count + grain - 1) / grain;
+    if (workers_.empty() || pieces <= 1) {
+        for (size_t begin = 0; begin < count; begin += grain) {
+            func(begin, std::min(count, begin + grain));
+        }
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        // dealt round-robin, so every thread starts with its own share
+        for (size_t piece = 0; piece < pieces; ++piece) {
+            size_t begin = piece * grain;
+            size_t end = std::min(count, begin + grain);
+            Queue& queue = *queues_[piece % queues_.size()];
+            std::lock_guard queue_lock(queue.mutex);
+            queue.tasks.push_back([&func, begin, end] {
+                func(begin, end);
+            });
+        }
+        queued_count_ += pieces;
+        unfinished_count_ += pieces;
+    }
+    has_tasks_.notify_all();
+
+    while (RunTask(queues_.size() - 1)) {
+    }
+    std::unique_lock lock(mutex_);
+    job_done_.wait(lock, [this] {
+        return unfinished_count_ == 0;
+    });
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            has_tasks_.wait(lock, [this] {
+                return stopping_ || queued_count_ > 0;
+            });
+            if (stopping_) {
+                return;
+            }
+        }
+        RunTask(index);
+    }
+}
+
+bool ThreadPool::RunTask(size_t index) {
+    Task task;
+    for (size_t i = 0; i < queues_.size() && !task; ++i) {
+        Queue& queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard queue_lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        // own tasks are taken LIFO, stolen ones FIFO
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    {
+        std::lock_guard lock(mutex_);
+        --queued_count_;
+    }
+
+    try {
+        task();
+    } catch (...) {
+        std::lock_guard lock(mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+
+    std::lock_guard lock(mutex_);
+    if (--unfinished_count_ == 0) {
+        job_done_.notify_all();
+    }
+    return true;
+}
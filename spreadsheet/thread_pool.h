@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing pool. Every worker has its own task deque: it
+// takes tasks from the back of its deque and, once that is empty, steals from
+// the front of the others. The thread that waits for a job runs tasks too, so
+// a pool of N threads starts N - 1 workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const;
+
+    // Calls func(begin, end) for pieces of [0, count) of at most `grain`
+    // items and returns when all of them are done. The first exception thrown
+    // by func is rethrown here.
+    void ParallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& func);
+
+private:
+    using Task = std::function<void()>;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // one queue per worker plus the last one for the waiting thread
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    std::condition_variable job_done_;
+    size_t queued_count_ = 0;
+    size_t unfinished_count_ = 0;
+    std::exception_ptr error_;
+    bool stopping_ = false;
+
+    void WorkerLoop(size_t index);
+    // Runs one task taken from queue `index` or stolen from another one
+    bool RunTask(size_t index);
+};